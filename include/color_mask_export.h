@@ -0,0 +1,49 @@
+#ifndef COLOR_MASK_EXPORT_H
+#define COLOR_MASK_EXPORT_H
+
+#include <QObject>
+#include <QFutureWatcher>
+#include <QStringList>
+#include <atomic>
+
+#include "labels.h"
+
+// Regenerates every _color_mask.png of the given directories from its _watershed_mask.png
+class ColorMaskExportJob : public QObject
+{
+    Q_OBJECT
+
+public:
+    ColorMaskExportJob(const QStringList& directories, const Name2Labels& labels, QObject* parent = Q_NULLPTR);
+
+    void start();
+
+    int total() const
+    {
+        return _files.size();
+    }
+
+public slots:
+    void cancel();
+
+signals:
+    void progressChanged(int value);
+
+    void finished(int exported, bool canceled);
+
+private:
+    static QStringList _listWatershedMasks(const QStringList& directories);
+
+    // The job works on its own copy of the labels, the palette may be edited again while it runs
+    Name2Labels _labels;
+    Id2Labels _idLabels;
+    QStringList _files;
+    std::atomic<int> _exported;
+    QFutureWatcher<void> _watcher;
+};
+
+QString colorMaskPath(const QString& watershedFile);
+
+bool exportColorMask(const QString& watershedFile, const Id2Labels& labels);
+
+#endif //COLOR_MASK_EXPORT_H
@@ -0,0 +1,11 @@
+#ifndef COMMAND_LINE_H
+#define COMMAND_LINE_H
+
+#include <QStringList>
+
+// True when the arguments ask for a batch command instead of the annotation window
+bool isCommandLineInvocation(int argc, char* argv[]);
+
+int runCommandLine(const QStringList& arguments);
+
+#endif //COMMAND_LINE_H
@@ -0,0 +1,48 @@
+#ifndef CONSENSUS_H
+#define CONSENSUS_H
+
+#include <QImage>
+#include <QMap>
+#include <QStringList>
+
+#include "labels.h"
+
+// Agreement of the annotators on one label: pixels they all gave it against pixels any of them gave it
+struct LabelAgreement
+{
+    quint64 unanimous = 0;
+    quint64 any = 0;
+
+    double score() const
+    {
+        return any ? double(unanimous) / any : 1.;
+    }
+};
+
+struct ConsensusResult
+{
+    // Weighted majority vote, Format_Grayscale16
+    QImage labels;
+    // Weight that didn't vote for the winner, 0 when unanimous up to 255, Format_Grayscale8
+    QImage disagreement;
+    QMap<int, LabelAgreement> agreement;
+};
+
+// Weights must be finite and positive
+bool isValidWeight(double weight);
+
+// Merges the id planes of several annotators of the same image, weights default to 1 and invalid ones count as 1
+ConsensusResult computeConsensus(const QVector<QImage>& masks, const QVector<double>& weights = {});
+
+// Colored rendering of a disagreement plane, Format_RGB888
+QImage disagreementHeatMap(const QImage& disagreement);
+
+// Writes the consensus and disagreement maps of every image annotated in all the directories, in parallel.
+// The directories hold the same images, the outputs are named after the images of the first one.
+// Returns the agreement accumulated over the dataset.
+QMap<int, LabelAgreement> runConsensusBatch(const QStringList& annotatorDirs, const QVector<double>& weights,
+                                            const QString& outputDir, const Id2Labels& labels);
+
+QString formatAgreementReport(const QMap<int, LabelAgreement>& agreement, const Id2Labels& labels);
+
+#endif //CONSENSUS_H
@@ -0,0 +1,77 @@
+#ifndef DATASET_INDEX_H
+#define DATASET_INDEX_H
+
+#include <QHash>
+#include <QMap>
+#include <QMutex>
+#include <QSize>
+#include <QImage>
+#include <atomic>
+#include <functional>
+
+#include "labels.h"
+
+// What the index knows about one image of a directory
+struct IndexEntry
+{
+    bool hasMask = false;
+    // Modification time of the newest mask of the image, msecs since epoch
+    qint64 maskModified = 0;
+    QSize size;
+    // Pixel count of every id of the final labels, the watershed mask when there is one
+    QMap<int, quint64> labelPixels;
+};
+
+struct IndexSummary
+{
+    int images = 0;
+    int annotated = 0;
+    quint64 labeledPixels = 0;
+    QMap<int, quint64> labelPixels;
+};
+
+// Persistent per-directory record of the annotation status and class statistics of every image
+class DatasetIndex
+{
+public:
+    explicit DatasetIndex(const QString& root);
+
+    static QString indexPath(const QString& root);
+
+    QString root() const
+    {
+        return _root;
+    }
+
+    bool load();
+
+    bool save();
+
+    // Records the labels of an image that was just saved
+    void update(const QString& imageFile, const QImage& ids);
+
+    // Re-reads, in parallel, the masks that changed since they were indexed and drops removed images.
+    // Returns the number of images that were rescanned.
+    int rescan(const std::atomic<bool>* cancel = Q_NULLPTR, const std::function<void(int, int)>& progress = {});
+
+    IndexSummary summary() const;
+
+    bool isDirty() const
+    {
+        return _dirty;
+    }
+
+private:
+    static IndexEntry _scan(const QString& imageFile);
+
+    QString _root;
+    QHash<QString, IndexEntry> _entries;
+    mutable QMutex _mutex;
+    bool _dirty;
+};
+
+QMap<int, quint64> countLabels(const QImage& ids);
+
+QString formatIndexReport(const IndexSummary& summary, const Id2Labels& labels);
+
+#endif //DATASET_INDEX_H
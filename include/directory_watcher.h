@@ -0,0 +1,45 @@
+#ifndef DIRECTORY_WATCHER_H
+#define DIRECTORY_WATCHER_H
+
+#include <QFileSystemWatcher>
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QStringList>
+#include <QTimer>
+
+// Follows the image files of opened directories while other programs add, remove or replace them.
+// Notifications are batched: a directory changing many times in a row is listed once per batch, and only the
+// difference with its previous listing is reported, so the tree is patched rather than rebuilt.
+class DirectoryWatcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit DirectoryWatcher(QObject* parent = Q_NULLPTR);
+
+    // Starts watching directory, whose image files are images as the tree lists them
+    void addRoot(const QString& directory, const QStringList& images);
+
+    // Files watched for writes in place, e.g. the masks of the open tabs; files that don't exist yet are skipped,
+    // their creation shows up as a directory change
+    void setWatchedFiles(const QStringList& files);
+
+signals:
+    // Image files of directory that appeared or disappeared since the last batch, sorted by name
+    void imagesChanged(const QString& directory, const QStringList& added, const QStringList& removed);
+
+    // A watched file, or a file of a watched directory, may have been written by another program
+    void filesChanged(const QStringList& files);
+
+private:
+    void _flush();
+
+    QFileSystemWatcher _watcher;
+    QHash<QString, QStringList> _images;
+    QSet<QString> _dirtyDirectories;
+    QSet<QString> _dirtyFiles;
+    QTimer _batchTimer;
+};
+
+#endif //DIRECTORY_WATCHER_H
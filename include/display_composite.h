@@ -0,0 +1,14 @@
+#ifndef DISPLAY_COMPOSITE_H
+#define DISPLAY_COMPOSITE_H
+
+#include <QImage>
+#include <QRect>
+#include <QVector>
+
+// Blends RGB888 layers over an RGB888 image inside rect, each at alpha over what is below it, as successive QPainter
+// draws at that opacity did, and writes the result to composite, a Format_ARGB32_Premultiplied buffer of the image
+// size that can be blitted as is. Rows are blended in parallel bands with OpenCV's vectorized kernels.
+void compositeLayers(const QImage& image, const QVector<const QImage*>& layers, double alpha, const QRect& rect,
+                     QImage* composite);
+
+#endif //DISPLAY_COMPOSITE_H
@@ -0,0 +1,58 @@
+#ifndef DISPLAY_MAPPING_H
+#define DISPLAY_MAPPING_H
+
+#include <QImage>
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+// How the native bands of an image are shown on screen
+struct DisplayMapping
+{
+    // Depth the window is expressed in, CV_8U or CV_16U
+    int depth = CV_8U;
+    // Bands shown in red, green and blue
+    int bands[3] = {0, 1, 2};
+    // Native values shown black and white
+    double low = 0;
+    double high = 255;
+    double gamma = 1.;
+};
+
+// Decodes an image at its native depth and band count, CV_8U or CV_16U, other depths are rescaled to 16 bits.
+// Color files come out RGB(A), TIFF band stacks stored one band per page are merged in page order.
+cv::Mat readNativeImage(const QString& file);
+
+// Plain 8-bit RGB is shown as decoded, everything else goes through a display mapping
+bool needsDisplayMapping(const cv::Mat& native);
+
+// First three bands, a single band as gray, windowed on the full range in 8 bits and on the 0.5 and 99.5
+// percentiles of the shown bands in 16 bits
+DisplayMapping defaultDisplayMapping(const cv::Mat& native);
+
+// Whether a mapping chosen on another image can be used as is on native
+bool fitsDisplayMapping(const DisplayMapping& mapping, const cv::Mat& native);
+
+// Window and gamma of a mapping tabulated for every value of its depth
+std::vector<uchar> displayLut(const DisplayMapping& mapping);
+
+// Renders native into display, an RGB888 buffer reused when it already has the right size
+void renderDisplay(const cv::Mat& native, const DisplayMapping& mapping, const std::vector<uchar>& lut,
+                   QImage* display);
+
+struct DecodedImage
+{
+    // RGB888 display buffer
+    QImage display;
+    // Native bands, empty when the display buffer is the decoded image
+    cv::Mat native;
+    DisplayMapping mapping;
+};
+
+// Decodes an image and renders its display buffer, with preferred as mapping when it fits
+DecodedImage decodeImage(const QString& file, const DisplayMapping* preferred = Q_NULLPTR);
+
+// Quick reduced decode for formats that can skip detail while decoding (JPEG DCT scaling),
+// null for the others, which would cost a full decode
+QImage readPreviewImage(const QString& file, int maxSide);
+
+#endif //DISPLAY_MAPPING_H
@@ -0,0 +1,17 @@
+#ifndef EDGE_MAP_H
+#define EDGE_MAP_H
+
+#include <QImage>
+#include <QLine>
+#include <QVector>
+#include <opencv2/core/core.hpp>
+
+// Strong edges of an RGB888 image, CV_8U with 255 on one pixel wide 8-connected Canny edges.
+// Thresholds follow the gradient of the image itself: the strongest 10% of the gradients start edges.
+cv::Mat computeEdgeMap(const QImage& image);
+
+// Part of the disc ImageMask::drawFillCircle(x, y, penSize) covers that its center reaches without crossing an edge,
+// as horizontal spans. The edge pixels bordering that part are included, so the footprint goes up to the edge.
+void appendClippedDisc(const cv::Mat& edges, int x, int y, int penSize, QVector<QLine>* spans);
+
+#endif //EDGE_MAP_H
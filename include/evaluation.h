@@ -0,0 +1,96 @@
+#ifndef EVALUATION_H
+#define EVALUATION_H
+
+#include <QObject>
+#include <QFutureWatcher>
+#include <QMutex>
+#include <QStringList>
+#include <QVector>
+
+#include "labels.h"
+
+// Comparison of annotated masks with gold masks over a dataset
+struct EvaluationResult
+{
+    // Classes of the matrix: the labels of the config in id order, then ids of no label, then watershed borders
+    QStringList classes;
+    // Label id of every class, -1 for the last two
+    QVector<int> ids;
+    // Pixels of gold class row annotated as class column, classes.size() squared
+    QVector<quint64> confusion;
+    // Pixel accuracy of every compared image, by path relative to the roots
+    QVector<QPair<QString, double>> images;
+    // Annotations only in the gold tree, only in the evaluated one, and pairs of different sizes
+    int missing = 0;
+    int extra = 0;
+    int mismatched = 0;
+
+    quint64 at(int gold, int annotated) const
+    {
+        return confusion[gold * classes.size() + annotated];
+    }
+
+    // Intersection over union of a class, -1 when it is in neither mask
+    double iou(int c) const;
+
+    // Mean IoU of the label classes present in either mask
+    double meanIou() const;
+
+    // Pixels given the gold class, watershed borders on either side left out
+    double accuracy() const;
+};
+
+// Pairs the annotations of both trees by relative path and counts the gold class against the annotated class of
+// every pixel. Images are compared in parallel; label ids are turned into class indices through a table built
+// once from the config, so the per-pixel loop only does lookups and counts.
+class EvaluationJob : public QObject
+{
+    Q_OBJECT
+
+public:
+    EvaluationJob(const QString& goldRoot, const QString& annotatedRoot, const Name2Labels& labels,
+                  QObject* parent = Q_NULLPTR);
+
+    void start();
+
+    void waitForFinished();
+
+    // Annotations found in both trees
+    int total() const
+    {
+        return _pairs.size();
+    }
+
+    const EvaluationResult& result() const
+    {
+        return _result;
+    }
+
+public slots:
+    void cancel();
+
+signals:
+    void progressChanged(int value);
+
+    void finished(bool canceled);
+
+private:
+    void _compare(const QString& base);
+
+    QString _goldRoot;
+    QString _annotatedRoot;
+    QStringList _pairs;
+    // Class index of every id
+    QVector<quint16> _classOf;
+    QMutex _mutex;
+    EvaluationResult _result;
+    QFutureWatcher<void> _watcher;
+};
+
+// Per class IoU, precision and recall, then the overall figures
+QString formatEvaluationReport(const EvaluationResult& result);
+
+// Writes evaluation.json, evaluation_classes.csv, evaluation_confusion.csv and evaluation_images.csv
+bool writeEvaluationReports(const EvaluationResult& result, const QString& directory);
+
+#endif //EVALUATION_H
@@ -3,12 +3,53 @@
 
 #include <QLabel>
 #include <QScrollArea>
+#include <QTimer>
+#include <QFutureWatcher>
+#include <QDateTime>
+#include <QRegion>
 
 #include "utils.h"
 #include "image_mask.h"
+#include "stroke_journal.h"
+#include "watershed_cache.h"
+#include "display_mapping.h"
+#include "memory_usage.h"
+#include "edge_map.h"
+#include "job_scheduler.h"
+#include "display_composite.h"
 
 class MainWindow;
 
+// What a tab reads of its annotation when it opens
+struct DecodedMask
+{
+    ImageMask mask;
+    // Content hash of the _watershed_mask.png on disk, 0 when there is none
+    size_t watershedHash = 0;
+};
+
+// What a save job wrote, applied to the canvas once the files are on disk
+struct SavedMask
+{
+    QString imageFile;
+    // Planes as they were when the save started, the canvas edits copies of them meanwhile
+    QImage mask;
+    QImage watershed;
+    int paletteGeneration = -1;
+    // Content hashes of the planes, 0 for a plane that wasn't compared to its file
+    size_t maskHash = 0;
+    size_t watershedHash = 0;
+    QDateTime maskFileTime;
+    bool maskWritten = false;
+    bool watershedWritten = false;
+    bool colorWritten = false;
+    bool maskFailed = false;
+    bool watershedFailed = false;
+    bool colorFailed = false;
+    // The dataset index describes the image by its mask rather than its watershed
+    bool indexMask = false;
+};
+
 class ImageCanvas : public QLabel
 {
     Q_OBJECT
@@ -16,31 +57,95 @@ class ImageCanvas : public QLabel
 public:
     explicit ImageCanvas(QScrollArea* parent, MainWindow* mainWindow);
 
+    ~ImageCanvas() override;
+
     void setLabelColor(int id);
 
     void setActionMask(const ImageMask& mask);
 
     void setWatershedMask(const QImage& watershed);
 
+    // Starts an unannotated image from markers propagated from another frame, undo goes back to the empty mask
+    void seedMask(const QImage& markers);
+
     void setPenSize(int penSize);
 
     ImageMask getMask() const;
 
     QImage getImage() const;
 
+    QString imageFilePath() const
+    {
+        return _imageFilePath;
+    }
+
+    // Decoded bands when the image isn't plain 8-bit RGB, empty otherwise
+    const cv::Mat& nativeImage() const
+    {
+        return _native;
+    }
+
+    DisplayMapping displayMapping() const
+    {
+        return _displayMapping;
+    }
+
+    // Only the lookup table and its pass over the native bands are recomputed
+    void setDisplayMapping(const DisplayMapping& mapping);
+
+    QString maskFilePath() const
+    {
+        return _maskFilePath;
+    }
+
+    // The _mask.png on disk isn't the one this tab last loaded or wrote
+    bool isMaskModifiedExternally() const;
+
+    // Shows a preview right away and decodes the image and its mask in workers, see loaded()
     void loadImage(const QString& filePath);
 
+    // Loads the image again from its files without saving first, after another job rewrote its masks
+    void reloadFromDisk();
+
+    // Image and mask are in, the canvas can be edited
+    bool isLoaded() const
+    {
+        return !_imagePending && !_maskPending;
+    }
+
+    // Blocks until loadImage is done, for callers that need the canvas right away
+    void waitUntilLoaded();
+
+    // Writes the changed planes in a worker, the tab is marked saved once they are on disk
     void saveMask();
 
+    // Blocks until the files of the last saveMask are written, for callers that read them next
+    void waitUntilSaved();
+
+    // A shown tab loads ahead of hidden ones
+    void setShown(bool shown);
+
+    void discardJournal();
+
     void scaleChanged(double scale);
 
     void alphaChanged(double alpha);
 
     void refresh();
 
-    void updateMaskColor(const Id2Labels& labels)
+    void updateMaskColor();
+
+    // Extra layer drawn over the masks, e.g. the disagreement of several annotators
+    void setOverlay(const QImage& overlay);
+
+    bool hasOverlay() const
+    {
+        return !_overlay.isNull();
+    }
+
+    WatershedCache& watershedCache()
     {
-        _mask.updateColor(labels);
+        return _watershedCache;
     }
 
     bool isNotSaved() const
@@ -48,6 +153,21 @@ public:
         return _undoList.size() > 1;
     }
 
+    MemoryUsage memoryUsage() const;
+
+    // Drops what can be computed again: the segmentation cache, the edge map and the loading preview
+    void dropCaches();
+
+    // Starts computing the edge map of the edge-snapping brush in a worker, unless it is there or on its way
+    void prepareEdgeMap();
+
+    // Blocks until the edge map is computed, for callers replaying edge-snapped strokes
+    void waitForEdgeMap();
+
+    // Forgets the oldest undo states beyond the last states ones, never the current state.
+    // Returns whether anything was dropped.
+    bool trimUndo(int states);
+
 protected:
     void mouseMoveEvent(QMouseEvent* event) override;
 
@@ -61,6 +181,12 @@ protected:
 
     void paintEvent(QPaintEvent* event) override;
 
+signals:
+    // Duration of each repaint, used by the input replay harness
+    void painted(qint64 nsecs);
+
+    void loaded();
+
 public slots :
     void clearMask();
 
@@ -73,14 +199,76 @@ private:
 
     void _initPixmap();
 
-    void _drawFillCircle(const QMouseEvent* e);
+    // Pushes the mask on the undo stack as a new step, dropping the undone ones, and journals it
+    void _pushUndoState();
+
+    void _load(const QString& filePath);
+
+    void _drawStroke(const QVector<QPointF>& positions);
+
+    void _scheduleFrame();
+
+    void _processPendingInput();
+
+    void _applyDecodedImage();
+
+    void _applyDecodedMask();
+
+    void _applyEdgeMap();
+
+    void _applySavedMask();
+
+    JobClass _loadClass() const
+    {
+        return _shown ? JobClass::Decode : JobClass::Background;
+    }
+
+    // Blends the parts of the composite that no longer match the planes shown
+    void _updateComposite();
+
+    // An edit in place of the mask, whose color plane had maskKey before it, changed rect
+    void _compositeEdited(qint64 maskKey, const QRect& rect);
 
     QScrollArea* _scrollArea;
     double _scale;
     double _alpha;
+    // Display buffer, the native image through the display mapping when there is one
     QImage _image;
+    cv::Mat _native;
+    DisplayMapping _displayMapping;
+    // Size of the image, known from the file header before it is decoded
+    QSize _imageSize;
+    // Reduced image shown until the decode is done
+    QImage _preview;
+    QFutureWatcher<DecodedImage> _imageLoader;
+    QFutureWatcher<DecodedMask> _maskLoader;
+    // Token of the image and mask decodes, to move them between queues
+    CancelToken _decodeToken;
+    bool _shown;
+    // Strong edges of the display buffer, for the edge-snapping brush
+    cv::Mat _edges;
+    QFutureWatcher<cv::Mat> _edgeLoader;
+    CancelToken _edgeToken;
+    // Display buffer the edge map on its way is computed from
+    qint64 _edgesKey;
+    bool _imagePending;
+    bool _maskPending;
+    QFutureWatcher<SavedMask> _saver;
+    bool _savePending;
     ImageMask _mask;
     ImageMask _watershed;
+    QImage _overlay;
+    // Image with the shown masks and overlay blended at the current alpha, what paintEvent blits
+    QImage _composite;
+    // Cache keys of the planes the composite was blended from, 0 for hidden ones, and the alpha used
+    qint64 _compositeImageKey;
+    qint64 _compositeMaskKey;
+    qint64 _compositeWatershedKey;
+    qint64 _compositeOverlayKey;
+    double _compositeAlpha;
+    // Parts of the composite behind edits made in place since the last paint
+    QRegion _compositeDirty;
+    WatershedCache _watershedCache;
     QList<ImageMask> _undoList;
     bool _undo;
     int _undoIndex;
@@ -88,10 +276,24 @@ private:
     QString _imageFilePath;
     QString _maskFilePath;
     QString _watershedFilePath;
+    int _paletteGeneration;
+    // What the mask files hold, by cache key of the plane written (unchanged buffer) and content hash (same pixels)
+    qint64 _savedMaskKey;
+    size_t _savedMaskHash;
+    qint64 _savedWatershedKey;
+    size_t _savedWatershedHash;
+    // Modification time of the _mask.png this tab last loaded or wrote, invalid when there was none
+    QDateTime _maskFileTime;
+    // Palette the color mask on disk was written with, -1 when it wasn't written by this tab
+    int _savedColorGeneration;
+    StrokeJournal _journal;
     ColorMask _labelColor;
     int _penSize;
     bool _leftButtonPressed;
     bool _rightButtonPressed;
+    // Mouse samples received since the last frame, in widget coordinates
+    QVector<QPointF> _pendingStrokePoints;
+    QTimer _frameTimer;
 };
 
 
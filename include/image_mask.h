@@ -6,28 +6,45 @@
 
 struct ColorMask
 {
-    QColor id;
+    int id;
     QColor color;
 };
 
 struct ImageMask
 {
+    // Label ids, Format_Grayscale16
     QImage id;
+    // Label colors, Format_RGB888
     QImage color;
 
     ImageMask();
 
-    ImageMask(const QString& file, Id2Labels id_labels);
+    ImageMask(const QString& file, const Id2Labels& id_labels);
 
     explicit ImageMask(QSize s);
 
+    int idAt(int x, int y) const;
+
     void drawFillCircle(int x, int y, int pen_size, ColorMask cm);
 
+    void drawFillCircles(const QVector<QPoint>& positions, int pen_size, ColorMask cm);
+
     void drawPixel(int x, int y, ColorMask cm);
 
+    void drawPixels(const QVector<QPoint>& positions, ColorMask cm);
+
+    // Horizontal spans, e.g. brush stamps clipped to the image edges
+    void drawSpans(const QVector<QLine>& spans, ColorMask cm);
+
     void updateColor(const Id2Labels& labels);
 
     void exchangeLabel(int x, int y, const Id2Labels& id_labels, ColorMask cm);
+
+private:
+    // Gives the planes a pooled private buffer before they are written, instead of a heap copy of a shared one
+    void _detach();
+
+    void _fillSpan(int y, int x0, int x1, const ColorMask& cm);
 };
 
 #endif
@@ -0,0 +1,89 @@
+#ifndef INPUT_RECORDER_H
+#define INPUT_RECORDER_H
+
+#include <QFile>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QPointF>
+#include <QMouseEvent>
+#include <QWheelEvent>
+#include <QKeyEvent>
+
+enum class InputRecordType : quint8
+{
+    Image = 0,
+    MousePress,
+    MouseMove,
+    MouseRelease,
+    Wheel,
+    KeyPress,
+    Label
+};
+
+// One canvas input, positions are in canvas coordinates
+struct InputRecord
+{
+    InputRecordType type = InputRecordType::Image;
+    // Milliseconds since the start of the recording
+    qint64 time = 0;
+    QPointF position;
+    int button = 0;
+    int buttons = 0;
+    int modifiers = 0;
+    int key = 0;
+    QPoint angleDelta;
+    int label = 0;
+    // Image path for Image records, typed text for KeyPress records
+    QString text;
+};
+
+// Tool state at the start of a recording, what the recorded input was drawn with
+struct InputSessionSettings
+{
+    int penSize = 0;
+    double scale = 1.;
+    double alpha = 0.;
+    QString engine;
+    bool edgeSnapping = false;
+};
+
+QDataStream& operator<<(QDataStream& out, const InputRecord& record);
+
+QDataStream& operator>>(QDataStream& in, InputRecord& record);
+
+// Records the input received by the canvases to a session file that can be replayed headlessly
+class InputRecorder
+{
+public:
+    bool start(const QString& file, const InputSessionSettings& settings);
+
+    void stop();
+
+    bool isRecording() const
+    {
+        return _file.isOpen();
+    }
+
+    void recordImage(const QString& imageFile);
+
+    void recordMouse(InputRecordType type, const QMouseEvent* event);
+
+    void recordWheel(const QWheelEvent* event);
+
+    void recordKey(const QKeyEvent* event);
+
+    void recordLabel(int id);
+
+private:
+    void _write(InputRecord& record);
+
+    QFile _file;
+    QDataStream _stream;
+    QElapsedTimer _clock;
+};
+
+// settings is left as is for sessions recorded before the header held them
+QVector<InputRecord> readInputSession(const QString& file, bool* ok = Q_NULLPTR,
+                                      InputSessionSettings* settings = Q_NULLPTR);
+
+#endif //INPUT_RECORDER_H
@@ -0,0 +1,21 @@
+#ifndef INPUT_REPLAY_H
+#define INPUT_REPLAY_H
+
+#include <QString>
+#include <QSize>
+
+struct ReplayOptions
+{
+    QString session;
+    // Replaces the recorded images when set
+    QString image;
+    // Generates a random image of this size instead when valid
+    QSize synthetic;
+    // Keeps the recorded pacing between events, needed for frame coalescing to behave as it did live
+    bool realtime = true;
+};
+
+// Replays a recorded session against a hidden main window and prints latency, paint and memory statistics
+int replayInputSession(const ReplayOptions& options);
+
+#endif //INPUT_REPLAY_H
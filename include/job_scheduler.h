@@ -0,0 +1,206 @@
+#ifndef JOB_SCHEDULER_H
+#define JOB_SCHEDULER_H
+
+#include <QFuture>
+#include <QPromise>
+#include <QMutex>
+#include <QSemaphore>
+#include <QThread>
+#include <QWaitCondition>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// Priority classes of the background work, a free worker always takes the first class with work waiting
+enum class JobClass
+{
+    // Segmentation the user is waiting for
+    Interactive,
+    // Decoding the image of a tab and what its tools need
+    Decode,
+    Save,
+    // Prefetch, thumbnails, indexing, batch jobs over whole directories and what hidden tabs load
+    Background,
+    Count
+};
+
+// Flag shared by its copies, a job polls it to stop early and is skipped when it is set before the job starts
+class CancelToken
+{
+public:
+    CancelToken() : _flag(std::make_shared<std::atomic<bool>>(false))
+    {}
+
+    void cancel()
+    {
+        *_flag = true;
+    }
+
+    bool isCanceled() const
+    {
+        return *_flag;
+    }
+
+    // For the APIs polling a flag, segmentation engines and index scans
+    const std::atomic<bool>* flag() const
+    {
+        return _flag.get();
+    }
+
+private:
+    std::shared_ptr<std::atomic<bool>> _flag;
+};
+
+// The one pool every off-GUI-thread task of the tool runs in, so background work can't starve interactive work.
+// Workers take items from per-class queues in priority order, and each class has a limit of running items: by
+// default batch work leaves a worker free for the classes above it. Mapped sequences are split into one item per
+// element that any idle worker claims, and a thread blocking on a mapped sequence works on it too, so jobs can map
+// from inside a worker without deadlocking the pool.
+class JobScheduler
+{
+public:
+    // Intentionally never destroyed, workers may still run while static objects are torn down
+    static JobScheduler& instance();
+
+    int threadCount() const
+    {
+        return static_cast<int>(_workers.size());
+    }
+
+    void setLimit(JobClass jobClass, int limit);
+
+    int limit(JobClass jobClass) const;
+
+    // Moves the jobs run with token that no worker has taken yet to the queue of jobClass, e.g. when the tab they
+    // load is shown or hidden
+    void setJobClass(const CancelToken& token, JobClass jobClass);
+
+    // Runs function in a worker. A job still queued when its future or token is canceled is skipped, its future has
+    // no result then.
+    template<typename Function>
+    QFuture<std::invoke_result_t<Function>> run(JobClass jobClass, Function function,
+                                                const CancelToken& token = CancelToken())
+    {
+        using Result = std::invoke_result_t<Function>;
+        auto promise = std::make_shared<QPromise<Result>>();
+        QFuture<Result> future = promise->future();
+        promise->start();
+        auto batch = std::make_shared<Batch>(jobClass, 1);
+        batch->token = token.flag();
+        batch->work = [promise, function, token](int) mutable-> void
+        {
+            if (token.isCanceled() || promise->isCanceled())
+            {
+                promise->future().cancel();
+                return;
+            }
+            if constexpr (std::is_void_v<Result>)
+            {
+                function();
+            }
+            else
+            {
+                promise->addResult(function());
+            }
+        };
+        batch->finish = [promise]()-> void
+        {
+            promise->finish();
+        };
+        _enqueue(batch);
+        return future;
+    }
+
+    // Calls function on every element of items, which must outlive the job. The progress of the future counts the
+    // elements done, canceling it skips the ones not started.
+    template<typename Sequence, typename Function>
+    QFuture<void> map(JobClass jobClass, Sequence& items, Function function)
+    {
+        auto promise = std::make_shared<QPromise<void>>();
+        QFuture<void> future = promise->future();
+        promise->start();
+        promise->setProgressRange(0, static_cast<int>(items.size()));
+        auto batch = std::make_shared<Batch>(jobClass, static_cast<int>(items.size()));
+        auto done = std::make_shared<std::atomic<int>>(0);
+        // Taken once here, elements must not be looked up through a container that might detach in the workers
+        auto begin = std::begin(items);
+        batch->work = [promise, done, begin, function](int index)-> void
+        {
+            if (!promise->isCanceled())
+            {
+                function(*(begin + index));
+            }
+            promise->setProgressValue(++*done);
+        };
+        batch->finish = [promise]()-> void
+        {
+            promise->finish();
+        };
+        _enqueue(batch);
+        return future;
+    }
+
+    // Same as map, returning once every element is done. The calling thread runs elements as well.
+    template<typename Sequence, typename Function>
+    void blockingMap(JobClass jobClass, Sequence& items, Function function)
+    {
+        QSemaphore finished;
+        auto batch = std::make_shared<Batch>(jobClass, static_cast<int>(items.size()));
+        auto begin = std::begin(items);
+        batch->work = [begin, &function](int index)-> void
+        {
+            function(*(begin + index));
+        };
+        batch->finish = [&finished]()-> void
+        {
+            finished.release();
+        };
+        _enqueue(batch);
+        _help(batch);
+        finished.acquire();
+    }
+
+private:
+    struct Batch
+    {
+        Batch(JobClass jobClass, int count) : jobClass(jobClass), count(count)
+        {}
+
+        JobClass jobClass;
+        int count;
+        // Flag of the token a single job was run with, to find it in the queues again
+        const std::atomic<bool>* token = Q_NULLPTR;
+        // Next element to claim and elements done
+        std::atomic<int> next{0};
+        std::atomic<int> done{0};
+        std::function<void(int)> work;
+        // Called once, by the thread finishing the last element
+        std::function<void()> finish;
+    };
+
+    JobScheduler();
+
+    void _enqueue(const std::shared_ptr<Batch>& batch);
+
+    // Claims the next element of the first class with work waiting and room under its limit
+    bool _take(std::shared_ptr<Batch>* batch, int* index);
+
+    static void _runElement(const std::shared_ptr<Batch>& batch, int index);
+
+    // Runs the elements of batch no worker has claimed yet in the calling thread
+    static void _help(const std::shared_ptr<Batch>& batch);
+
+    void _work();
+
+    mutable QMutex _mutex;
+    QWaitCondition _wake;
+    std::deque<std::shared_ptr<Batch>> _queues[static_cast<int>(JobClass::Count)];
+    int _running[static_cast<int>(JobClass::Count)];
+    int _limits[static_cast<int>(JobClass::Count)];
+    std::vector<std::unique_ptr<QThread>> _workers;
+};
+
+#endif //JOB_SCHEDULER_H
@@ -0,0 +1,66 @@
+#ifndef LABEL_LIST_MODEL_H
+#define LABEL_LIST_MODEL_H
+
+#include <QAbstractListModel>
+#include <QHash>
+#include <QStyledItemDelegate>
+
+#include "labels.h"
+
+// Labels of the config in name order, one row per label. Rows are looked up by id in constant time.
+class LabelListModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+public:
+    enum Role
+    {
+        IdRole = Qt::UserRole,
+        NameRole,
+        // Name and category, what the search matches
+        SearchRole
+    };
+
+    explicit LabelListModel(QObject* parent = Q_NULLPTR);
+
+    // Shortcut texts of the first rows, e.g. "1" or "Ctrl+3"
+    void setLabels(const Name2Labels& labels, const QStringList& shortcuts);
+
+    // Replaces the label of the same id, only its row is repainted
+    void updateLabel(const LabelInfo& label);
+
+    // Row of a label id, -1 when there is none
+    int rowOfId(int id) const
+    {
+        return _rows.value(id, -1);
+    }
+
+    const LabelInfo& labelAt(int row) const
+    {
+        return _labels[row];
+    }
+
+    int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+
+    QVariant data(const QModelIndex& index, int role) const override;
+
+private:
+    QVector<LabelInfo> _labels;
+    QStringList _shortcuts;
+    QHash<int, int> _rows;
+};
+
+// Paints each label as a swatch of its color, the current one highlighted with the inverse color
+class LabelItemDelegate : public QStyledItemDelegate
+{
+    Q_OBJECT
+
+public:
+    using QStyledItemDelegate::QStyledItemDelegate;
+
+    void paint(QPainter* painter, const QStyleOptionViewItem& option, const QModelIndex& index) const override;
+
+    QSize sizeHint(const QStyleOptionViewItem& option, const QModelIndex& index) const override;
+};
+
+#endif //LABEL_LIST_MODEL_H
@@ -0,0 +1,139 @@
+#ifndef LABEL_REMAP_H
+#define LABEL_REMAP_H
+
+#include <QObject>
+#include <QFile>
+#include <QFutureWatcher>
+#include <QJsonObject>
+#include <QMutex>
+#include <QSet>
+#include <QStringList>
+#include <atomic>
+
+#include "labels.h"
+
+// Reads "polegroup=pole,other=unlabeled", old label name to new label name
+bool parseLabelMerges(const QString& text, QMap<QString, QString>* merges, QString* error);
+
+// Old id -> new id table of a taxonomy change, 65536 entries: every label of from goes to the label of to with the
+// same name, or to the one merges names for it. Ids that aren't labels of from and the watershed border are kept.
+// Returns false with the labels left without a match in error.
+bool configRemap(const Name2Labels& from, const Name2Labels& to, const QMap<QString, QString>& merges,
+                 QVector<quint16>* remap, QString* error);
+
+// Rewrites the _mask.png, _watershed_mask.png and _color_mask.png of every annotated image of the given directories
+// through a remap table. Each image is read, remapped and written by one worker, so memory stays bounded by the pool
+// size however large the dataset is; files are replaced atomically and only when their content changes. A dry run
+// writes nothing and only counts the pixels that would change.
+// A remap isn't idempotent (ids may be swapped), so every file written is logged in the .pixel_annotation_remap of
+// its directory: a run that failed or was canceled is finished by running the same remap again, which skips the
+// logged files. The logs are removed once every image is remapped.
+class LabelRemapJob : public QObject
+{
+    Q_OBJECT
+
+public:
+    LabelRemapJob(const QStringList& directories, const QVector<quint16>& remap, const Name2Labels& from,
+                  const Name2Labels& to, bool dryRun, QObject* parent = Q_NULLPTR);
+
+    ~LabelRemapJob() override;
+
+    // Not empty when a directory holds the log of an unfinished remap with another table, the job must not run
+    QString error() const
+    {
+        return _error;
+    }
+
+    void start();
+
+    void waitForFinished();
+
+    int total() const
+    {
+        return _files.size();
+    }
+
+    // Files an earlier run of the same remap already wrote
+    int skipped() const
+    {
+        return _done.size();
+    }
+
+    // Finished with every image remapped, not a dry run
+    bool isComplete() const;
+
+    // The labels, the id table and the outcome of the remap, as saveRemapRecord writes it
+    QJsonObject record() const;
+
+    bool isDryRun() const
+    {
+        return _dryRun;
+    }
+
+    // Images with at least one pixel remapped
+    int changed() const
+    {
+        return _changed;
+    }
+
+    // Files that couldn't be written
+    int failed() const
+    {
+        return _failed;
+    }
+
+    // CSV of every label whose id changes and its pixel count in the manual and watershed masks
+    QString report() const;
+
+public slots:
+    void cancel();
+
+signals:
+    void progressChanged(int value);
+
+    void finished(int changed, bool canceled);
+
+private:
+    // Remaps a plane in place and adds the pixels changed per old id to counts, false when none did
+    bool _remapPlane(QImage* plane, qint64* counts) const;
+
+    void _remapImage(const QString& imageFile);
+
+    // Logs a file written for good, false when the log couldn't be written
+    bool _logWritten(const QString& file);
+
+    // Removes the logs of a complete remap, keeps the others for the next run
+    void _closeLogs();
+
+    QStringList _directories;
+    QStringList _files;
+    QVector<quint16> _remap;
+    Name2Labels _from;
+    Name2Labels _to;
+    Id2Labels _toIds;
+    bool _dryRun;
+    // The colors change for ids that keep their value, every color mask is written again
+    bool _recolor;
+    // Old ids the table changes, and their slot in the counts
+    QVector<quint16> _changedIds;
+    QVector<int> _slots;
+    QMutex _countsMutex;
+    QVector<qint64> _maskPixels;
+    QVector<qint64> _watershedPixels;
+    std::atomic<int> _changed;
+    std::atomic<int> _failed;
+    // "old=new" pairs of the table, the first line of the logs after their header
+    QString _tableLine;
+    QSet<QString> _done;
+    QString _error;
+    QMutex _logMutex;
+    QMap<QString, QFile*> _logs;
+    bool _logsClosed;
+    QFutureWatcher<void> _watcher;
+};
+
+// Writes the record of job next to configFile, as <config>_remap.json, whether or not every image was remapped;
+// once they all are, configFile is replaced by the new labels. Returns false with the file that failed in error.
+bool saveRemapRecord(const QString& configFile, const LabelRemapJob& job, QString* error);
+
+#endif //LABEL_REMAP_H
@@ -1,8 +1,9 @@
 #ifndef LABELS_H
 #define LABELS_H
 
-#include <QListWidgetItem>
+#include <QMap>
 #include <QJsonObject>
+#include <QColor>
 
 class LabelInfo
 {
@@ -12,7 +13,6 @@ public:
     int id;
     int id_category;
     QColor color;
-    QListWidgetItem* item;
 
     LabelInfo();
 
@@ -31,11 +31,49 @@ public:
     void write(QJsonObject& json) const;
 };
 
-class Id2Labels : public QMap<int, const LabelInfo*>
-{};
+// Label ids are stored on 16 bits, the last value marks the borders produced by the watershed
+constexpr int MAX_LABEL_ID = 0xFFFE;
+constexpr quint16 WATERSHED_BORDER_ID = 0xFFFF;
+
+// Dense id -> label table, indexed directly by the values of the id planes
+class Id2Labels
+{
+public:
+    Id2Labels();
+
+    void insert(int id, const LabelInfo* label);
+
+    const LabelInfo* value(int id) const
+    {
+        return id >= 0 && id < _labels.size() ? _labels[id] : Q_NULLPTR;
+    }
+
+    const LabelInfo* operator[](int id) const
+    {
+        return value(id);
+    }
+
+    bool contains(int id) const
+    {
+        return value(id) != Q_NULLPTR;
+    }
+
+    // One entry for every possible id, unknown ids are white
+    const QRgb* palette() const
+    {
+        return _palette.constData();
+    }
+
+private:
+    QVector<const LabelInfo*> _labels;
+    QVector<QRgb> _palette;
+};
 
 Id2Labels getId2Label(const Name2Labels& labels);
 
 Name2Labels defaultLabels();
 
+// Reads a config file written by "Save config file"
+bool readLabelsFile(const QString& file, Name2Labels* labels);
+
 #endif
@@ -10,6 +10,19 @@
 
 #include "ui_main_window.h"
 #include "image_canvas.h"
+#include "color_mask_export.h"
+#include "input_recorder.h"
+#include "dataset_index.h"
+#include "segmentation_engine.h"
+#include "sequence_propagation.h"
+#include "label_list_model.h"
+#include "directory_watcher.h"
+
+#include <QFuture>
+#include <QPointer>
+#include <QSortFilterProxyModel>
+#include <QTableWidget>
+#include <optional>
 
 QT_BEGIN_NAMESPACE
 
@@ -38,12 +51,45 @@ private:
 
     void openDirectory();
 
+    // Patches the children of the tree items of directory instead of listing it again
+    void updateDirectoryTree(const QString& directory, const QStringList& added, const QStringList& removed);
+
+    void checkExternalMasks(const QStringList& files);
+
+    // The masks of the open tabs are watched for writes in place
+    void updateWatchedMasks();
+
     void registerShortcuts();
 
     ImageCanvas* getCanvasByIndex(int index) const;
 
     ImageCanvas* getCurrentImageCanvas();
 
+    // Runs slow engines off the GUI thread behind a cancelable progress dialog, null when canceled
+    // Segments native instead of image when it isn't empty
+    QImage runSegmentationEngine(const SegmentationEngine* engine, const QImage& image, const cv::Mat& native,
+                                 const QImage& markers);
+
+    // File offset places away from an image in the tree of its directory, empty past either end
+    QString neighborFile(const QString& imageFile, int offset) const;
+
+    PropagationRequest propagationRequest(const ImageCanvas* from, const QString& nextFile) const;
+
+    // Starts a freshly opened frame from the markers of the frame before it
+    void seedFromPreviousFrame(ImageCanvas* ic, const ImageCanvas* previous);
+
+    // Memory held by every tab, by tab index, and by the whole window in total
+    QVector<MemoryUsage> tabMemoryUsage(MemoryUsage* total) const;
+
+    // Drops caches then undo states, background tabs first, until total fits the budget. Returns the new total.
+    qint64 enforceMemoryBudget(qint64 total);
+
+    // Asks before opening an image that would go over the memory budget
+    bool confirmMemoryForImage(const QString& filePath);
+
+    // Directories opened in the tree
+    QStringList openedDirectories() const;
+
     ImageMask copiedMask;
     QVector<QShortcut*> shortcuts;
     bool isLoadingNewLabels;
@@ -52,6 +98,11 @@ public:
     ImageCanvas* imageCanvas_;
     Name2Labels labels;
     Id2Labels id_labels;
+    LabelListModel* labelModel;
+    // Search of the label panel
+    QSortFilterProxyModel* labelFilter;
+    // Bumped on every palette change, canvases compare it to recolor lazily
+    int paletteGeneration;
     QAction* save_action;
     QAction* copy_mask_action;
     QAction* paste_mask_action;
@@ -62,17 +113,64 @@ public:
     QAction* redo_action;
     QAction* next_file_action;
     QAction* previous_file_action;
+    QAction* export_color_masks_action;
+    QAction* export_shards_action;
+    QAction* remap_labels_action;
+    QAction* evaluate_action;
+    QAction* record_input_action;
+    QAction* dataset_statistics_action;
+    QAction* disagreement_action;
+    QAction* sequence_mode_action;
+    QAction* sequence_global_motion_action;
+    QAction* display_mapping_action;
+    QAction* memory_usage_action;
+    QAction* edge_snapping_action;
+    QAction* memory_budget_action;
+    InputRecorder inputRecorder;
+    // Index of every opened directory, by path
+    QMap<QString, DatasetIndex*> datasetIndexes;
+    CancelToken indexingToken;
+    QList<QFuture<void>> indexingJobs;
+    QTimer indexSaveTimer;
+    // Opened directories followed while files are added to them
+    DirectoryWatcher directoryWatcher;
+    // Run times in ms of each segmentation engine during this session
+    QMap<QString, QVector<qint64>> engineTimings;
+    SequencePrefetcher sequencePrefetcher;
+    // Last band mapping and window chosen, applied to the next images it fits
+    std::optional<DisplayMapping> displayMapping;
+    // Delays preparing the next frame until the edits of the current one settle
+    QTimer sequenceTimer;
+    // Bytes the open tabs and the clipboard may hold before caches and undo states are dropped
+    qint64 memoryBudget;
+    QTimer memoryTimer;
+    QLabel* memoryLabel;
+    QPointer<QTableWidget> memoryTable;
     QString curr_open_dir;
+    // Config file the labels were loaded from or saved to, empty for the default labels
+    QString config_file;
 
     QString currentDir() const;
 
     QString currentFile() const;
 
+    // Opens an image in a new tab and makes it current
+    ImageCanvas* openImage(const QString& filePath);
+
+    void indexSavedMask(const QString& imageFile, const QImage& ids);
+
     void initCanvasConnection(const ImageCanvas* ic);
 
     void allDisconnect(const ImageCanvas* ic);
 
-    void setStarAtNameOfTab(bool star);
+    // Marks the tab of ic, the current one by default
+    void setStarAtNameOfTab(bool star, const ImageCanvas* ic = Q_NULLPTR);
+
+    // Marks the tab of ic when its _mask.png was written by another program since it was loaded or saved
+    void updateExternalMaskFlag(ImageCanvas* ic);
+
+    // Makes a label current in the label panel, clearing a search that hides it
+    void selectLabel(int id);
 
     void dragEnterEvent(QDragEnterEvent* e) override;
 
@@ -82,14 +180,40 @@ protected:
     void closeEvent(QCloseEvent* event) override;
 
 public slots:
-    void changeLabel(QListWidgetItem*, QListWidgetItem*);
+    void changeLabel(const QModelIndex& current);
 
-    void changeColor(QListWidgetItem*);
+    void changeColor(const QModelIndex& index);
 
     void saveConfigFile();
 
     void loadConfigFile();
 
+    void exportColorMasks();
+
+    void exportShards();
+
+    void remapLabels();
+
+    void evaluateAgainstGold();
+
+    void recordInput(bool checked);
+
+    void showDatasetStatistics();
+
+    void showDisagreement(bool checked);
+
+    void prefetchNextFrame();
+
+    void editDisplayMapping();
+
+    void updateMemoryUsage();
+
+    void showMemoryUsage();
+
+    void editMemoryBudget();
+
+    void saveDatasetIndexes();
+
     void runWatershed();
 
     void swapView();
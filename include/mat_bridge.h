@@ -0,0 +1,22 @@
+#ifndef MAT_BRIDGE_H
+#define MAT_BRIDGE_H
+
+#include <QImage>
+#include <opencv2/core/core.hpp>
+
+// Views between QImage and cv::Mat sharing the same pixels.
+// Every 3-channel buffer of the tool is RGB, channels are only swapped when files are decoded.
+
+// Read-only header over the pixels of image, valid as long as image is neither destroyed nor written to
+cv::Mat matView(const QImage& image);
+
+// Writable header over the pixels of image, which is detached first
+cv::Mat mutableMatView(QImage& image);
+
+// Image over the pixels of mat, the buffer is kept alive until the last copy of the image is gone
+QImage qImageView(const cv::Mat& mat);
+
+// Decodes an 8-bit color image straight into RGB, null when the file can't be read
+QImage readRgbImage(const QString& file);
+
+#endif //MAT_BRIDGE_H
@@ -0,0 +1,65 @@
+#ifndef MEMORY_USAGE_H
+#define MEMORY_USAGE_H
+
+#include <QImage>
+#include <QPixmap>
+#include <QSet>
+#include <opencv2/core/core.hpp>
+
+enum class MemoryCategory
+{
+    // Display buffer, native bands and loading preview
+    Image,
+    Pixmap,
+    Mask,
+    Watershed,
+    Undo,
+    // Segmentation results and overlays that can be computed again
+    Cache,
+    Clipboard,
+    // Free buffers kept by the plane pool for reuse
+    Pool,
+    Count
+};
+
+QString memoryCategoryName(MemoryCategory category);
+
+// Bytes held per category. Implicitly shared buffers are counted once, by the first category they are added to,
+// so undo states still sharing the current mask cost nothing.
+class MemoryUsage
+{
+public:
+    MemoryUsage();
+
+    void add(MemoryCategory category, const QImage& image);
+
+    void add(MemoryCategory category, const QPixmap& pixmap);
+
+    void add(MemoryCategory category, const cv::Mat& mat);
+
+    void addBytes(MemoryCategory category, qint64 bytes);
+
+    // Whether the buffer of image is already counted
+    bool holds(const QImage& image) const;
+
+    qint64 bytes(MemoryCategory category) const
+    {
+        return _bytes[static_cast<int>(category)];
+    }
+
+    qint64 total() const;
+
+    MemoryUsage& operator+=(const MemoryUsage& other);
+
+private:
+    qint64 _bytes[static_cast<int>(MemoryCategory::Count)];
+    QSet<qint64> _images;
+    QSet<const void*> _mats;
+};
+
+// Rough footprint of a tab on an image of that size once loaded: display buffer, mask, watershed and one undo state
+qint64 estimatedTabBytes(const QSize& imageSize);
+
+QString formatMegabytes(qint64 bytes);
+
+#endif //MEMORY_USAGE_H
@@ -0,0 +1,64 @@
+#ifndef PLANE_POOL_H
+#define PLANE_POOL_H
+
+#include <QImage>
+#include <QMap>
+#include <QMutex>
+#include <QVector>
+#include <opencv2/core/core.hpp>
+
+// Recycles the full-size buffers of masks, images and segmentation temporaries.
+// Sizes are rounded up to buckets an eighth of a power of two apart, so planes of images of about the same size share
+// buffers. A buffer goes back to the pool when the last QImage or cv::Mat over it is gone; free buffers are kept up
+// to a budget, the least recently returned ones are freed first. Small buffers go straight to the heap.
+class PlanePool
+{
+public:
+    static PlanePool& instance();
+
+    explicit PlanePool(qint64 budgetBytes = 512 * 1024 * 1024);
+
+    ~PlanePool();
+
+    PlanePool(const PlanePool&) = delete;
+
+    PlanePool& operator=(const PlanePool&) = delete;
+
+    // Uninitialized image whose buffer comes from the pool
+    QImage image(const QSize& size, QImage::Format format);
+
+    // Pooled copy of image, e.g. a private buffer to write to instead of detaching into the heap
+    QImage copy(const QImage& image);
+
+    // Uninitialized matrix whose buffer comes from the pool
+    cv::Mat mat(int rows, int cols, int type);
+
+    // Allocator to set on a cv::Mat before OpenCV creates it, e.g. as the output of convertTo
+    cv::MatAllocator* matAllocator();
+
+    // Bytes of the free buffers held for reuse
+    qint64 freeBytes() const;
+
+    // Frees every buffer held for reuse
+    void trim();
+
+private:
+    friend class PooledMatAllocator;
+
+    static qsizetype _bucket(qsizetype bytes);
+
+    uchar* _take(qsizetype bytes, qsizetype* capacity);
+
+    void _give(uchar* data, qsizetype capacity);
+
+    mutable QMutex _mutex;
+    // Free buffers by capacity, most recently returned last
+    QMap<qsizetype, QVector<uchar*>> _free;
+    // Capacities of the free buffers in the order they were returned
+    QVector<qsizetype> _returned;
+    qint64 _freeBytes;
+    qint64 _budget;
+    cv::MatAllocator* _matAllocator;
+};
+
+#endif //PLANE_POOL_H
@@ -0,0 +1,135 @@
+#ifndef SEGMENTATION_ENGINE_H
+#define SEGMENTATION_ENGINE_H
+
+#include <QImage>
+#include <QVector>
+#include <opencv2/core/core.hpp>
+#include <atomic>
+#include <functional>
+
+// Turns the strokes of the manual mask into a label for every pixel
+class SegmentationEngine
+{
+public:
+    virtual ~SegmentationEngine() = default;
+
+    virtual QString name() const = 0;
+
+    // Fast enough to run on the GUI thread after every edit
+    virtual bool isInteractive() const
+    {
+        return false;
+    }
+
+    // Labels an RGB888 image from a Grayscale16 marker plane where 0 is unlabeled.
+    // Returns a Grayscale16 plane, WATERSHED_BORDER_ID where the engine draws boundaries, null when canceled.
+    // Progress goes from 0 to 1 and may be reported from any thread.
+    virtual QImage segment(const QImage& image, const QImage& markers, const std::atomic<bool>* cancel = Q_NULLPTR,
+                           const std::function<void(double)>& progress = {}) const = 0;
+
+    // Same on the native bands of an image, any band count, CV_8U or CV_16U.
+    // By default the first three bands are stretched to 8 bits over their full range and segmented as RGB.
+    virtual QImage segmentNative(const cv::Mat& native, const QImage& markers,
+                                 const std::atomic<bool>* cancel = Q_NULLPTR,
+                                 const std::function<void(double)>& progress = {}) const;
+};
+
+// cv::watershed, the historical behavior
+class WatershedEngine : public SegmentationEngine
+{
+public:
+    QString name() const override
+    {
+        return "Watershed";
+    }
+
+    bool isInteractive() const override
+    {
+        return true;
+    }
+
+    QImage segment(const QImage& image, const QImage& markers, const std::atomic<bool>* cancel = Q_NULLPTR,
+                   const std::function<void(double)>& progress = {}) const override;
+
+    // Flooding of the gradient magnitude of all the bands, at 16-bit precision
+    QImage segmentNative(const cv::Mat& native, const QImage& markers, const std::atomic<bool>* cancel = Q_NULLPTR,
+                         const std::function<void(double)>& progress = {}) const override;
+};
+
+// One GrabCut per label, the label's strokes as foreground and the other labels' as background.
+// Pixels claimed by no label or by several are settled by a watershed seeded with the undisputed ones.
+class GrabCutEngine : public SegmentationEngine
+{
+public:
+    explicit GrabCutEngine(int iterations = 3) : _iterations(iterations)
+    {}
+
+    QString name() const override
+    {
+        return "GrabCut";
+    }
+
+    QImage segment(const QImage& image, const QImage& markers, const std::atomic<bool>* cancel = Q_NULLPTR,
+                   const std::function<void(double)>& progress = {}) const override;
+
+private:
+    int _iterations;
+};
+
+// Random walker of Grady, each pixel gets the label a random walk from it most likely reaches first.
+// The systems are solved by preconditioned conjugate gradient started from the watershed labels,
+// so a bounded number of iterations only has to move the boundaries.
+class RandomWalkerEngine : public SegmentationEngine
+{
+public:
+    explicit RandomWalkerEngine(double beta = 90., int maxIterations = 300, double tolerance = 1e-3)
+        : _beta(beta), _maxIterations(maxIterations), _tolerance(tolerance)
+    {}
+
+    QString name() const override
+    {
+        return "Random walker";
+    }
+
+    QImage segment(const QImage& image, const QImage& markers, const std::atomic<bool>* cancel = Q_NULLPTR,
+                   const std::function<void(double)>& progress = {}) const override;
+
+private:
+    double _beta;
+    int _maxIterations;
+    double _tolerance;
+};
+
+// cv::watershed tile by tile, for images whose full-size temporaries don't fit in memory.
+// A watershed on a reduced copy of the image seeds the inside of its regions in every tile, so each tile floods only
+// the bands around the coarse boundaries and tiles without strokes still get labels. Tiles overlap so the flooding
+// near a seam sees the same context from both sides; ids are label ids, the same in every tile, so stitching is
+// copying the core of each tile. Only as many tiles as threads are held at once.
+class TiledWatershedEngine : public SegmentationEngine
+{
+public:
+    explicit TiledWatershedEngine(int tileSize = 2048, int overlap = 128, int coarseSize = 2048)
+        : _tileSize(tileSize), _overlap(overlap), _coarseSize(coarseSize)
+    {}
+
+    QString name() const override
+    {
+        return "Tiled watershed";
+    }
+
+    QImage segment(const QImage& image, const QImage& markers, const std::atomic<bool>* cancel = Q_NULLPTR,
+                   const std::function<void(double)>& progress = {}) const override;
+
+private:
+    int _tileSize;
+    int _overlap;
+    int _coarseSize;
+};
+
+// Every available engine, watershed first
+const QVector<const SegmentationEngine*>& segmentationEngines();
+
+// Engine by name, the watershed when there is none of that name
+const SegmentationEngine* findSegmentationEngine(const QString& name);
+
+#endif //SEGMENTATION_ENGINE_H
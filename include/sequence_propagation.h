@@ -0,0 +1,86 @@
+#ifndef SEQUENCE_PROPAGATION_H
+#define SEQUENCE_PROPAGATION_H
+
+#include <QObject>
+#include <QFutureWatcher>
+#include <QImage>
+#include <atomic>
+
+#include "labels.h"
+#include "segmentation_engine.h"
+
+enum class MotionModel
+{
+    // Farneback dense optical flow, follows independently moving objects
+    DenseFlow,
+    // One translation from phase correlation, enough for panning cameras and much cheaper
+    GlobalShift
+};
+
+// Markers of the previous frame moved onto the next one, Format_Grayscale16, null when the frames differ in size
+QImage propagateMarkers(const QImage& previousImage, const QImage& previousMarkers, const QImage& nextImage,
+                        MotionModel model);
+
+// Markers propagated to a frame together with their segmentation
+struct PropagatedFrame
+{
+    QString imageFile;
+    QImage markers;
+    // Border already removed unless it is kept
+    QImage labels;
+    // Watershed cache key of the markers
+    quint64 cacheKey = 0;
+    // Key of the markers they were propagated from
+    quint64 sourceKey = 0;
+};
+
+struct PropagationRequest
+{
+    QImage previousImage;
+    QImage previousMarkers;
+    QString nextFile;
+    const SegmentationEngine* engine = Q_NULLPTR;
+    bool keepBorder = false;
+    Id2Labels labels;
+    MotionModel model = MotionModel::DenseFlow;
+};
+
+// Prepares the next frame of a sequence in the background while the current one is edited.
+// Only the latest request matters, a new one cancels the running one.
+class SequencePrefetcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit SequencePrefetcher(QObject* parent = Q_NULLPTR);
+
+    ~SequencePrefetcher() override;
+
+    void request(const PropagationRequest& request);
+
+    // Hands over the frame prepared for an image, false when none is ready or a newer request is on its way
+    bool take(const QString& imageFile, PropagatedFrame* frame);
+
+    void cancel();
+
+    // Runs a request on the calling thread, an empty frame when the next frame is already annotated or on cancel
+    static PropagatedFrame propagate(const PropagationRequest& request, const std::atomic<bool>* cancel = Q_NULLPTR);
+
+    static quint64 sourceKey(const QImage& markers);
+
+signals:
+    void ready(const QString& imageFile);
+
+private:
+    void _start();
+
+    void _finished();
+
+    std::atomic<bool> _cancel;
+    bool _hasPending;
+    PropagationRequest _pending;
+    PropagatedFrame _result;
+    QFutureWatcher<PropagatedFrame> _watcher;
+};
+
+#endif //SEQUENCE_PROPAGATION_H
@@ -0,0 +1,101 @@
+#ifndef SHARD_EXPORT_H
+#define SHARD_EXPORT_H
+
+#include <QObject>
+#include <QFutureWatcher>
+#include <QSize>
+#include <QStringList>
+#include <atomic>
+
+#include "labels.h"
+
+struct ShardExportOptions
+{
+    // Directories whose annotated images are exported, in this order
+    QStringList directories;
+    QString output;
+    // WebDataset tar shards, a .image.png, .label.png and .json member per sample
+    bool webDataset = true;
+    // .npy stacks per shard, uint8 (N, H, W, 3) images and uint16 (N, H, W) labels; needs a target size
+    bool npy = false;
+    // Every sample is resized to it, images by area and labels by nearest neighbor; invalid keeps the native size
+    QSize size;
+    int samplesPerShard = 1000;
+    // Exported id of every label id, 65536 entries
+    QVector<quint16> remap;
+};
+
+QVector<quint16> identityRemap();
+
+// Reads "7=1,8=1,road=2" where each side is a label id or name into remap, which already holds a table.
+// Returns false with an error message on an unknown name or an id out of range.
+bool parseLabelRemap(const QString& text, const Name2Labels& labels, QVector<quint16>* remap, QString* error);
+
+// Packs the annotated images of directories and their labels into large sequential shards trainers can stream.
+// Shards are written by parallel workers, each holding one sample at a time, so memory is bounded by the thread
+// count. Every shard is written to .part files that are renamed when complete, then its part of the index is
+// written: an interrupted export started again with the same options only writes the shards still missing.
+class ShardExportJob : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit ShardExportJob(const ShardExportOptions& options, QObject* parent = Q_NULLPTR);
+
+    // Checks the options, lists the samples and writes the manifest, or checks that the output holds the same export
+    bool prepare(QString* error);
+
+    void start();
+
+    void waitForFinished();
+
+    // Concatenates the index of every shard into index.csv, false while shards are missing
+    bool writeIndex();
+
+    int written() const
+    {
+        return _written;
+    }
+
+    int samples() const
+    {
+        return _files.size();
+    }
+
+    int shards() const
+    {
+        return (_files.size() + _options.samplesPerShard - 1) / _options.samplesPerShard;
+    }
+
+    // Shards found complete from an earlier run
+    int resumed() const
+    {
+        return _resumed;
+    }
+
+public slots:
+    void cancel();
+
+signals:
+    void progressChanged(int value);
+
+    // Shards written by this run
+    void finished(int written, bool canceled);
+
+private:
+    QString _shardPath(int shard, const QString& suffix) const;
+
+    bool _isComplete(int shard) const;
+
+    bool _writeShard(int shard);
+
+    ShardExportOptions _options;
+    QStringList _files;
+    QList<int> _pending;
+    int _resumed;
+    std::atomic<int> _written;
+    std::atomic<bool> _cancel;
+    QFutureWatcher<void> _watcher;
+};
+
+#endif //SHARD_EXPORT_H
@@ -0,0 +1,79 @@
+#ifndef STROKE_JOURNAL_H
+#define STROKE_JOURNAL_H
+
+#include <QFile>
+#include <QTimer>
+#include <QDataStream>
+
+#include "image_mask.h"
+
+// Append-only log of the edits made to a mask since it was last saved, replayed after a crash.
+// Records stay small: strokes and fills by their input, undo and redo by the step they move to, pastes by the
+// rectangle they change. Only a recovered state is written as a full snapshot.
+class StrokeJournal
+{
+public:
+    enum RecordType : quint8
+    {
+        Stroke = 1,
+        Fill = 2,
+        Snapshot = 3,
+        Spans = 4,
+        // The current mask becomes a new undo step, the steps after the current one are dropped
+        Step = 5,
+        Undo = 6,
+        Redo = 7,
+        Clear = 8,
+        Paste = 9
+    };
+
+    StrokeJournal();
+
+    ~StrokeJournal();
+
+    static QString journalPath(const QString& imageFile);
+
+    // Points the journal to a new mask, the file itself is only created by the first record
+    void setFile(const QString& file, QSize size);
+
+    void appendStroke(int id, int penSize, const QVector<QPoint>& positions);
+
+    void appendFill(int id, QPoint position);
+
+    // Pixels painted by a stroke that can't be drawn again from its positions alone, e.g. an edge-snapped one
+    void appendSpans(int id, const QVector<QLine>& spans);
+
+    void appendSnapshot(const QImage& ids);
+
+    // The canvas pushed its mask on the undo stack
+    void appendStep();
+
+    // The canvas went back or forward one undo step
+    void appendUndo();
+
+    void appendRedo();
+
+    void appendClear();
+
+    // The ids of rect, the only part of the mask a paste changed
+    void appendPaste(const QRect& rect, const QImage& ids);
+
+    // Flushes the pending records and forces them to disk
+    void sync();
+
+    // Drops the journal once its content is saved or discarded
+    void remove();
+
+    // Applies the records of a journal to mask, returns the number of records replayed or -1 for an invalid file
+    static int replay(const QString& file, ImageMask* mask, const Id2Labels& labels);
+
+private:
+    bool _beginRecord(RecordType type);
+
+    QFile _file;
+    QDataStream _stream;
+    QSize _size;
+    QTimer _syncTimer;
+};
+
+#endif //STROKE_JOURNAL_H
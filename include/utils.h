@@ -2,14 +2,25 @@
 #define PIX_ANN_UTILS_H
 
 #include "labels.h"
+#include "mat_bridge.h"
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <QImage>
 
-cv::Mat qImage2Mat(QImage const& src);
+// Reads an id plane from a legacy 8-bit RGB/gray mask or a 16-bit gray mask, as Format_Grayscale16.
+// In 8-bit masks 255 is the watershed border and is read as WATERSHED_BORDER_ID.
+QImage readIdImage(const QString& file);
 
-QImage mat2QImage(cv::Mat const& src);
+// Final labels of an annotated image: its watershed mask, or its manual mask when the watershed was never run
+QImage readAnnotationLabels(const QString& imageFile);
+
+// Writes an id plane as a legacy 8-bit RGB mask when every id is below 255 or the border, as a 16-bit gray PNG
+// otherwise
+bool writeIdImage(const QImage& image_id, const QString& file);
+
+// PNG bytes writeIdImage would write, empty on failure
+QByteArray encodeIdImage(const QImage& image_id);
 
 QImage idToColor(const QImage& image_id, const Id2Labels& id_label);
 
@@ -26,7 +37,7 @@ QColor readableColor(const QColor& color);
 
 QVector<QColor> colorMap(int size);
 
-cv::Mat convertMat32StoRGBC3(const cv::Mat& mat);
+cv::Mat convertMat32StoId16(const cv::Mat& mat);
 
 QImage watershed(const QImage& qimage, const QImage& qmarkers_mask);
 
@@ -34,6 +45,23 @@ QImage removeBorder(const QImage& mask_id, const Id2Labels& labels, cv::Size win
 
 bool isFullZero(const QImage& image);
 
+// Hash of the pixels of an image, row padding excluded, to tell whether a plane still holds what was saved
+size_t contentHash(const QImage& image);
+
+// Image files of a directory that can be annotated, masks excluded, sorted by name
+QStringList listImageFiles(const QString& directory);
+
+bool isImageFile(const QString& fileName);
+
+// File next to an image sharing its base name, e.g. suffix "_mask.png"
+QString siblingFile(const QString& imageFile, const QString& suffix);
+
+// Peak resident memory of the process in bytes, 0 when unknown
+qint64 peakMemoryUsage();
+
+// Resident memory of the process right now in bytes, 0 when unknown
+qint64 currentMemoryUsage();
+
 int rgbToInt(uchar r, uchar g, uchar b);
 
 void intToRgb(int value, uchar& r, uchar& g, uchar& b);
@@ -0,0 +1,42 @@
+#ifndef WATERSHED_CACHE_H
+#define WATERSHED_CACHE_H
+
+#include <QImage>
+#include <QList>
+
+// Recent segmentation results of one canvas, keyed by the engine and the content of the marker plane,
+// least recently used dropped first
+class WatershedCache
+{
+public:
+    explicit WatershedCache(qint64 budgetBytes = 256 * 1024 * 1024);
+
+    static quint64 key(const QImage& markers, bool keepBorder, const QString& engine);
+
+    bool find(quint64 key, QImage* result);
+
+    void insert(quint64 key, const QImage& result);
+
+    void clear();
+
+    qint64 bytes() const
+    {
+        return _bytes;
+    }
+
+    QList<QImage> results() const;
+
+private:
+    struct Entry
+    {
+        quint64 key;
+        QImage result;
+    };
+
+    // Most recently used first
+    QList<Entry> _entries;
+    qint64 _bytes;
+    qint64 _budget;
+};
+
+#endif //WATERSHED_CACHE_H
@@ -4,14 +4,30 @@
  * Author: Rudra Poudel
  */
 #include "main_window.h"
+#include "command_line.h"
 
 int main(int argc, char* argv[])
 {
+    // ImageCanvas coalesces move events per frame itself, so keep every raw sample Qt receives
+    QApplication::setAttribute(Qt::AA_CompressHighFrequencyEvents, false);
+
+    // Batch commands run without a display
+    const bool commandLine = isCommandLineInvocation(argc, argv);
+    if (commandLine && qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+    {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+
     QApplication app(argc, argv);
     QApplication::setOrganizationName("pixelannotationtool_org");
     QApplication::setOrganizationDomain("pixelannotationtool_domain");
     QApplication::setApplicationName("PixelAnnotationTool");
 
+    if (commandLine)
+    {
+        return runCommandLine(QApplication::arguments());
+    }
+
     MainWindow win;
     win.show();
 
@@ -0,0 +1,68 @@
+#include "color_mask_export.h"
+#include "utils.h"
+#include "job_scheduler.h"
+
+#include <QDir>
+#include <QDirIterator>
+
+static const QString WATERSHED_SUFFIX = "_watershed_mask.png";
+static const QString COLOR_SUFFIX = "_color_mask.png";
+
+QString colorMaskPath(const QString& watershedFile)
+{
+    return watershedFile.left(watershedFile.size() - WATERSHED_SUFFIX.size()) + COLOR_SUFFIX;
+}
+
+bool exportColorMask(const QString& watershedFile, const Id2Labels& labels)
+{
+    QImage watershed = readIdImage(watershedFile);
+    if (watershed.isNull())
+    {
+        return false;
+    }
+    return idToColor(watershed, labels).save(colorMaskPath(watershedFile));
+}
+
+ColorMaskExportJob::ColorMaskExportJob(const QStringList& directories, const Name2Labels& labels, QObject* parent)
+    : QObject(parent), _labels(labels), _exported(0)
+{
+    _idLabels = getId2Label(_labels);
+    _files = _listWatershedMasks(directories);
+
+    connect(&_watcher, &QFutureWatcher<void>::progressValueChanged, this, &ColorMaskExportJob::progressChanged);
+    connect(&_watcher, &QFutureWatcher<void>::finished, this, [this]()-> void
+    {
+        emit finished(_exported, _watcher.isCanceled());
+    });
+}
+
+QStringList ColorMaskExportJob::_listWatershedMasks(const QStringList& directories)
+{
+    QStringList files;
+    for (const QString& directory : directories)
+    {
+        QDirIterator it(directory, {"*" + WATERSHED_SUFFIX}, QDir::Files);
+        while (it.hasNext())
+        {
+            files.append(it.next());
+        }
+    }
+    return files;
+}
+
+void ColorMaskExportJob::start()
+{
+    // Each file is decoded, recolored and written by one worker, so memory stays bounded by the pool size
+    _watcher.setFuture(JobScheduler::instance().map(JobClass::Background, _files, [this](const QString& file)-> void
+    {
+        if (exportColorMask(file, _idLabels))
+        {
+            ++_exported;
+        }
+    }));
+}
+
+void ColorMaskExportJob::cancel()
+{
+    _watcher.cancel();
+}
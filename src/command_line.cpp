@@ -0,0 +1,445 @@
+#include "command_line.h"
+#include "input_replay.h"
+#include "dataset_index.h"
+#include "consensus.h"
+#include "segmentation_engine.h"
+#include "utils.h"
+#include "color_mask_export.h"
+#include "shard_export.h"
+#include "label_remap.h"
+#include "evaluation.h"
+
+#include <QCommandLineParser>
+#include <QTextStream>
+#include <QMutex>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QElapsedTimer>
+#include <algorithm>
+#include <numeric>
+#include <cstring>
+
+static const char* COMMANDS[] = {"--replay", "--dataset-report", "--consensus", "--engine-benchmark", "--segment", "--export-shards", "--remap-labels", "--evaluate"};
+
+bool isCommandLineInvocation(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        for (const char* command : COMMANDS)
+        {
+            if (strcmp(argv[i], command) == 0)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static Name2Labels commandLabels(const QString& configFile)
+{
+    Name2Labels labels = defaultLabels();
+    if (!configFile.isEmpty() && !readLabelsFile(configFile, &labels))
+    {
+        QTextStream(stderr) << "Couldn't read config " << configFile << ", using the default labels\n";
+        labels = defaultLabels();
+    }
+    return labels;
+}
+
+static int datasetReport(const QString& root, const Name2Labels& labels)
+{
+    QTextStream err(stderr);
+    DatasetIndex index(root);
+    index.load();
+    QMutex mutex;
+    const int rescanned = index.rescan(Q_NULLPTR, [&err, &mutex](int done, int total)-> void
+    {
+        if (done % 100 == 0 || done == total)
+        {
+            QMutexLocker locker(&mutex);
+            err << "\rIndexing " << done << "/" << total << Qt::flush;
+        }
+    });
+    err << "\n" << rescanned << " images rescanned\n";
+    if (!index.save())
+    {
+        err << "Couldn't write " << DatasetIndex::indexPath(root) << "\n";
+    }
+    QTextStream(stdout) << formatIndexReport(index.summary(), getId2Label(labels));
+    return 0;
+}
+
+static int consensus(const QString& outputDir, const QStringList& annotators, const QStringList& weightList,
+                     const Name2Labels& labels)
+{
+    if (annotators.size() < 2)
+    {
+        QTextStream(stderr) << "--consensus needs at least two --annotators directories\n";
+        return 1;
+    }
+    QVector<double> weights;
+    for (const QString& weight : weightList)
+    {
+        bool ok = false;
+        const double value = weight.toDouble(&ok);
+        if (!ok || !isValidWeight(value))
+        {
+            QTextStream(stderr) << "Invalid weight \"" << weight << "\", --weights takes positive numbers\n";
+            return 1;
+        }
+        weights.append(value);
+    }
+
+    const QString report = formatAgreementReport(
+        runConsensusBatch(annotators, weights, outputDir, getId2Label(labels)), getId2Label(labels));
+    QFile file(outputDir + "/consensus_report.csv");
+    if (file.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+        file.write(report.toUtf8());
+    }
+    QTextStream(stdout) << report;
+    return 0;
+}
+
+static int engineBenchmark(const QString& directory)
+{
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+    const QVector<const SegmentationEngine*>& engines = segmentationEngines();
+
+    struct EngineRun
+    {
+        QVector<qint64> msecs;
+        // Pixels of the saved watershed masks, borders excluded, and how many the engine labeled the same
+        quint64 compared = 0;
+        quint64 agreeing = 0;
+    };
+    QVector<EngineRun> runs(engines.size());
+
+    int images = 0;
+    for (const QString& name : listImageFiles(directory))
+    {
+        const QString file = QDir(directory).absoluteFilePath(name);
+        const QImage markers = readIdImage(siblingFile(file, "_mask.png"));
+        const QImage image = markers.isNull() ? QImage() : readRgbImage(file);
+        if (image.isNull() || image.size() != markers.size())
+        {
+            continue;
+        }
+        const QImage reference = readIdImage(siblingFile(file, "_watershed_mask.png"));
+        for (int i = 0; i < engines.size(); i++)
+        {
+            QElapsedTimer timer;
+            timer.start();
+            const QImage labels = engines[i]->segment(image, markers);
+            runs[i].msecs.append(timer.elapsed());
+            if (reference.size() == labels.size())
+            {
+                const cv::Mat counted = matView(reference) != WATERSHED_BORDER_ID;
+                runs[i].compared += cv::countNonZero(counted);
+                runs[i].agreeing += cv::countNonZero(counted & (matView(reference) == matView(labels)));
+            }
+        }
+        err << "\r" << ++images << " images" << Qt::flush;
+    }
+    err << "\n";
+    if (images == 0)
+    {
+        err << "No annotated image in " << directory << "\n";
+        return 1;
+    }
+
+    out << QString("%1 %2 %3 %4 %5\n").arg("Engine", -16).arg("mean ms", 10).arg("median ms", 10).arg("max ms", 10)
+                                      .arg("agreement", 10);
+    for (int i = 0; i < engines.size(); i++)
+    {
+        QVector<qint64> msecs = runs[i].msecs;
+        std::sort(msecs.begin(), msecs.end());
+        const double mean = std::accumulate(msecs.begin(), msecs.end(), 0.) / msecs.size();
+        out << QString("%1 %2 %3 %4 %5\n")
+               .arg(engines[i]->name(), -16)
+               .arg(mean, 10, 'f', 1)
+               .arg(msecs[msecs.size() / 2], 10)
+               .arg(msecs.last(), 10)
+               .arg(runs[i].compared
+                        ? QString::number(100. * runs[i].agreeing / runs[i].compared, 'f', 2) + "%"
+                        : QString("-"), 10);
+    }
+    out << "Peak memory: " << peakMemoryUsage() / (1024 * 1024) << " MB\n";
+    return 0;
+}
+
+static int segmentDirectory(const QString& directory, const QString& engineName, bool keepBorder,
+                            const Name2Labels& labels)
+{
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+    const SegmentationEngine* engine = findSegmentationEngine(engineName);
+    if (!engineName.isEmpty() && engine->name() != engineName)
+    {
+        err << "Unknown engine " << engineName << ", using " << engine->name() << "\n";
+    }
+    const Id2Labels idLabels = getId2Label(labels);
+
+    int segmented = 0;
+    for (const QString& name : listImageFiles(directory))
+    {
+        // Masks are read and written next to the image, wherever the command runs from
+        const QString file = QDir(directory).absoluteFilePath(name);
+        const QImage markers = readIdImage(siblingFile(file, "_mask.png"));
+        const QImage image = markers.isNull() ? QImage() : readRgbImage(file);
+        if (image.isNull() || image.size() != markers.size())
+        {
+            continue;
+        }
+        // The lifetime peak only ever grows, the working set around the run is what this image costs
+        const qint64 before = currentMemoryUsage();
+        QElapsedTimer timer;
+        timer.start();
+        QImage result = engine->segment(image, markers);
+        const qint64 msecs = timer.elapsed();
+        const qint64 after = currentMemoryUsage();
+        if (!keepBorder)
+        {
+            result = removeBorder(result, idLabels);
+        }
+        const QString watershedFile = siblingFile(file, "_watershed_mask.png");
+        if (!writeIdImage(result, watershedFile) || !idToColor(result, idLabels).save(colorMaskPath(watershedFile)))
+        {
+            err << "Couldn't write the masks of " << file << "\n";
+            continue;
+        }
+        segmented++;
+        out << QFileInfo(file).fileName() << ": " << image.width() << "x" << image.height() << " in "
+            << msecs << " ms, working set " << before / (1024 * 1024) << " MB before, " << after / (1024 * 1024)
+            << " MB after\n" << Qt::flush;
+    }
+    out << segmented << " images segmented with " << engine->name() << "\n";
+    return 0;
+}
+
+static QSize parseSize(const QString& text)
+{
+    const QStringList parts = text.toLower().split('x');
+    if (parts.size() != 2)
+    {
+        return QSize();
+    }
+    return QSize(parts[0].toInt(), parts[1].toInt());
+}
+
+static int exportShards(ShardExportOptions options, const QString& formats, const QString& remap,
+                        const Name2Labels& labels)
+{
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+    const QStringList formatList = formats.toLower().split(',', Qt::SkipEmptyParts);
+    options.webDataset = formatList.isEmpty() || formatList.contains("webdataset");
+    options.npy = formatList.contains("npy");
+    options.remap = identityRemap();
+    QString error;
+    if (!parseLabelRemap(remap, labels, &options.remap, &error))
+    {
+        err << error << "\n";
+        return 1;
+    }
+
+    ShardExportJob job(options);
+    if (!job.prepare(&error))
+    {
+        err << error << "\n";
+        return 1;
+    }
+    out << job.samples() << " samples in " << job.shards() << " shards, " << job.resumed()
+        << " already written\n" << Qt::flush;
+    QElapsedTimer timer;
+    timer.start();
+    job.start();
+    job.waitForFinished();
+    if (!job.writeIndex())
+    {
+        err << "Some shards couldn't be written, run the same command again to retry them\n";
+        return 1;
+    }
+    out << job.written() << " shards written in " << timer.elapsed() << " ms, peak memory "
+        << peakMemoryUsage() / (1024 * 1024) << " MB\n";
+    return 0;
+}
+
+static int remapLabels(const QStringList& directories, const QString& configFile, const QString& toFile,
+                       const QString& mergeText, bool dryRun)
+{
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+    const Name2Labels from = commandLabels(configFile);
+    Name2Labels to;
+    if (!readLabelsFile(toFile, &to))
+    {
+        err << "Couldn't read config " << toFile << "\n";
+        return 1;
+    }
+    QMap<QString, QString> merges;
+    QVector<quint16> remap;
+    QString error;
+    if (!parseLabelMerges(mergeText, &merges, &error) || !configRemap(from, to, merges, &remap, &error))
+    {
+        err << error << "\n";
+        return 1;
+    }
+
+    LabelRemapJob job(directories, remap, from, to, dryRun);
+    if (!job.error().isEmpty())
+    {
+        err << job.error() << "\n";
+        return 1;
+    }
+    QElapsedTimer timer;
+    timer.start();
+    job.start();
+    job.waitForFinished();
+    out << job.report();
+    out << job.changed() << " of " << job.total() << " images " << (dryRun ? "would change" : "remapped") << " in "
+        << timer.elapsed() << " ms, peak memory " << peakMemoryUsage() / (1024 * 1024) << " MB\n";
+    if (job.skipped() > 0)
+    {
+        out << job.skipped() << " files were already remapped by an earlier run\n";
+    }
+    if (!dryRun && !configFile.isEmpty())
+    {
+        // The record is kept even for a partial run, the masks then hold ids of both configs
+        QString file;
+        if (!saveRemapRecord(configFile, job, &file))
+        {
+            err << "Couldn't write " << file << "\n";
+            return 1;
+        }
+        out << (job.isComplete() ? configFile + " updated\n" : configFile + " kept, the remap is recorded next to it\n");
+    }
+    if (job.failed() > 0)
+    {
+        err << job.failed() << " images couldn't be written, run the same command again to finish the remap\n";
+        return 1;
+    }
+    return 0;
+}
+
+int runCommandLine(const QStringList& arguments)
+{
+    QCommandLineParser parser;
+    parser.setApplicationDescription("PixelAnnotationTool batch commands");
+    parser.addHelpOption();
+
+    QCommandLineOption replayOption("replay", "Replay a recorded input session headlessly and report latencies.",
+                                    "session");
+    QCommandLineOption imageOption("image", "Image to replay the session on instead of the recorded one.", "file");
+    QCommandLineOption syntheticOption("synthetic", "Replay the session on a generated image of this size.",
+                                       "WxH");
+    QCommandLineOption fastOption("fast", "Replay events back to back instead of at the recorded pace.");
+    QCommandLineOption reportOption("dataset-report",
+                                    "Update the index of a directory and print its annotation progress and class balance.",
+                                    "directory");
+    QCommandLineOption configOption("config", "Label config file, the default labels otherwise.", "file");
+    QCommandLineOption consensusOption("consensus",
+                                       "Merge the annotations of several annotators by weighted majority vote.",
+                                       "output directory");
+    QCommandLineOption annotatorsOption("annotators", "Comma separated annotator directories.", "directories");
+    QCommandLineOption weightsOption("weights", "Comma separated annotator weights.", "weights");
+    QCommandLineOption benchmarkOption("engine-benchmark",
+                                       "Time every segmentation engine on the annotated images of a directory.",
+                                       "directory");
+    QCommandLineOption segmentOption("segment",
+                                     "Segment every annotated image of a directory from its manual mask and write its "
+                                     "watershed and color masks.", "directory");
+    QCommandLineOption engineOption("engine", "Segmentation engine of --segment, e.g. \"Tiled watershed\".", "name");
+    QCommandLineOption keepBorderOption("keep-border", "Keep the border drawn by the watershed.");
+    QCommandLineOption shardsOption("export-shards",
+                                    "Pack the annotated images of --from directories into training shards.",
+                                    "output directory");
+    QCommandLineOption fromOption("from", "Comma separated directories to export.", "directories");
+    QCommandLineOption formatOption("format", "Comma separated shard formats, webdataset (default) and npy.",
+                                    "formats");
+    QCommandLineOption sizeOption("size", "Size every exported sample is resized to, needed by npy.", "WxH");
+    QCommandLineOption shardSizeOption("shard-size", "Samples per shard, 1000 by default.", "count");
+    QCommandLineOption remapOption("remap", "Comma separated label remapping, e.g. 7=1,road=1,car=2.", "pairs");
+    QCommandLineOption remapLabelsOption("remap-labels",
+                                         "Rewrite the masks of comma separated directories from the --config "
+                                         "labels to the --to labels.", "directories");
+    QCommandLineOption toOption("to", "Config the masks are remapped to.", "config.json");
+    QCommandLineOption mergeOption("merge", "Comma separated old=new label names, e.g. polegroup=pole.", "pairs");
+    QCommandLineOption dryRunOption("dry-run", "Only report the pixels that would change.");
+    QCommandLineOption evaluateOption("evaluate",
+                                      "Compare the masks of a directory with the --gold masks, per class IoU and "
+                                      "confusion matrix.", "directory");
+    QCommandLineOption goldOption("gold", "Directory of the reference masks.", "directory");
+    QCommandLineOption reportsOption("reports", "Directory of the evaluation reports, the evaluated one by default.",
+                                     "directory");
+    parser.addOptions({
+        replayOption, imageOption, syntheticOption, fastOption, reportOption, configOption, consensusOption,
+        annotatorsOption, weightsOption, benchmarkOption, segmentOption, engineOption, keepBorderOption,
+        shardsOption, fromOption, formatOption, sizeOption, shardSizeOption, remapOption, remapLabelsOption,
+        toOption, mergeOption, dryRunOption, evaluateOption, goldOption, reportsOption
+    });
+    parser.process(arguments);
+
+    if (parser.isSet(replayOption))
+    {
+        ReplayOptions options;
+        options.session = parser.value(replayOption);
+        options.image = parser.value(imageOption);
+        options.synthetic = parseSize(parser.value(syntheticOption));
+        options.realtime = !parser.isSet(fastOption);
+        return replayInputSession(options);
+    }
+
+    if (parser.isSet(reportOption))
+    {
+        return datasetReport(parser.value(reportOption), commandLabels(parser.value(configOption)));
+    }
+
+    if (parser.isSet(consensusOption))
+    {
+        return consensus(parser.value(consensusOption), parser.value(annotatorsOption).split(',', Qt::SkipEmptyParts),
+                         parser.value(weightsOption).split(',', Qt::SkipEmptyParts),
+                         commandLabels(parser.value(configOption)));
+    }
+
+    if (parser.isSet(benchmarkOption))
+    {
+        return engineBenchmark(parser.value(benchmarkOption));
+    }
+
+    if (parser.isSet(segmentOption))
+    {
+        return segmentDirectory(parser.value(segmentOption), parser.value(engineOption), parser.isSet(keepBorderOption),
+                                commandLabels(parser.value(configOption)));
+    }
+
+    if (parser.isSet(shardsOption))
+    {
+        ShardExportOptions options;
+        options.output = parser.value(shardsOption);
+        options.directories = parser.value(fromOption).split(',', Qt::SkipEmptyParts);
+        options.size = parseSize(parser.value(sizeOption));
+        options.samplesPerShard = parser.isSet(shardSizeOption) ? parser.value(shardSizeOption).toInt() : 1000;
+        return exportShards(options, parser.value(formatOption), parser.value(remapOption),
+                            commandLabels(parser.value(configOption)));
+    }
+
+    if (parser.isSet(remapLabelsOption))
+    {
+        return remapLabels(parser.value(remapLabelsOption).split(',', Qt::SkipEmptyParts),
+                           parser.value(configOption), parser.value(toOption), parser.value(mergeOption),
+                           parser.isSet(dryRunOption));
+    }
+
+    if (parser.isSet(evaluateOption))
+    {
+        return evaluate(parser.value(evaluateOption), parser.value(goldOption), parser.value(reportsOption),
+                        commandLabels(parser.value(configOption)));
+    }
+
+    QTextStream(stderr) << parser.helpText();
+    return 1;
+}
@@ -0,0 +1,200 @@
+#include "consensus.h"
+#include "utils.h"
+#include "job_scheduler.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QMutex>
+#include <cmath>
+#include <numeric>
+
+// Unanimous and "any annotator" pixel counts per label. unanimous masks the pixels where every plane holds the id of
+// the first one, repeated[i] those where plane i holds an id an earlier plane already gave, both built from the
+// equality masks of the vote. Single-threaded: images are already merged in parallel.
+static QMap<int, LabelAgreement> countAgreement(const std::vector<cv::Mat>& planes, const cv::Mat& unanimous,
+                                                const std::vector<cv::Mat>& repeated)
+{
+    std::vector<quint64> unanimousCounts(WATERSHED_BORDER_ID + 1, 0);
+    std::vector<quint64> anyCounts(WATERSHED_BORDER_ID + 1, 0);
+    for (int y = 0; y < planes[0].rows; y++)
+    {
+        const auto* first = planes[0].ptr<quint16>(y);
+        const uchar* same = unanimous.ptr<uchar>(y);
+        for (int x = 0; x < planes[0].cols; x++)
+        {
+            unanimousCounts[first[x]] += same[x] & 1;
+        }
+        for (size_t i = 0; i < planes.size(); i++)
+        {
+            const auto* ids = planes[i].ptr<quint16>(y);
+            const uchar* seen = repeated[i].ptr<uchar>(y);
+            for (int x = 0; x < planes[0].cols; x++)
+            {
+                anyCounts[ids[x]] += ~seen[x] & 1;
+            }
+        }
+    }
+
+    QMap<int, LabelAgreement> agreement;
+    for (size_t id = 0; id < anyCounts.size(); id++)
+    {
+        if (anyCounts[id])
+        {
+            agreement[int(id)] = LabelAgreement{unanimousCounts[id], anyCounts[id]};
+        }
+    }
+    return agreement;
+}
+
+bool isValidWeight(double weight)
+{
+    return std::isfinite(weight) && weight > 0;
+}
+
+ConsensusResult computeConsensus(const QVector<QImage>& masks, const QVector<double>& weights)
+{
+    ConsensusResult result;
+    if (masks.isEmpty())
+    {
+        return result;
+    }
+    const int n = masks.size();
+    std::vector<cv::Mat> planes;
+    for (const QImage& mask : masks)
+    {
+        CV_Assert(mask.size() == masks[0].size() && mask.format() == QImage::Format_Grayscale16);
+        planes.push_back(matView(mask));
+    }
+    std::vector<float> w(n, 1.f);
+    for (int i = 0; i < n && i < weights.size(); i++)
+    {
+        if (isValidWeight(weights[i]))
+        {
+            w[i] = static_cast<float>(weights[i]);
+        }
+        else
+        {
+            qWarning() << "Consensus weight" << weights[i] << "isn't a positive number, annotator" << i << "counts as 1";
+        }
+    }
+    const float total = std::accumulate(w.begin(), w.end(), 0.f);
+
+    // score_i = weight of the annotators agreeing with annotator i, built from pairwise equality masks.
+    // Everything runs through OpenCV's vectorized compare/add/copyTo kernels.
+    std::vector<cv::Mat> scores(n);
+    std::vector<cv::Mat> repeated(n);
+    for (int i = 0; i < n; i++)
+    {
+        scores[i] = cv::Mat(planes[i].size(), CV_32F, cv::Scalar(w[i]));
+        repeated[i] = cv::Mat::zeros(planes[i].size(), CV_8U);
+    }
+    cv::Mat unanimous(planes[0].size(), CV_8U, cv::Scalar(255));
+    cv::Mat equal;
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = i + 1; j < n; j++)
+        {
+            cv::compare(planes[i], planes[j], equal, cv::CMP_EQ);
+            cv::add(scores[i], cv::Scalar(w[j]), scores[i], equal);
+            cv::add(scores[j], cv::Scalar(w[i]), scores[j], equal);
+            // The same masks give the agreement counts
+            cv::bitwise_or(repeated[j], equal, repeated[j]);
+            if (i == 0)
+            {
+                cv::bitwise_and(unanimous, equal, unanimous);
+            }
+        }
+    }
+
+    cv::Mat winner = planes[0].clone();
+    cv::Mat best = scores[0].clone();
+    cv::Mat better;
+    for (int i = 1; i < n; i++)
+    {
+        cv::compare(scores[i], best, better, cv::CMP_GT);
+        planes[i].copyTo(winner, better);
+        scores[i].copyTo(best, better);
+    }
+
+    cv::Mat disagreement;
+    if (total > 0 && std::isfinite(total))
+    {
+        best.convertTo(disagreement, CV_8U, -255. / total, 255.);
+    }
+    else
+    {
+        disagreement = cv::Mat::zeros(best.size(), CV_8U);
+    }
+
+    result.labels = qImageView(winner);
+    result.disagreement = qImageView(disagreement);
+    result.agreement = countAgreement(planes, unanimous, repeated);
+    return result;
+}
+
+QImage disagreementHeatMap(const QImage& disagreement)
+{
+    cv::Mat heat;
+    cv::applyColorMap(matView(disagreement), heat, cv::COLORMAP_JET);
+    cv::cvtColor(heat, heat, cv::COLOR_BGR2RGB);
+    return qImageView(heat);
+}
+
+QMap<int, LabelAgreement> runConsensusBatch(const QStringList& annotatorDirs, const QVector<double>& weights,
+                                            const QString& outputDir, const Id2Labels& labels)
+{
+    QMap<int, LabelAgreement> total;
+    if (annotatorDirs.isEmpty())
+    {
+        return total;
+    }
+    QDir().mkpath(outputDir);
+
+    QMutex mutex;
+    QStringList images = listImageFiles(annotatorDirs.first());
+    // One image per task, only the masks of the images being merged are in memory
+    JobScheduler::instance().blockingMap(JobClass::Background, images, [&](const QString& image)-> void
+    {
+        QVector<QImage> masks;
+        for (const QString& dir : annotatorDirs)
+        {
+            const QImage ids = readAnnotationLabels(dir + "/" + image);
+            if (ids.isNull() || (!masks.isEmpty() && ids.size() != masks.first().size()))
+            {
+                return;
+            }
+            masks.append(ids);
+        }
+
+        const ConsensusResult consensus = computeConsensus(masks, weights);
+        const QString base = outputDir + "/" + QFileInfo(image).completeBaseName();
+        writeIdImage(consensus.labels, base + "_mask.png");
+        idToColor(consensus.labels, labels).save(base + "_color_mask.png");
+        consensus.disagreement.save(base + "_disagreement.png");
+
+        QMutexLocker locker(&mutex);
+        for (auto it = consensus.agreement.constBegin(); it != consensus.agreement.constEnd(); ++it)
+        {
+            total[it.key()].unanimous += it->unanimous;
+            total[it.key()].any += it->any;
+        }
+    });
+    return total;
+}
+
+QString formatAgreementReport(const QMap<int, LabelAgreement>& agreement, const Id2Labels& labels)
+{
+    QString report = "id,label,unanimous_pixels,any_pixels,agreement\n";
+    for (auto it = agreement.constBegin(); it != agreement.constEnd(); ++it)
+    {
+        const LabelInfo* label = labels[it.key()];
+        report += QString("%1,%2,%3,%4,%5\n")
+                  .arg(it.key())
+                  .arg(label ? label->name : QString())
+                  .arg(it->unanimous)
+                  .arg(it->any)
+                  .arg(it->score(), 0, 'f', 4);
+    }
+    return report;
+}
@@ -0,0 +1,239 @@
+#include "dataset_index.h"
+#include "utils.h"
+#include "job_scheduler.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QSaveFile>
+#include <QSet>
+
+static const quint32 INDEX_MAGIC = 0x50415449; // "PATI"
+static const quint16 INDEX_VERSION = 1;
+
+static QDataStream& operator<<(QDataStream& out, const IndexEntry& entry)
+{
+    return out << entry.hasMask << entry.maskModified << entry.size << entry.labelPixels;
+}
+
+static QDataStream& operator>>(QDataStream& in, IndexEntry& entry)
+{
+    return in >> entry.hasMask >> entry.maskModified >> entry.size >> entry.labelPixels;
+}
+
+QMap<int, quint64> countLabels(const QImage& ids)
+{
+    QVector<quint64> histogram(WATERSHED_BORDER_ID + 1, 0);
+    for (int y = 0; y < ids.height(); y++)
+    {
+        const auto* line = reinterpret_cast<const quint16*>(ids.constScanLine(y));
+        for (int x = 0; x < ids.width(); x++)
+        {
+            histogram[line[x]]++;
+        }
+    }
+    QMap<int, quint64> counts;
+    for (int id = 0; id < histogram.size(); id++)
+    {
+        if (histogram[id])
+        {
+            counts.insert(id, histogram[id]);
+        }
+    }
+    return counts;
+}
+
+static qint64 maskModified(const QString& imageFile, bool* hasMask)
+{
+    QFileInfo mask(siblingFile(imageFile, "_mask.png"));
+    QFileInfo watershed(siblingFile(imageFile, "_watershed_mask.png"));
+    *hasMask = mask.exists();
+    qint64 modified = 0;
+    for (const QFileInfo& info : {mask, watershed})
+    {
+        if (info.exists())
+        {
+            modified = std::max(modified, info.lastModified().toMSecsSinceEpoch());
+        }
+    }
+    return modified;
+}
+
+DatasetIndex::DatasetIndex(const QString& root) : _root(root), _dirty(false)
+{}
+
+QString DatasetIndex::indexPath(const QString& root)
+{
+    return root + "/.pixel_annotation_index";
+}
+
+bool DatasetIndex::load()
+{
+    QFile file(indexPath(_root));
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        return false;
+    }
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_6_0);
+    quint32 magic;
+    quint16 version;
+    stream >> magic >> version;
+    if (magic != INDEX_MAGIC || version != INDEX_VERSION)
+    {
+        return false;
+    }
+    QHash<QString, IndexEntry> entries;
+    stream >> entries;
+    if (stream.status() != QDataStream::Ok)
+    {
+        return false;
+    }
+
+    QMutexLocker locker(&_mutex);
+    _entries = entries;
+    _dirty = false;
+    return true;
+}
+
+bool DatasetIndex::save()
+{
+    QMutexLocker locker(&_mutex);
+    QSaveFile file(indexPath(_root));
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        return false;
+    }
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream << INDEX_MAGIC << INDEX_VERSION << _entries;
+    if (!file.commit())
+    {
+        return false;
+    }
+    _dirty = false;
+    return true;
+}
+
+IndexEntry DatasetIndex::_scan(const QString& imageFile)
+{
+    IndexEntry entry;
+    entry.maskModified = maskModified(imageFile, &entry.hasMask);
+    entry.size = QImageReader(imageFile).size();
+
+    if (!entry.hasMask)
+    {
+        return entry;
+    }
+    const QImage ids = readAnnotationLabels(imageFile);
+    if (!ids.isNull())
+    {
+        entry.labelPixels = countLabels(ids);
+    }
+    return entry;
+}
+
+void DatasetIndex::update(const QString& imageFile, const QImage& ids)
+{
+    IndexEntry entry;
+    entry.maskModified = maskModified(imageFile, &entry.hasMask);
+    entry.size = ids.size();
+    entry.labelPixels = countLabels(ids);
+
+    QMutexLocker locker(&_mutex);
+    _entries.insert(QFileInfo(imageFile).fileName(), entry);
+    _dirty = true;
+}
+
+int DatasetIndex::rescan(const std::atomic<bool>* cancel, const std::function<void(int, int)>& progress)
+{
+    const QStringList images = listImageFiles(_root);
+
+    // Only a stat per image on this pass, masks are decoded for the changed images only
+    QStringList changed;
+    {
+        QMutexLocker locker(&_mutex);
+        for (const QString& image : images)
+        {
+            bool hasMask;
+            const qint64 modified = maskModified(_root + "/" + image, &hasMask);
+            auto it = _entries.constFind(image);
+            if (it == _entries.constEnd() || it->hasMask != hasMask || it->maskModified != modified)
+            {
+                changed.append(image);
+            }
+        }
+        const QSet<QString> present(images.begin(), images.end());
+        for (auto it = _entries.begin(); it != _entries.end();)
+        {
+            if (present.contains(it.key()))
+            {
+                ++it;
+            }
+            else
+            {
+                it = _entries.erase(it);
+                _dirty = true;
+            }
+        }
+    }
+
+    std::atomic<int> done(0);
+    JobScheduler::instance().blockingMap(JobClass::Background, changed, [&](const QString& image)-> void
+    {
+        if (cancel && *cancel)
+        {
+            return;
+        }
+        const IndexEntry entry = _scan(_root + "/" + image);
+        {
+            QMutexLocker locker(&_mutex);
+            _entries.insert(image, entry);
+            _dirty = true;
+        }
+        if (progress)
+        {
+            progress(++done, changed.size());
+        }
+    });
+    return done;
+}
+
+IndexSummary DatasetIndex::summary() const
+{
+    QMutexLocker locker(&_mutex);
+    IndexSummary summary;
+    for (const IndexEntry& entry : _entries)
+    {
+        summary.images++;
+        if (!entry.hasMask)
+        {
+            continue;
+        }
+        summary.annotated++;
+        for (auto it = entry.labelPixels.constBegin(); it != entry.labelPixels.constEnd(); ++it)
+        {
+            summary.labelPixels[it.key()] += it.value();
+            summary.labeledPixels += it.value();
+        }
+    }
+    return summary;
+}
+
+QString formatIndexReport(const IndexSummary& summary, const Id2Labels& labels)
+{
+    QString report = QString("Annotated images: %1 / %2\n").arg(summary.annotated).arg(summary.images);
+    for (auto it = summary.labelPixels.constBegin(); it != summary.labelPixels.constEnd(); ++it)
+    {
+        const LabelInfo* label = labels[it.key()];
+        const QString name = label ? label->name : it.key() == WATERSHED_BORDER_ID ? "border" : "unknown";
+        report += QString("%1 %2 %3 %4%\n")
+                  .arg(it.key(), 6)
+                  .arg(name, -24)
+                  .arg(it.value(), 14)
+                  .arg(100. * it.value() / std::max<quint64>(1, summary.labeledPixels), 7, 'f', 3);
+    }
+    return report;
+}
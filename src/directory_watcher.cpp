@@ -0,0 +1,97 @@
+#include "directory_watcher.h"
+#include "utils.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <algorithm>
+#include <iterator>
+
+DirectoryWatcher::DirectoryWatcher(QObject* parent) : QObject(parent)
+{
+    // A capture pipeline writes frames back to back, one listing per batch keeps up with it
+    _batchTimer.setSingleShot(true);
+    _batchTimer.setInterval(500);
+    connect(&_batchTimer, &QTimer::timeout, this, &DirectoryWatcher::_flush);
+    connect(&_watcher, &QFileSystemWatcher::directoryChanged, this, [this](const QString& directory)-> void
+    {
+        _dirtyDirectories.insert(directory);
+        if (!_batchTimer.isActive())
+        {
+            _batchTimer.start();
+        }
+    });
+    connect(&_watcher, &QFileSystemWatcher::fileChanged, this, [this](const QString& file)-> void
+    {
+        _dirtyFiles.insert(file);
+        if (!_batchTimer.isActive())
+        {
+            _batchTimer.start();
+        }
+    });
+}
+
+void DirectoryWatcher::addRoot(const QString& directory, const QStringList& images)
+{
+    const QString path = QDir(directory).absolutePath();
+    _images.insert(path, images);
+    _watcher.addPath(path);
+}
+
+void DirectoryWatcher::setWatchedFiles(const QStringList& files)
+{
+    const QStringList watched = _watcher.files();
+    const QSet<QString> wanted(files.begin(), files.end());
+    for (const QString& file : watched)
+    {
+        if (!wanted.contains(file))
+        {
+            _watcher.removePath(file);
+        }
+    }
+    // Files replaced through a rename drop out of the watcher and are added back here
+    for (const QString& file : wanted)
+    {
+        if (!watched.contains(file) && QFileInfo::exists(file))
+        {
+            _watcher.addPath(file);
+        }
+    }
+}
+
+void DirectoryWatcher::_flush()
+{
+    for (const QString& directory : std::as_const(_dirtyDirectories))
+    {
+        auto known = _images.find(directory);
+        if (known == _images.end())
+        {
+            continue;
+        }
+        // Names only, nothing is read or stat'ed; both listings are sorted the same way
+        const QStringList images = listImageFiles(directory);
+        QStringList added;
+        QStringList removed;
+        std::set_difference(images.begin(), images.end(), known->begin(), known->end(), std::back_inserter(added),
+                            [](const QString& a, const QString& b)-> bool
+                            {
+                                return QString::compare(a, b) < 0;
+                            });
+        std::set_difference(known->begin(), known->end(), images.begin(), images.end(), std::back_inserter(removed),
+                            [](const QString& a, const QString& b)-> bool
+                            {
+                                return QString::compare(a, b) < 0;
+                            });
+        *known = images;
+        if (!added.isEmpty() || !removed.isEmpty())
+        {
+            emit imagesChanged(directory, added, removed);
+        }
+        _dirtyFiles.insert(directory);
+    }
+    _dirtyDirectories.clear();
+    if (!_dirtyFiles.isEmpty())
+    {
+        emit filesChanged(QStringList(_dirtyFiles.begin(), _dirtyFiles.end()));
+        _dirtyFiles.clear();
+    }
+}
@@ -0,0 +1,44 @@
+#include "display_composite.h"
+#include "mat_bridge.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+
+void compositeLayers(const QImage& image, const QVector<const QImage*>& layers, double alpha, const QRect& rect,
+                     QImage* composite)
+{
+    const QRect area = rect.intersected(composite->rect());
+    if (area.isEmpty())
+    {
+        return;
+    }
+    const QImage rgb = image.format() == QImage::Format_RGB888 ? image : image.convertToFormat(QImage::Format_RGB888);
+    const cv::Mat base = matView(rgb);
+    QVector<cv::Mat> overlays;
+    for (const QImage* layer : layers)
+    {
+        overlays.append(matView(*layer));
+    }
+    cv::Mat out = mutableMatView(*composite);
+
+    // Bands of a few rows stay in cache from the first blend to the conversion into the display buffer
+    cv::parallel_for_(cv::Range(area.top(), area.bottom() + 1), [&](const cv::Range& range)-> void
+    {
+        const cv::Rect band(area.x(), range.start, area.width(), range.end - range.start);
+        cv::Mat blended = base(band);
+        if (!overlays.isEmpty())
+        {
+            cv::Mat mixed;
+            for (const cv::Mat& overlay : overlays)
+            {
+                cv::addWeighted(blended, 1. - alpha, overlay(band), alpha, 0., mixed);
+                blended = mixed;
+            }
+        }
+        // Opaque pixels are their own premultiplied value, only the channel order and alpha change: ARGB32 words are
+        // B, G, R, A bytes on the little-endian hosts the tool runs on
+        cv::Mat target = out(band);
+        cv::cvtColor(blended, target, cv::COLOR_RGB2BGRA);
+    }, std::max(1., area.height() / 16.));
+}
@@ -0,0 +1,204 @@
+#include "display_mapping.h"
+#include "mat_bridge.h"
+
+#include <QFileInfo>
+#include <QImageReader>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <cmath>
+
+cv::Mat readNativeImage(const QString& file)
+{
+    const bool tiff = QStringList{"tif", "tiff"}.contains(QFileInfo(file).suffix().toLower());
+    // Only TIFF may hold more than three bands, other formats keep their EXIF orientation applied
+    cv::Mat native = cv::imread(file.toStdString(),
+                                tiff ? cv::IMREAD_UNCHANGED : cv::IMREAD_ANYDEPTH | cv::IMREAD_ANYCOLOR);
+    bool pages = false;
+    if (tiff && (native.empty() || native.channels() == 1))
+    {
+        std::vector<cv::Mat> bands;
+        if (cv::imreadmulti(file.toStdString(), bands, cv::IMREAD_UNCHANGED) && bands.size() > 1
+            && std::all_of(bands.begin(), bands.end(), [&bands](const cv::Mat& band)-> bool
+            {
+                return band.size() == bands[0].size() && band.type() == bands[0].type() && band.channels() == 1;
+            }))
+        {
+            cv::merge(bands, native);
+            pages = true;
+        }
+    }
+    if (native.empty())
+    {
+        return native;
+    }
+
+    if (native.depth() != CV_8U && native.depth() != CV_16U)
+    {
+        cv::normalize(native, native, 0, 65535, cv::NORM_MINMAX, CV_MAKETYPE(CV_16U, native.channels()));
+    }
+    if (!pages && native.channels() == 3)
+    {
+        cv::cvtColor(native, native, cv::COLOR_BGR2RGB);
+    }
+    else if (!pages && native.channels() == 4)
+    {
+        cv::cvtColor(native, native, cv::COLOR_BGRA2RGBA);
+    }
+    return native;
+}
+
+bool needsDisplayMapping(const cv::Mat& native)
+{
+    return native.type() != CV_8UC3;
+}
+
+DisplayMapping defaultDisplayMapping(const cv::Mat& native)
+{
+    DisplayMapping mapping;
+    mapping.depth = native.depth();
+    for (int i = 0; i < 3; i++)
+    {
+        mapping.bands[i] = native.channels() < 3 ? 0 : i;
+    }
+    if (native.depth() == CV_8U)
+    {
+        return mapping;
+    }
+
+    // Histogram of the shown bands on a subsample of the pixels
+    std::vector<quint64> histogram(65536, 0);
+    quint64 count = 0;
+    const int channels = native.channels();
+    for (int y = 0; y < native.rows; y += 4)
+    {
+        const auto* line = native.ptr<quint16>(y);
+        for (int x = 0; x < native.cols; x += 4)
+        {
+            for (int band : mapping.bands)
+            {
+                histogram[line[x * channels + band]]++;
+                count++;
+            }
+        }
+    }
+    quint64 seen = 0;
+    mapping.low = -1;
+    for (int value = 0; value < 65536; value++)
+    {
+        seen += histogram[value];
+        if (mapping.low < 0 && seen * 1000 >= count * 5)
+        {
+            mapping.low = value;
+        }
+        if (seen * 1000 >= count * 995)
+        {
+            mapping.high = std::max<double>(value, mapping.low + 1);
+            break;
+        }
+    }
+    return mapping;
+}
+
+bool fitsDisplayMapping(const DisplayMapping& mapping, const cv::Mat& native)
+{
+    return mapping.depth == native.depth() && std::all_of(std::begin(mapping.bands), std::end(mapping.bands),
+                                                          [&native](int band)-> bool
+                                                          {
+                                                              return band >= 0 && band < native.channels();
+                                                          });
+}
+
+std::vector<uchar> displayLut(const DisplayMapping& mapping)
+{
+    std::vector<uchar> lut(mapping.depth == CV_16U ? 65536 : 256);
+    const double range = std::max(mapping.high - mapping.low, 1e-6);
+    const double exponent = 1. / std::max(mapping.gamma, 1e-3);
+    for (size_t value = 0; value < lut.size(); value++)
+    {
+        const double t = std::clamp((value - mapping.low) / range, 0., 1.);
+        lut[value] = static_cast<uchar>(std::lround(255. * std::pow(t, exponent)));
+    }
+    return lut;
+}
+
+template <typename T>
+static void renderBands(const cv::Mat& native, const int bands[3], const std::vector<uchar>& lut, QImage* display)
+{
+    const int channels = native.channels();
+    const uchar* table = lut.data();
+    // Detaches once when the previous rendering is still shared, e.g. with a running segmentation
+    uchar* bits = display->bits();
+    const qsizetype bytesPerLine = display->bytesPerLine();
+    cv::parallel_for_(cv::Range(0, native.rows), [&](const cv::Range& range)-> void
+    {
+        for (int y = range.start; y < range.end; y++)
+        {
+            const T* source = native.ptr<T>(y);
+            uchar* target = bits + y * bytesPerLine;
+            for (int x = 0; x < native.cols; x++)
+            {
+                const T* pixel = source + x * channels;
+                target[3 * x] = table[pixel[bands[0]]];
+                target[3 * x + 1] = table[pixel[bands[1]]];
+                target[3 * x + 2] = table[pixel[bands[2]]];
+            }
+        }
+    }, cv::getNumThreads());
+}
+
+void renderDisplay(const cv::Mat& native, const DisplayMapping& mapping, const std::vector<uchar>& lut,
+                   QImage* display)
+{
+    if (display->size() != QSize(native.cols, native.rows) || display->format() != QImage::Format_RGB888)
+    {
+        *display = QImage(native.cols, native.rows, QImage::Format_RGB888);
+    }
+    CV_Assert(lut.size() == (native.depth() == CV_16U ? 65536u : 256u));
+    int bands[3];
+    for (int i = 0; i < 3; i++)
+    {
+        bands[i] = std::clamp(mapping.bands[i], 0, native.channels() - 1);
+    }
+    if (native.depth() == CV_16U)
+    {
+        renderBands<quint16>(native, bands, lut, display);
+    }
+    else
+    {
+        renderBands<uchar>(native, bands, lut, display);
+    }
+}
+
+DecodedImage decodeImage(const QString& file, const DisplayMapping* preferred)
+{
+    DecodedImage decoded;
+    decoded.native = readNativeImage(file);
+    if (!needsDisplayMapping(decoded.native))
+    {
+        decoded.display = decoded.native.empty() ? QImage() : qImageView(decoded.native);
+        decoded.native = cv::Mat();
+        return decoded;
+    }
+    decoded.mapping = preferred && fitsDisplayMapping(*preferred, decoded.native)
+                          ? *preferred
+                          : defaultDisplayMapping(decoded.native);
+    renderDisplay(decoded.native, decoded.mapping, displayLut(decoded.mapping), &decoded.display);
+    return decoded;
+}
+
+QImage readPreviewImage(const QString& file, int maxSide)
+{
+    QImageReader reader(file);
+    reader.setAutoTransform(true);
+    const QSize size = reader.size();
+    if (!size.isValid() || !reader.supportsOption(QImageIOHandler::ScaledSize))
+    {
+        return QImage();
+    }
+    if (std::max(size.width(), size.height()) > maxSide)
+    {
+        reader.setScaledSize(size.scaled(maxSide, maxSide, Qt::KeepAspectRatio));
+    }
+    return reader.read();
+}
@@ -0,0 +1,149 @@
+#include "edge_map.h"
+#include "mat_bridge.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <cmath>
+
+cv::Mat computeEdgeMap(const QImage& image)
+{
+    cv::Mat gray;
+    cv::cvtColor(matView(image), gray, cv::COLOR_RGB2GRAY);
+    cv::GaussianBlur(gray, gray, cv::Size(5, 5), 1.4);
+    cv::Mat dx, dy;
+    cv::Sobel(gray, dx, CV_16S, 1, 0, 3);
+    cv::Sobel(gray, dy, CV_16S, 0, 1, 3);
+
+    // L1 gradient histogram on a subsample, Canny is then run on the same L1 norm
+    std::vector<quint64> histogram(2 * 1020 + 1, 0);
+    quint64 count = 0;
+    for (int y = 0; y < gray.rows; y += 2)
+    {
+        const auto* lineX = dx.ptr<short>(y);
+        const auto* lineY = dy.ptr<short>(y);
+        for (int x = 0; x < gray.cols; x += 2)
+        {
+            histogram[std::abs(lineX[x]) + std::abs(lineY[x])]++;
+            count++;
+        }
+    }
+    int high = 1;
+    quint64 seen = 0;
+    for (int value = 0; value < static_cast<int>(histogram.size()); value++)
+    {
+        seen += histogram[value];
+        if (seen * 10 >= count * 9)
+        {
+            high = std::max(value, 1);
+            break;
+        }
+    }
+
+    cv::Mat edges;
+    cv::Canny(dx, dy, edges, 0.4 * high, high, false);
+    return edges;
+}
+
+void appendClippedDisc(const cv::Mat& edges, int x, int y, int penSize, QVector<QLine>* spans)
+{
+    // Same disc as ImageMask::drawFillCircle
+    const double radius = penSize / 2. + 0.5;
+    const double cx = x + penSize / 2.;
+    const double cy = y + penSize / 2.;
+    const int top = std::max(static_cast<int>(std::floor(cy - radius)), 0);
+    const int bottom = std::min(static_cast<int>(std::ceil(cy + radius)), edges.rows - 1);
+    const int left = std::max(static_cast<int>(std::floor(cx - radius)), 0);
+    const int right = std::min(static_cast<int>(std::ceil(cx + radius)), edges.cols - 1);
+    if (top > bottom || left > right)
+    {
+        return;
+    }
+    const int w = right - left + 1;
+    const int h = bottom - top + 1;
+
+    enum : uchar
+    {
+        Outside,
+        Open,
+        Edge,
+        Reached
+    };
+    // Reused between stamps, a stroke sends hundreds of them
+    thread_local std::vector<uchar> cells;
+    thread_local std::vector<int> stack;
+    cells.assign(size_t(w) * h, Outside);
+    for (int py = top; py <= bottom; py++)
+    {
+        const double dy = py + 0.5 - cy;
+        const double d2 = radius * radius - dy * dy;
+        if (d2 < 0)
+        {
+            continue;
+        }
+        const double half = std::sqrt(d2);
+        const int x0 = std::max(static_cast<int>(std::ceil(cx - half - 0.5)), left);
+        const int x1 = std::min(static_cast<int>(std::floor(cx + half - 0.5)), right);
+        const uchar* edge = edges.ptr<uchar>(py);
+        uchar* cell = cells.data() + size_t(py - top) * w - left;
+        for (int px = x0; px <= x1; px++)
+        {
+            cell[px] = edge[px] ? Edge : Open;
+        }
+    }
+
+    // 4-connected flood from the center, one pixel wide 8-connected edges can't be crossed that way
+    const int sx = std::clamp(static_cast<int>(cx), left, right) - left;
+    const int sy = std::clamp(static_cast<int>(cy), top, bottom) - top;
+    if (cells[size_t(sy) * w + sx] == Outside)
+    {
+        return;
+    }
+    stack.clear();
+    cells[size_t(sy) * w + sx] = Reached;
+    stack.push_back(sy * w + sx);
+    while (!stack.empty())
+    {
+        const int i = stack.back();
+        stack.pop_back();
+        const int px = i % w;
+        const int py = i / w;
+        const int neighbors[4][2] = {{px - 1, py}, {px + 1, py}, {px, py - 1}, {px, py + 1}};
+        for (const auto& n : neighbors)
+        {
+            if (n[0] < 0 || n[0] >= w || n[1] < 0 || n[1] >= h)
+            {
+                continue;
+            }
+            uchar& cell = cells[size_t(n[1]) * w + n[0]];
+            if (cell == Open)
+            {
+                cell = Reached;
+                stack.push_back(n[1] * w + n[0]);
+            }
+            else if (cell == Edge)
+            {
+                // The edge itself is painted, the flood stops there
+                cell = Reached;
+            }
+        }
+    }
+
+    for (int py = 0; py < h; py++)
+    {
+        const uchar* cell = cells.data() + size_t(py) * w;
+        int start = -1;
+        for (int px = 0; px <= w; px++)
+        {
+            const bool reached = px < w && cell[px] == Reached;
+            if (reached && start < 0)
+            {
+                start = px;
+            }
+            else if (!reached && start >= 0)
+            {
+                spans->append(QLine(left + start, top + py, left + px - 1, top + py));
+                start = -1;
+            }
+        }
+    }
+}
@@ -0,0 +1,349 @@
+#include "evaluation.h"
+#include "utils.h"
+#include "job_scheduler.h"
+
+#include <QDir>
+#include <QDirIterator>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QSet>
+#include <algorithm>
+#include <vector>
+
+static const QString WATERSHED_SUFFIX = "_watershed_mask.png";
+static const QString MASK_SUFFIX = "_mask.png";
+static const QString COLOR_SUFFIX = "_color_mask.png";
+
+// Relative paths of the annotated images of a tree, without their mask suffix
+static QSet<QString> annotatedBases(const QString& root)
+{
+    QSet<QString> bases;
+    const QDir dir(root);
+    QDirIterator it(root, {"*" + MASK_SUFFIX}, QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext())
+    {
+        const QString file = dir.relativeFilePath(it.next());
+        if (file.endsWith(WATERSHED_SUFFIX))
+        {
+            bases.insert(file.chopped(WATERSHED_SUFFIX.size()));
+        }
+        else if (!file.endsWith(COLOR_SUFFIX))
+        {
+            bases.insert(file.chopped(MASK_SUFFIX.size()));
+        }
+    }
+    return bases;
+}
+
+// Final labels of an annotation as readAnnotationLabels picks them, from its path without suffix
+static QImage loadLabels(const QString& base)
+{
+    QImage ids = readIdImage(base + WATERSHED_SUFFIX);
+    if (ids.isNull() || isFullZero(ids))
+    {
+        ids = readIdImage(base + MASK_SUFFIX);
+    }
+    return ids;
+}
+
+// Adds the joint histogram of the classes of two id planes of the same size to counts, classes squared entries
+static void countConfusion(const QImage& gold, const QImage& annotated, const quint16* classOf, int classes,
+                           quint64* counts)
+{
+    const int size = classes * classes;
+    const int width = gold.width();
+    // Four interleaved histograms: neighbor pixels of the same pair of classes, the common case, don't wait on each
+    // other's increment
+    std::vector<quint64> histograms(4 * size, 0);
+    quint64* h0 = histograms.data();
+    quint64* h1 = h0 + size;
+    quint64* h2 = h1 + size;
+    quint64* h3 = h2 + size;
+    std::vector<quint32> joint(width);
+    for (int y = 0; y < gold.height(); y++)
+    {
+        const auto* g = reinterpret_cast<const quint16*>(gold.constScanLine(y));
+        const auto* a = reinterpret_cast<const quint16*>(annotated.constScanLine(y));
+        for (int x = 0; x < width; x++)
+        {
+            joint[x] = classOf[g[x]] * classes + classOf[a[x]];
+        }
+        int x = 0;
+        for (; x + 4 <= width; x += 4)
+        {
+            h0[joint[x]]++;
+            h1[joint[x + 1]]++;
+            h2[joint[x + 2]]++;
+            h3[joint[x + 3]]++;
+        }
+        for (; x < width; x++)
+        {
+            h0[joint[x]]++;
+        }
+    }
+    for (int i = 0; i < size; i++)
+    {
+        counts[i] += h0[i] + h1[i] + h2[i] + h3[i];
+    }
+}
+
+// Diagonal share of a matrix whose last class is the watershed border, border pixels left out
+static double pixelAccuracy(const QVector<quint64>& confusion, int classes)
+{
+    quint64 total = 0;
+    quint64 diagonal = 0;
+    for (int gold = 0; gold < classes - 1; gold++)
+    {
+        for (int annotated = 0; annotated < classes - 1; annotated++)
+        {
+            total += confusion[gold * classes + annotated];
+        }
+        diagonal += confusion[gold * classes + gold];
+    }
+    return total ? double(diagonal) / total : 1.;
+}
+
+double EvaluationResult::iou(int c) const
+{
+    quint64 gold = 0;
+    quint64 annotated = 0;
+    for (int i = 0; i < classes.size(); i++)
+    {
+        gold += at(c, i);
+        annotated += at(i, c);
+    }
+    const quint64 intersection = at(c, c);
+    const quint64 united = gold + annotated - intersection;
+    return united ? double(intersection) / united : -1.;
+}
+
+double EvaluationResult::meanIou() const
+{
+    double sum = 0;
+    int present = 0;
+    for (int c = 0; c < classes.size() - 2; c++)
+    {
+        const double value = iou(c);
+        if (value >= 0)
+        {
+            sum += value;
+            present++;
+        }
+    }
+    return present ? sum / present : 1.;
+}
+
+double EvaluationResult::accuracy() const
+{
+    return pixelAccuracy(confusion, classes.size());
+}
+
+EvaluationJob::EvaluationJob(const QString& goldRoot, const QString& annotatedRoot, const Name2Labels& labels,
+                             QObject* parent)
+    : QObject(parent), _goldRoot(goldRoot), _annotatedRoot(annotatedRoot)
+{
+    // Names are resolved here once, the comparison only sees class indices
+    QVector<const LabelInfo*> sorted;
+    for (const LabelInfo& label : labels)
+    {
+        if (label.id >= 0 && label.id <= MAX_LABEL_ID)
+        {
+            sorted.append(&label);
+        }
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [](const LabelInfo* a, const LabelInfo* b)-> bool
+    {
+        return a->id < b->id;
+    });
+    QSet<int> seen;
+    for (const LabelInfo* label : sorted)
+    {
+        if (!seen.contains(label->id))
+        {
+            seen.insert(label->id);
+            _result.classes.append(label->name);
+            _result.ids.append(label->id);
+        }
+    }
+    _result.classes << "(no label)" << "(border)";
+    _result.ids << -1 << -1;
+    const int classes = _result.classes.size();
+    _result.confusion.fill(0, classes * classes);
+
+    _classOf.fill(static_cast<quint16>(classes - 2), WATERSHED_BORDER_ID + 1);
+    for (int c = 0; c < classes - 2; c++)
+    {
+        _classOf[_result.ids[c]] = static_cast<quint16>(c);
+    }
+    _classOf[WATERSHED_BORDER_ID] = static_cast<quint16>(classes - 1);
+
+    const QSet<QString> gold = annotatedBases(_goldRoot);
+    const QSet<QString> annotated = annotatedBases(_annotatedRoot);
+    for (const QString& base : gold)
+    {
+        if (annotated.contains(base))
+        {
+            _pairs.append(base);
+        }
+    }
+    std::sort(_pairs.begin(), _pairs.end());
+    _result.missing = gold.size() - _pairs.size();
+    _result.extra = annotated.size() - _pairs.size();
+
+    connect(&_watcher, &QFutureWatcher<void>::progressValueChanged, this, &EvaluationJob::progressChanged);
+    connect(&_watcher, &QFutureWatcher<void>::finished, this, [this]()-> void
+    {
+        std::sort(_result.images.begin(), _result.images.end());
+        emit finished(_watcher.isCanceled());
+    });
+}
+
+void EvaluationJob::start()
+{
+    // One image pair per task, only the two planes being compared are in memory
+    _watcher.setFuture(JobScheduler::instance().map(JobClass::Background, _pairs, [this](const QString& base)-> void
+    {
+        _compare(base);
+    }));
+}
+
+void EvaluationJob::waitForFinished()
+{
+    _watcher.waitForFinished();
+    std::sort(_result.images.begin(), _result.images.end());
+}
+
+void EvaluationJob::cancel()
+{
+    _watcher.cancel();
+}
+
+void EvaluationJob::_compare(const QString& base)
+{
+    const QImage gold = loadLabels(_goldRoot + "/" + base);
+    const QImage annotated = loadLabels(_annotatedRoot + "/" + base);
+    if (gold.isNull() || annotated.isNull() || gold.size() != annotated.size())
+    {
+        QMutexLocker lock(&_mutex);
+        _result.mismatched++;
+        return;
+    }
+
+    const int classes = _result.classes.size();
+    QVector<quint64> counts(classes * classes, 0);
+    countConfusion(gold, annotated, _classOf.constData(), classes, counts.data());
+    QMutexLocker lock(&_mutex);
+    for (int i = 0; i < counts.size(); i++)
+    {
+        _result.confusion[i] += counts[i];
+    }
+    _result.images.append({base, pixelAccuracy(counts, classes)});
+}
+
+QString formatEvaluationReport(const EvaluationResult& result)
+{
+    const int classes = result.classes.size();
+    QString report = "id,label,iou,precision,recall,gold_pixels,annotated_pixels\n";
+    for (int c = 0; c < classes; c++)
+    {
+        quint64 gold = 0;
+        quint64 annotated = 0;
+        for (int i = 0; i < classes; i++)
+        {
+            gold += result.at(c, i);
+            annotated += result.at(i, c);
+        }
+        if (gold == 0 && annotated == 0)
+        {
+            continue;
+        }
+        report += QString("%1,%2,%3,%4,%5,%6,%7\n")
+                  .arg(result.ids[c] >= 0 ? QString::number(result.ids[c]) : QString())
+                  .arg(result.classes[c])
+                  .arg(result.iou(c), 0, 'f', 4)
+                  .arg(annotated ? double(result.at(c, c)) / annotated : 0., 0, 'f', 4)
+                  .arg(gold ? double(result.at(c, c)) / gold : 0., 0, 'f', 4)
+                  .arg(gold)
+                  .arg(annotated);
+    }
+    report += QString("mean IoU %1, pixel accuracy %2 over %3 images; %4 only in gold, %5 only annotated, "
+                      "%6 of different sizes\n")
+              .arg(result.meanIou(), 0, 'f', 4)
+              .arg(result.accuracy(), 0, 'f', 4)
+              .arg(result.images.size())
+              .arg(result.missing)
+              .arg(result.extra)
+              .arg(result.mismatched);
+    return report;
+}
+
+static bool writeText(const QString& file, const QByteArray& data)
+{
+    QSaveFile out(file);
+    return out.open(QIODevice::WriteOnly) && out.write(data) == data.size() && out.commit();
+}
+
+bool writeEvaluationReports(const EvaluationResult& result, const QString& directory)
+{
+    const int classes = result.classes.size();
+    QJsonArray classArray;
+    QJsonArray matrix;
+    QString confusionCsv = "gold \\ annotated";
+    for (int c = 0; c < classes; c++)
+    {
+        confusionCsv += ",\"" + result.classes[c] + "\"";
+    }
+    confusionCsv += "\n";
+    for (int c = 0; c < classes; c++)
+    {
+        quint64 gold = 0;
+        quint64 annotated = 0;
+        QJsonArray row;
+        confusionCsv += "\"" + result.classes[c] + "\"";
+        for (int i = 0; i < classes; i++)
+        {
+            gold += result.at(c, i);
+            annotated += result.at(i, c);
+            row.append(double(result.at(c, i)));
+            confusionCsv += "," + QString::number(result.at(c, i));
+        }
+        confusionCsv += "\n";
+        matrix.append(row);
+        QJsonObject object;
+        object["name"] = result.classes[c];
+        object["id"] = result.ids[c];
+        object["iou"] = result.iou(c);
+        object["gold_pixels"] = double(gold);
+        object["annotated_pixels"] = double(annotated);
+        classArray.append(object);
+    }
+    QJsonArray imageArray;
+    QString imagesCsv = "image,pixel_accuracy\n";
+    for (const auto& image : result.images)
+    {
+        QJsonObject object;
+        object["image"] = image.first;
+        object["pixel_accuracy"] = image.second;
+        imageArray.append(object);
+        imagesCsv += QString("\"%1\",%2\n").arg(image.first).arg(image.second, 0, 'f', 4);
+    }
+
+    QJsonObject root;
+    root["classes"] = classArray;
+    root["confusion"] = matrix;
+    root["mean_iou"] = result.meanIou();
+    root["pixel_accuracy"] = result.accuracy();
+    root["images"] = imageArray;
+    root["only_in_gold"] = result.missing;
+    root["only_annotated"] = result.extra;
+    root["size_mismatches"] = result.mismatched;
+
+    QDir().mkpath(directory);
+    return writeText(directory + "/evaluation.json", QJsonDocument(root).toJson())
+        && writeText(directory + "/evaluation_classes.csv", formatEvaluationReport(result).section('\n', 0, -3)
+                                                                .append('\n').toUtf8())
+        && writeText(directory + "/evaluation_confusion.csv", confusionCsv.toUtf8())
+        && writeText(directory + "/evaluation_images.csv", imagesCsv.toUtf8());
+}
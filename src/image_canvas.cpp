@@ -5,9 +5,16 @@
 #include <QDir>
 #include <QScrollBar>
 #include <QMouseEvent>
+#include <QEventPoint>
+#include <QScreen>
+#include <QElapsedTimer>
+#include <QImageReader>
+#include <cstring>
 
 #include "image_canvas.h"
 #include "main_window.h"
+#include "job_scheduler.h"
+#include "plane_pool.h"
 
 ImageCanvas::ImageCanvas(QScrollArea* parent, MainWindow* mainWindow) : _mainWindow(mainWindow), _scrollArea(parent)
 {
@@ -23,6 +30,31 @@ ImageCanvas::ImageCanvas(QScrollArea* parent, MainWindow* mainWindow) : _mainWin
     _undoList.clear();
     _undoIndex = 0;
     _undo = false;
+    _paletteGeneration = _mainWindow->paletteGeneration;
+    _savedMaskKey = 0;
+    _savedMaskHash = 0;
+    _savedWatershedKey = 0;
+    _savedWatershedHash = 0;
+    _savedColorGeneration = -1;
+    _imagePending = false;
+    _maskPending = false;
+    // A tab is opened to be shown
+    _shown = true;
+    _savePending = false;
+    connect(&_saver, &QFutureWatcher<SavedMask>::finished, this, &ImageCanvas::_applySavedMask);
+    connect(&_imageLoader, &QFutureWatcher<DecodedImage>::finished, this, &ImageCanvas::_applyDecodedImage);
+    connect(&_maskLoader, &QFutureWatcher<DecodedMask>::finished, this, &ImageCanvas::_applyDecodedMask);
+    _edgesKey = 0;
+    _compositeImageKey = 0;
+    _compositeMaskKey = 0;
+    _compositeWatershedKey = 0;
+    _compositeOverlayKey = 0;
+    _compositeAlpha = 0;
+    connect(&_edgeLoader, &QFutureWatcher<cv::Mat>::finished, this, &ImageCanvas::_applyEdgeMap);
+
+    // Move events are only collected as they arrive; rasterization, the status bar and the repaint run once per frame
+    _frameTimer.setSingleShot(true);
+    connect(&_frameTimer, &QTimer::timeout, this, &ImageCanvas::_processPendingInput);
 
     _scrollArea->setBackgroundRole(QPalette::Dark);
     _scrollArea->setWidget(this);
@@ -43,27 +75,152 @@ void ImageCanvas::_initPixmap()
     setPixmap(newPixmap);
 }
 
+ImageCanvas::~ImageCanvas()
+{
+    // A tab closed while its files are written lets the write finish
+    _saver.waitForFinished();
+}
+
 void ImageCanvas::setLabelColor(const int id)
 {
-    _labelColor.id = QColor(id, id, id);
-    _labelColor.color = _mainWindow->id_labels[id]->color;
+    _labelColor.id = id;
+    const LabelInfo* label = _mainWindow->id_labels[id];
+    _labelColor.color = label ? label->color : QColor(255, 255, 255);
+}
+
+// Smallest rectangle holding every pixel where two id planes of the same size differ, empty when none does
+static QRect changedRect(const QImage& before, const QImage& after)
+{
+    const qsizetype lineSize = qsizetype(after.width()) * sizeof(quint16);
+    QRect rect;
+    for (int y = 0; y < after.height(); y++)
+    {
+        const auto* a = reinterpret_cast<const quint16*>(before.constScanLine(y));
+        const auto* b = reinterpret_cast<const quint16*>(after.constScanLine(y));
+        if (memcmp(a, b, lineSize) == 0)
+        {
+            continue;
+        }
+        int left = 0;
+        while (a[left] == b[left])
+        {
+            left++;
+        }
+        int right = after.width() - 1;
+        while (a[right] == b[right])
+        {
+            right--;
+        }
+        rect |= QRect(QPoint(left, y), QPoint(right, y));
+    }
+    return rect;
 }
 
 void ImageCanvas::setActionMask(const ImageMask& mask)
 {
+    if (!isLoaded())
+    {
+        return;
+    }
+    // Journaled by what changed: a paste usually covers a part of the image, a clear needs no pixels at all
+    if (mask.id.size() != _mask.id.size())
+    {
+        _journal.appendSnapshot(mask.id);
+    }
+    else if (isFullZero(mask.id))
+    {
+        _journal.appendClear();
+    }
+    else
+    {
+        const QRect rect = changedRect(_mask.id, mask.id);
+        if (!rect.isEmpty())
+        {
+            _journal.appendPaste(rect, mask.id);
+        }
+    }
     _mask = mask;
+    _pushUndoState();
+}
+
+void ImageCanvas::_pushUndoState()
+{
+    if (_undo)
+    {
+        // A new edit drops the states that were undone
+        while (_undoList.size() > _undoIndex)
+        {
+            _undoList.removeLast();
+        }
+        _undo = false;
+        _mainWindow->redo_action->setEnabled(false);
+    }
     _undoList.push_back(_mask);
     _undoIndex++;
+    _journal.appendStep();
     _mainWindow->setStarAtNameOfTab(true);
     _mainWindow->undo_action->setEnabled(true);
 }
 
+void ImageCanvas::setDisplayMapping(const DisplayMapping& mapping)
+{
+    if (_native.empty())
+    {
+        return;
+    }
+    _displayMapping = mapping;
+    renderDisplay(_native, _displayMapping, displayLut(_displayMapping), &_image);
+    // Results computed on the previous rendering no longer match it
+    _watershedCache.clear();
+    _edges = cv::Mat();
+    if (_mainWindow->edge_snapping_action->isChecked())
+    {
+        prepareEdgeMap();
+    }
+    update();
+}
+
+void ImageCanvas::seedMask(const QImage& markers)
+{
+    ImageMask mask(_imageSize);
+    mask.id = markers;
+    mask.updateColor(_mainWindow->id_labels);
+    if (_undoList.isEmpty())
+    {
+        _undoList.push_back(_mask);
+        _undoIndex++;
+    }
+    setActionMask(mask);
+}
+
 void ImageCanvas::setWatershedMask(const QImage& watershed)
 {
     _watershed.id = watershed;
     idToColor(_watershed.id, _mainWindow->id_labels, &_watershed.color);
 }
 
+void ImageCanvas::updateMaskColor()
+{
+    // Canvases recolor lazily: only the visible one follows each palette edit right away
+    if (!isLoaded() || _paletteGeneration == _mainWindow->paletteGeneration)
+    {
+        return;
+    }
+    _paletteGeneration = _mainWindow->paletteGeneration;
+    _mask.updateColor(_mainWindow->id_labels);
+    if (!_watershed.id.isNull())
+    {
+        _watershed.updateColor(_mainWindow->id_labels);
+    }
+    update();
+}
+
+void ImageCanvas::setOverlay(const QImage& overlay)
+{
+    _overlay = overlay;
+    update();
+}
+
 void ImageCanvas::setPenSize(const int penSize)
 {
     _penSize = penSize;
@@ -83,10 +240,24 @@ QImage ImageCanvas::getImage() const
 
 void ImageCanvas::loadImage(const QString& filePath)
 {
-    if (!_image.isNull())
+    if (isLoaded() && !_image.isNull())
     {
         saveMask();
     }
+    _load(filePath);
+}
+
+void ImageCanvas::reloadFromDisk()
+{
+    // The planes in memory are stale, saving them would overwrite what was just written
+    _load(_imageFilePath);
+}
+
+void ImageCanvas::_load(const QString& filePath)
+{
+    waitUntilLoaded();
+    // The files are read again, the write in progress is part of them
+    waitUntilSaved();
 
     _imageFilePath = filePath;
     QFileInfo file(_imageFilePath);
@@ -95,61 +266,438 @@ void ImageCanvas::loadImage(const QString& filePath)
         return;
     }
 
-    _image = mat2QImage(cv::imread(_imageFilePath.toStdString()));
-
     _maskFilePath = file.dir().absolutePath() + "/" + file.completeBaseName() + "_mask.png";
     _watershedFilePath = file.dir().absolutePath() + "/" + file.completeBaseName() + "_watershed_mask.png";
 
-    _watershed = ImageMask(_image.size());
+    // The tab shows up with a preview, the full image and the mask are decoded side by side in workers
+    QImageReader reader(_imageFilePath);
+    reader.setAutoTransform(true);
+    _imageSize = reader.size();
+    if (reader.transformation() & QImageIOHandler::TransformationRotate90)
+    {
+        _imageSize.transpose();
+    }
+    _preview = readPreviewImage(_imageFilePath, 1024);
+    _image = QImage();
+    _native = cv::Mat();
+    _edges = cv::Mat();
+    // The edge map of the previous image is of no use if it hasn't started yet
+    _edgeToken.cancel();
+    _mask = ImageMask();
+    _watershed = ImageMask();
+    _watershedCache.clear();
+    _overlay = QImage();
+    _composite = QImage();
     _undoList.clear();
     _undoIndex = 0;
-    if (QFile(_maskFilePath).exists())
+    _paletteGeneration = _mainWindow->paletteGeneration;
+    _savedMaskKey = 0;
+    _savedMaskHash = 0;
+    _savedWatershedKey = 0;
+    _savedWatershedHash = 0;
+    _savedColorGeneration = -1;
+    _maskFileTime = QDateTime();
+    _journal.setFile(StrokeJournal::journalPath(_imageFilePath), _imageSize);
+    _mainWindow->undo_action->setEnabled(false);
+    _mainWindow->redo_action->setEnabled(false);
+
+    _imagePending = true;
+    _maskPending = true;
+    const std::optional<DisplayMapping> preferred = _mainWindow->displayMapping;
+    _decodeToken = CancelToken();
+    _imageLoader.setFuture(JobScheduler::instance().run(_loadClass(), [filePath, preferred]()-> DecodedImage
     {
-        _mask = ImageMask(_maskFilePath, _mainWindow->id_labels);
-        // mainWindow->runWatershed(this); // ui->button_watershed->released());
-        // mainWindow->ui->checkbox_manuel_mask->setChecked(true);
+        return decodeImage(filePath, preferred ? &*preferred : Q_NULLPTR);
+    }, _decodeToken));
+    const QString maskFile = _maskFilePath;
+    const QString watershedFile = _watershedFilePath;
+    const Id2Labels labels = _mainWindow->id_labels;
+    _maskLoader.setFuture(JobScheduler::instance().run(_loadClass(), [maskFile, watershedFile, labels]()-> DecodedMask
+    {
+        DecodedMask decoded;
+        if (QFile::exists(maskFile))
+        {
+            decoded.mask = ImageMask(maskFile, labels);
+        }
+        // Only hashed: a segmentation giving the same labels again doesn't rewrite the file
+        const QImage watershed = QFile::exists(watershedFile) ? readIdImage(watershedFile) : QImage();
+        if (!watershed.isNull())
+        {
+            decoded.watershedHash = contentHash(watershed);
+        }
+        return decoded;
+    }, _decodeToken));
+
+    resize(_scale * _imageSize);
+    update();
+}
+
+void ImageCanvas::waitUntilLoaded()
+{
+    _imageLoader.waitForFinished();
+    _maskLoader.waitForFinished();
+    _applyDecodedImage();
+    _applyDecodedMask();
+}
+
+void ImageCanvas::_applyDecodedImage()
+{
+    if (!_imagePending)
+    {
+        return;
+    }
+    _imagePending = false;
+    const DecodedImage decoded = _imageLoader.result();
+    _image = decoded.display;
+    _native = decoded.native;
+    _displayMapping = decoded.mapping;
+    _preview = QImage();
+    if (_image.size() != _imageSize)
+    {
+        // Headers some readers can't size, or orientations they don't report
+        _imageSize = _image.size();
+        _journal.setFile(StrokeJournal::journalPath(_imageFilePath), _imageSize);
+        resize(_scale * _imageSize);
+    }
+    _watershed = ImageMask(_imageSize);
+    // The watershed on disk isn't read back, only its hash: this blank plane is written over it once it changes
+    _savedWatershedKey = _watershed.id.cacheKey();
+    if (_mainWindow->edge_snapping_action->isChecked())
+    {
+        prepareEdgeMap();
+    }
+    update();
+    // A mask decoded first waited for the size of the image
+    if (_maskLoader.isFinished())
+    {
+        _applyDecodedMask();
+    }
+}
+
+void ImageCanvas::_applyDecodedMask()
+{
+    if (!_maskPending || _imagePending)
+    {
+        // The mask is settled against the size of the decoded image
+        return;
+    }
+    _maskPending = false;
+    const DecodedMask decoded = _maskLoader.result();
+    _mask = decoded.mask;
+    _savedWatershedHash = decoded.watershedHash;
+    _maskFileTime = QFileInfo(_maskFilePath).lastModified();
+    if (!_mask.id.isNull())
+    {
+        _savedMaskKey = _mask.id.cacheKey();
+        _savedMaskHash = contentHash(_mask.id);
         _undoList.push_back(_mask);
         _undoIndex++;
     }
     else
     {
-        clearMask();
+        _mask = ImageMask(_imageSize);
     }
-    _mainWindow->undo_action->setEnabled(false);
-    _mainWindow->redo_action->setEnabled(false);
 
-    setPixmap(QPixmap::fromImage(_image));
-    resize(_scale * _image.size());
+    // Edits that never reached the masks on disk before a crash are still in the journal
+    const QString journalFile = StrokeJournal::journalPath(_imageFilePath);
+    QFileInfo journal(journalFile);
+    if (journal.exists())
+    {
+        QFileInfo mask(_maskFilePath);
+        if (!mask.exists() || journal.lastModified() >= mask.lastModified())
+        {
+            const ImageMask saved = _mask;
+            int records = StrokeJournal::replay(journalFile, &_mask, _mainWindow->id_labels);
+            if (records > 0)
+            {
+                if (_undoList.isEmpty())
+                {
+                    _undoList.push_back(saved);
+                    _undoIndex++;
+                }
+                _undoList.push_back(_mask);
+                _undoIndex++;
+                // The recovered state becomes the base of the new journal, replayed on top of the mask on disk
+                _journal.appendSnapshot(_mask.id);
+                _journal.appendStep();
+                _journal.sync();
+                _mainWindow->ui->statusbar->showMessage(
+                    QString("Recovered %1 unsaved edits of %2").arg(records).arg(QFileInfo(_imageFilePath).fileName())
+                );
+            }
+            else
+            {
+                _journal.remove();
+            }
+        }
+        else
+        {
+            _journal.remove();
+        }
+    }
+    // The palette may have been edited while the mask was decoded with the old one
+    updateMaskColor();
+    update();
+    emit loaded();
 }
 
 void ImageCanvas::saveMask()
 {
+    if (!isLoaded())
+    {
+        return;
+    }
+    // One save at a time, the saved state each one compares against is the one the last left
+    waitUntilSaved();
     if (isFullZero(_mask.id))
     {
+        _journal.remove();
         return;
     }
 
-    _mask.id.save(_maskFilePath);
-    if (!_watershed.id.isNull())
+    // Planes still holding what is on disk are not encoded again, browsing annotated images writes nothing.
+    // The cache keys are compared here, hashing and encoding run in a worker on shallow copies of the planes.
+    SavedMask request;
+    request.imageFile = _imageFilePath;
+    request.mask = _mask.id;
+    request.watershed = _watershed.id;
+    request.paletteGeneration = _mainWindow->paletteGeneration;
+    const bool maskChanged = _mask.id.cacheKey() != _savedMaskKey;
+    const size_t savedMaskHash = _savedMaskHash;
+    const bool watershedChanged = !_watershed.id.isNull() && _watershed.id.cacheKey() != _savedWatershedKey;
+    const size_t savedWatershedHash = _savedWatershedHash;
+    const bool recolor = _savedColorGeneration >= 0 && _savedColorGeneration != request.paletteGeneration;
+    const QString maskFile = _maskFilePath;
+    const QString watershedFile = _watershedFilePath;
+    QFileInfo file(_imageFilePath);
+    const QString colorFile = file.dir().absolutePath() + "/" + file.completeBaseName() + "_color_mask.png";
+    const Id2Labels labels = _mainWindow->id_labels;
+    _savePending = true;
+    _saver.setFuture(JobScheduler::instance().run(JobClass::Save, [=]()-> SavedMask
+    {
+        SavedMask saved = request;
+        if (maskChanged)
+        {
+            saved.maskHash = contentHash(saved.mask);
+            if (savedMaskHash == 0 || saved.maskHash != savedMaskHash)
+            {
+                if (writeIdImage(saved.mask, maskFile))
+                {
+                    saved.maskWritten = true;
+                    saved.maskFileTime = QFileInfo(maskFile).lastModified();
+                }
+                else
+                {
+                    saved.maskFailed = true;
+                }
+            }
+        }
+        if (!saved.watershed.isNull())
+        {
+            bool color = recolor;
+            if (watershedChanged)
+            {
+                saved.watershedHash = contentHash(saved.watershed);
+                if (savedWatershedHash == 0 || saved.watershedHash != savedWatershedHash)
+                {
+                    if (writeIdImage(saved.watershed, watershedFile))
+                    {
+                        saved.watershedWritten = true;
+                        color = true;
+                    }
+                    else
+                    {
+                        saved.watershedFailed = true;
+                    }
+                }
+            }
+            if (color)
+            {
+                saved.colorWritten = idToColor(saved.watershed, labels).save(colorFile);
+                saved.colorFailed = !saved.colorWritten;
+            }
+        }
+        saved.indexMask = saved.watershed.isNull() || isFullZero(saved.watershed);
+        return saved;
+    }));
+}
+
+void ImageCanvas::waitUntilSaved()
+{
+    _saver.waitForFinished();
+    _applySavedMask();
+}
+
+void ImageCanvas::_applySavedMask()
+{
+    if (!_savePending)
     {
-        QImage watershed = _watershed.id;
-        // if (!_mainWindow->ui->checkbox_border_ws->isChecked())
-        // {
-        //     watershed = removeBorder(_watershed.id, _mainWindow->id_labels);
-        // }
-        watershed.save(_watershedFilePath);
-        QFileInfo file(_imageFilePath);
-        QString color_file = file.dir().absolutePath() + "/" + file.completeBaseName() + "_color_mask.png";
-        idToColor(watershed, _mainWindow->id_labels).save(color_file);
+        return;
     }
-    _undoList.clear();
-    _undoIndex = 0;
-    _mainWindow->setStarAtNameOfTab(false);
+    _savePending = false;
+    const SavedMask saved = _saver.result();
+    if (saved.maskHash != 0 && !saved.maskFailed)
+    {
+        _savedMaskKey = saved.mask.cacheKey();
+        _savedMaskHash = saved.maskHash;
+    }
+    if (saved.maskWritten)
+    {
+        _maskFileTime = saved.maskFileTime;
+    }
+    if (saved.watershedHash != 0 && !saved.watershedFailed)
+    {
+        _savedWatershedKey = saved.watershed.cacheKey();
+        _savedWatershedHash = saved.watershedHash;
+    }
+    if (saved.colorWritten)
+    {
+        _savedColorGeneration = saved.paletteGeneration;
+    }
+    // The index describes the files, a plane that didn't reach the disk isn't reported to it
+    if ((saved.maskWritten || saved.watershedWritten) && (saved.indexMask ? saved.maskWritten : saved.watershedWritten))
+    {
+        _mainWindow->indexSavedMask(saved.imageFile, saved.indexMask ? saved.mask : saved.watershed);
+    }
+
+    // A file that couldn't be written keeps the journal and the undo states, the edits can still be recovered, undone
+    // and saved again
+    if (!saved.maskFailed && !saved.watershedFailed && !saved.colorFailed)
+    {
+        if (_mask.id.cacheKey() != saved.mask.cacheKey())
+        {
+            // Edited while the files were written: the journal starts again from the current mask, on top of the
+            // one just written
+            _journal.remove();
+            _journal.appendSnapshot(_mask.id);
+            _journal.appendStep();
+        }
+        else
+        {
+            _journal.remove();
+            if (_watershed.id.cacheKey() == saved.watershed.cacheKey())
+            {
+                _undoList.clear();
+                _undoIndex = 0;
+                _mainWindow->setStarAtNameOfTab(false, this);
+            }
+        }
+    }
+    _mainWindow->updateExternalMaskFlag(this);
+}
+
+bool ImageCanvas::isMaskModifiedExternally() const
+{
+    // A file being written by this tab is settled once the write is done
+    if (!isLoaded() || _savePending)
+    {
+        return false;
+    }
+    const QFileInfo mask(_maskFilePath);
+    return mask.exists() ? mask.lastModified() != _maskFileTime : _maskFileTime.isValid();
+}
+
+MemoryUsage ImageCanvas::memoryUsage() const
+{
+    MemoryUsage usage;
+    usage.add(MemoryCategory::Image, _image);
+    usage.add(MemoryCategory::Image, _native);
+    usage.add(MemoryCategory::Image, _preview);
+    usage.add(MemoryCategory::Pixmap, pixmap());
+    usage.add(MemoryCategory::Mask, _mask.id);
+    usage.add(MemoryCategory::Mask, _mask.color);
+    usage.add(MemoryCategory::Watershed, _watershed.id);
+    usage.add(MemoryCategory::Watershed, _watershed.color);
+    for (const ImageMask& state : _undoList)
+    {
+        usage.add(MemoryCategory::Undo, state.id);
+        usage.add(MemoryCategory::Undo, state.color);
+    }
+    for (const QImage& result : _watershedCache.results())
+    {
+        usage.add(MemoryCategory::Cache, result);
+    }
+    usage.add(MemoryCategory::Cache, _overlay);
+    usage.add(MemoryCategory::Cache, _edges);
+    usage.add(MemoryCategory::Cache, _composite);
+    return usage;
+}
+
+void ImageCanvas::dropCaches()
+{
+    _watershedCache.clear();
+    _edges = cv::Mat();
+    _composite = QImage();
+    if (isLoaded())
+    {
+        _preview = QImage();
+    }
+}
+
+void ImageCanvas::prepareEdgeMap()
+{
+    if (_image.isNull() || !_edges.empty() || _edgeLoader.isRunning())
+    {
+        return;
+    }
+    const QImage image = _image;
+    _edgesKey = image.cacheKey();
+    _edgeToken = CancelToken();
+    _edgeLoader.setFuture(JobScheduler::instance().run(_loadClass(), [image]()-> cv::Mat
+    {
+        return computeEdgeMap(image);
+    }, _edgeToken));
+}
+
+void ImageCanvas::waitForEdgeMap()
+{
+    prepareEdgeMap();
+    _edgeLoader.waitForFinished();
+    _applyEdgeMap();
+}
+
+void ImageCanvas::setShown(const bool shown)
+{
+    _shown = shown;
+    JobScheduler::instance().setJobClass(_decodeToken, _loadClass());
+    JobScheduler::instance().setJobClass(_edgeToken, _loadClass());
+}
+
+void ImageCanvas::_applyEdgeMap()
+{
+    // Another image or display mapping came in while it was computed
+    if (_edgesKey != _image.cacheKey() || _edgeLoader.future().resultCount() == 0)
+    {
+        if (_mainWindow->edge_snapping_action->isChecked())
+        {
+            prepareEdgeMap();
+        }
+        return;
+    }
+    _edges = _edgeLoader.result();
+}
+
+bool ImageCanvas::trimUndo(const int states)
+{
+    // The first state is the base undo returns to, states before the current one are the only ones that can go
+    const int dropped = std::min<int>(_undoList.size() - std::max(states, 2), _undoIndex - 2);
+    if (dropped <= 0)
+    {
+        return false;
+    }
+    _undoList.erase(_undoList.begin() + 1, _undoList.begin() + 1 + dropped);
+    _undoIndex -= dropped;
+    return true;
+}
+
+void ImageCanvas::discardJournal()
+{
+    _journal.remove();
 }
 
 void ImageCanvas::scaleChanged(const double scale)
 {
-    resize(scale * _image.size());
+    resize(scale * _imageSize);
 
     // Adjust scrollbars
     if (QScrollBar* vScrollBar = _scrollArea->verticalScrollBar())
@@ -184,12 +732,35 @@ void ImageCanvas::alphaChanged(const double alpha)
 
 void ImageCanvas::mouseMoveEvent(QMouseEvent* event)
 {
-    qDebug() << "ImageCanvas::mouseMoveEvent";
-    _globalMousePosition = event->position().toPoint();
+    _mainWindow->inputRecorder.recordMouse(InputRecordType::MouseMove, event);
+    for (const QEventPoint& point : event->points())
+    {
+        _globalMousePosition = point.position().toPoint();
+        if (_leftButtonPressed && isLoaded())
+        {
+            _pendingStrokePoints.append(point.position());
+        }
+    }
+    _scheduleFrame();
+}
 
-    if (_leftButtonPressed)
+void ImageCanvas::_scheduleFrame()
+{
+    if (_frameTimer.isActive())
     {
-        _drawFillCircle(event);
+        return;
+    }
+    double refreshRate = screen() ? screen()->refreshRate() : 60.;
+    _frameTimer.start(qMax(1, qRound(1000. / qMax(1., refreshRate))));
+}
+
+void ImageCanvas::_processPendingInput()
+{
+    _frameTimer.stop();
+    if (!_pendingStrokePoints.isEmpty())
+    {
+        _drawStroke(_pendingStrokePoints);
+        _pendingStrokePoints.clear();
     }
 
     _mainWindow->ui->statusbar->showMessage(
@@ -201,11 +772,14 @@ void ImageCanvas::mouseMoveEvent(QMouseEvent* event)
 void ImageCanvas::mousePressEvent(QMouseEvent* e)
 {
     qDebug() << "ImageCanvas::mousePressEvent";
+    _mainWindow->inputRecorder.recordMouse(InputRecordType::MousePress, e);
     setFocus();
-    if (e->button() == Qt::LeftButton)
+    // Editing starts once the mask is in
+    if (e->button() == Qt::LeftButton && isLoaded())
     {
+        _processPendingInput();
         _leftButtonPressed = true;
-        _drawFillCircle(e);
+        _drawStroke({e->position()});
         update();
     }
 }
@@ -213,52 +787,38 @@ void ImageCanvas::mousePressEvent(QMouseEvent* e)
 void ImageCanvas::mouseReleaseEvent(QMouseEvent* event)
 {
     qDebug() << "ImageCanvas::mouseReleaseEvent";
+    _mainWindow->inputRecorder.recordMouse(InputRecordType::MouseRelease, event);
+    if (!isLoaded())
+    {
+        _leftButtonPressed = false;
+        return;
+    }
     if (event->button() == Qt::LeftButton)
     {
+        // The undo snapshot must contain every sample of the stroke
+        _processPendingInput();
         _leftButtonPressed = false;
 
-        if (_undo)
-        {
-            QMutableListIterator it(_undoList);
-            int i = 0;
-            while (it.hasNext())
-            {
-                it.next();
-                if (i++ >= _undoIndex)
-                    it.remove();
-            }
-            _undo = false;
-            _mainWindow->redo_action->setEnabled(false);
-        }
-        _undoList.push_back(_mask);
-        _undoIndex++;
-        _mainWindow->setStarAtNameOfTab(true);
-        _mainWindow->undo_action->setEnabled(true);
+        _pushUndoState();
     }
 
     if (event->button() == Qt::RightButton)
     {
         // selection of label
-        QColor maskColor = _mask.id.pixel(_globalMousePosition / _scale);
-        QColor watershedColor = _watershed.id.pixel(_globalMousePosition / _scale);
-        const LabelInfo* label = _mainWindow->id_labels[maskColor.red()]
-                                     ? _mainWindow->id_labels[maskColor.red()] :
-                                     _mainWindow->id_labels[watershedColor.red()];
+        const QPoint position = _globalMousePosition / _scale;
+        const int maskId = _mask.idAt(position.x(), position.y());
+        const int watershedId = _watershed.idAt(position.x(), position.y());
+        const LabelInfo* label = _mainWindow->id_labels[maskId]
+                                     ? _mainWindow->id_labels[maskId] :
+                                     _mainWindow->id_labels[watershedId];
         if (label)
         {
-            if (!_watershed.id.isNull() && _mainWindow->ui->checkbox_watershed_mask->isChecked())
+            if (!_watershed.id.isNull() && _mainWindow->ui->checkbox_watershed_mask->isChecked()
+                && _mainWindow->id_labels.contains(watershedId))
             {
-                QColor color = QColor(_watershed.id.pixel(_globalMousePosition / _scale));
-                QMap<int, const LabelInfo*>::const_iterator it = _mainWindow->id_labels.find(color.red());
-                if (it != _mainWindow->id_labels.end())
-                {
-                    label = it.value();
-                }
-            }
-            if (label->item)
-            {
-                emit _mainWindow->ui->list_label->currentItemChanged(label->item, Q_NULLPTR);
+                label = _mainWindow->id_labels[watershedId];
             }
+            _mainWindow->selectLabel(label->id);
             refresh();
         }
     }
@@ -278,6 +838,7 @@ void ImageCanvas::mouseReleaseEvent(QMouseEvent* event)
         }
 
         _mask.exchangeLabel(x, y, _mainWindow->id_labels, _labelColor);
+        _journal.appendFill(_labelColor.id, QPoint(x, y));
         update();
     }
 }
@@ -285,7 +846,8 @@ void ImageCanvas::mouseReleaseEvent(QMouseEvent* event)
 void ImageCanvas::keyPressEvent(QKeyEvent* event)
 {
     qDebug() << "ImageCanvas::keyPressEvent";
-    if (event->key() == Qt::Key_Space)
+    _mainWindow->inputRecorder.recordKey(event);
+    if (event->key() == Qt::Key_Space && isLoaded())
     {
         emit _mainWindow->ui->button_watershed->released();
     }
@@ -294,6 +856,7 @@ void ImageCanvas::keyPressEvent(QKeyEvent* event)
 void ImageCanvas::wheelEvent(QWheelEvent* event)
 {
     qDebug() << "ImageCanvas::wheelEvent";
+    _mainWindow->inputRecorder.recordWheel(event);
     int delta = event->angleDelta().y() > 0 ? 1 : -1;
     if (Qt::ShiftModifier == event->modifiers())
     {
@@ -317,28 +880,29 @@ void ImageCanvas::wheelEvent(QWheelEvent* event)
 void ImageCanvas::paintEvent(QPaintEvent* event)
 {
     qDebug() << "ImageCanvas::paintEvent";
+    QElapsedTimer timer;
+    timer.start();
     QPainter painter(this);
     painter.setRenderHint(QPainter::Antialiasing, false);
     QRect rect = painter.viewport();
-    QSize size = _scale * _image.size();
-    if (size != _image.size())
+    QSize size = _scale * _imageSize;
+    if (size != _imageSize)
     {
         rect.size().scale(size, Qt::KeepAspectRatio);
         painter.setViewport(rect.x(), rect.y(), size.width(), size.height());
-        painter.setWindow(pixmap().rect());
+        painter.setWindow(QRect(QPoint(0, 0), _imageSize));
     }
-    painter.drawImage(QPoint(0, 0), _image);
-    painter.setOpacity(_alpha);
-
-    if (!_mask.id.isNull() && _mainWindow->ui->checkbox_manuel_mask->isChecked())
+    if (_image.isNull())
     {
-        painter.drawImage(QPoint(0, 0), _mask.color);
+        painter.drawImage(QRect(QPoint(0, 0), _imageSize), _preview);
     }
-
-    if (!_watershed.id.isNull() && _mainWindow->ui->checkbox_watershed_mask->isChecked())
+    else
     {
-        painter.drawImage(QPoint(0, 0), _watershed.color);
+        // Image and overlays are blended ahead into one premultiplied buffer, the paint is a plain blit
+        _updateComposite();
+        painter.drawImage(QPoint(0, 0), _composite.isNull() ? _image : _composite);
     }
+    painter.setOpacity(_alpha);
 
     if (_globalMousePosition.x() > 10 && _globalMousePosition.y() > 10 &&
         _globalMousePosition.x() <= QLabel::size().width() - 10 &&
@@ -351,28 +915,132 @@ void ImageCanvas::paintEvent(QPaintEvent* event)
                             _penSize, _penSize);
     }
     painter.end();
+    emit painted(timer.nsecsElapsed());
 }
 
-void ImageCanvas::_drawFillCircle(const QMouseEvent* e)
+void ImageCanvas::_drawStroke(const QVector<QPointF>& positions)
 {
+    const qint64 maskKey = _mask.color.cacheKey();
+    QVector<QPoint> points;
+    points.reserve(positions.size());
     if (_penSize > 0)
     {
-        int x = e->position().x() / _scale - _penSize / 2;
-        int y = e->position().y() / _scale - _penSize / 2;
-        _mask.drawFillCircle(x, y, _penSize, _labelColor);
+        for (const QPointF& p : positions)
+        {
+            points.append(QPoint(p.x() / _scale - _penSize / 2, p.y() / _scale - _penSize / 2));
+        }
+        if (_mainWindow->edge_snapping_action->isChecked())
+        {
+            prepareEdgeMap();
+        }
+        // Until the edge map is there the brush stamps whole discs
+        if (_mainWindow->edge_snapping_action->isChecked() && _edges.size() == cv::Size(_mask.id.width(),
+                                                                                        _mask.id.height()))
+        {
+            QVector<QLine> spans;
+            for (const QPoint& p : points)
+            {
+                appendClippedDisc(_edges, p.x(), p.y(), _penSize, &spans);
+            }
+            _mask.drawSpans(spans, _labelColor);
+            _journal.appendSpans(_labelColor.id, spans);
+        }
+        else
+        {
+            _mask.drawFillCircles(points, _penSize, _labelColor);
+            _journal.appendStroke(_labelColor.id, _penSize, points);
+        }
     }
     else
     {
-        int x = (e->position().x() + 0.5) / _scale;
-        int y = (e->position().y() + 0.5) / _scale;
-        _mask.drawPixel(x, y, _labelColor);
+        for (const QPointF& p : positions)
+        {
+            points.append(QPoint((p.x() + 0.5) / _scale, (p.y() + 0.5) / _scale));
+        }
+        _mask.drawPixels(points, _labelColor);
+        _journal.appendStroke(_labelColor.id, 0, points);
+    }
+
+    // Discs are stamped from their top left corner, spans never leave them
+    QRect bounds;
+    for (const QPoint& p : points)
+    {
+        bounds |= QRect(p, QSize(1, 1));
     }
+    const int reach = std::max(_penSize, 0) + 1;
+    _compositeEdited(maskKey, bounds.adjusted(-1, -1, reach, reach));
+}
+
+void ImageCanvas::_compositeEdited(qint64 maskKey, const QRect& rect)
+{
+    // The composite was in step with the mask before this edit, only the region it touched is blended again
+    if (maskKey != 0 && maskKey == _compositeMaskKey)
+    {
+        _compositeDirty += rect;
+        _compositeMaskKey = _mask.color.cacheKey();
+    }
+}
+
+void ImageCanvas::_updateComposite()
+{
+    const bool showMask = !_mask.id.isNull() && _mainWindow->ui->checkbox_manuel_mask->isChecked();
+    const bool showWatershed = !_watershed.id.isNull() && _mainWindow->ui->checkbox_watershed_mask->isChecked();
+    QVector<const QImage*> layers;
+    if (showMask)
+    {
+        layers.append(&_mask.color);
+    }
+    if (showWatershed)
+    {
+        layers.append(&_watershed.color);
+    }
+    if (!_overlay.isNull())
+    {
+        layers.append(&_overlay);
+    }
+    for (const QImage* layer : layers)
+    {
+        if (layer->size() != _image.size())
+        {
+            // A plane of the previous image size while a new one settles, it can't be blended
+            return;
+        }
+    }
+
+    const qint64 maskKey = showMask ? _mask.color.cacheKey() : 0;
+    const qint64 watershedKey = showWatershed ? _watershed.color.cacheKey() : 0;
+    if (_composite.size() != _image.size() || _compositeImageKey != _image.cacheKey() || _compositeMaskKey != maskKey
+        || _compositeWatershedKey != watershedKey || _compositeOverlayKey != _overlay.cacheKey()
+        || _compositeAlpha != _alpha)
+    {
+        // Planes replaced or recolored, a toggle or the alpha: everything is blended again
+        if (_composite.size() != _image.size())
+        {
+            _composite = PlanePool::instance().image(_image.size(), QImage::Format_ARGB32_Premultiplied);
+        }
+        _compositeDirty = QRegion(_composite.rect());
+        _compositeImageKey = _image.cacheKey();
+        _compositeMaskKey = maskKey;
+        _compositeWatershedKey = watershedKey;
+        _compositeOverlayKey = _overlay.cacheKey();
+        _compositeAlpha = _alpha;
+    }
+    for (const QRect& rect : _compositeDirty)
+    {
+        compositeLayers(_image, layers, _alpha, rect, &_composite);
+    }
+    _compositeDirty = QRegion();
 }
 
 void ImageCanvas::clearMask()
 {
-    _mask = ImageMask(_image.size());
-    _watershed = ImageMask(_image.size());
+    if (!isLoaded())
+    {
+        return;
+    }
+    _mask = ImageMask(_imageSize);
+    _watershed = ImageMask(_imageSize);
+    _journal.appendClear();
     _undoList.clear();
     _undoIndex = 0;
     update();
@@ -389,17 +1057,23 @@ void ImageCanvas::refresh()
 
 void ImageCanvas::undo()
 {
+    if (!isLoaded())
+    {
+        return;
+    }
     _undo = true;
     _undoIndex--;
     if (_undoIndex == 1)
     {
         _mask = _undoList.at(_undoIndex - 1);
+        _journal.appendUndo();
         _mainWindow->undo_action->setEnabled(false);
         refresh();
     }
     else if (_undoIndex > 1)
     {
         _mask = _undoList.at(_undoIndex - 1);
+        _journal.appendUndo();
         refresh();
     }
     else
@@ -412,15 +1086,28 @@ void ImageCanvas::undo()
 
 void ImageCanvas::redo()
 {
+    if (!isLoaded())
+    {
+        return;
+    }
     _undoIndex++;
+    // Back from index 0, which undo reaches without changing the mask, the mask doesn't change either
     if (_undoIndex < _undoList.size())
     {
         _mask = _undoList.at(_undoIndex - 1);
+        if (_undoIndex > 1)
+        {
+            _journal.appendRedo();
+        }
         refresh();
     }
     else if (_undoIndex == _undoList.size())
     {
         _mask = _undoList.at(_undoIndex - 1);
+        if (_undoIndex > 1)
+        {
+            _journal.appendRedo();
+        }
         _mainWindow->redo_action->setEnabled(false);
         refresh();
     }
@@ -1,47 +1,132 @@
 #include "image_mask.h"
 #include "utils.h"
+#include "plane_pool.h"
 
-#include <QPainter>
+#include <cmath>
+#include <cstring>
+#include <QStack>
 
 ImageMask::ImageMask() = default;
 
-ImageMask::ImageMask(const QString& file, Id2Labels id_labels)
+ImageMask::ImageMask(const QString& file, const Id2Labels& id_labels)
 {
-    id = mat2QImage(cv::imread(file.toStdString()));
+    id = readIdImage(file);
     color = idToColor(id, id_labels);
 }
 
 ImageMask::ImageMask(QSize s)
 {
-    id = QImage(s, QImage::Format_RGB888);
-    color = QImage(s, QImage::Format_RGB888);
-    id.fill(QColor(0, 0, 0));
-    color.fill(QColor(0, 0, 0));
+    id = PlanePool::instance().image(s, QImage::Format_Grayscale16);
+    color = PlanePool::instance().image(s, QImage::Format_RGB888);
+    // The whole buffers, line padding included: pooled planes come back with the data of earlier images
+    memset(id.bits(), 0, id.sizeInBytes());
+    memset(color.bits(), 0, color.sizeInBytes());
+}
+
+int ImageMask::idAt(int x, int y) const
+{
+    if (!id.valid(x, y))
+    {
+        return 0;
+    }
+    return reinterpret_cast<const quint16*>(id.constScanLine(y))[x];
+}
+
+void ImageMask::_detach()
+{
+    // Undo states share the planes until the next edit
+    if (!id.isNull() && !id.isDetached())
+    {
+        id = PlanePool::instance().copy(id);
+    }
+    if (!color.isNull() && !color.isDetached())
+    {
+        color = PlanePool::instance().copy(color);
+    }
+}
+
+void ImageMask::_fillSpan(int y, int x0, int x1, const ColorMask& cm)
+{
+    if (y < 0 || y >= id.height())
+    {
+        return;
+    }
+    x0 = std::max(x0, 0);
+    x1 = std::min(x1, id.width() - 1);
+    if (x0 > x1)
+    {
+        return;
+    }
+
+    auto* line_id = reinterpret_cast<quint16*>(id.scanLine(y));
+    std::fill(line_id + x0, line_id + x1 + 1, static_cast<quint16>(cm.id));
+
+    const uchar r = cm.color.red();
+    const uchar g = cm.color.green();
+    const uchar b = cm.color.blue();
+    uchar* pix = color.scanLine(y) + x0 * 3;
+    for (int x = x0; x <= x1; x++, pix += 3)
+    {
+        pix[0] = r;
+        pix[1] = g;
+        pix[2] = b;
+    }
 }
 
 void ImageMask::drawFillCircle(int x, int y, int pen_size, ColorMask cm)
 {
-    QPen pen(QBrush(cm.id), 1.0);
-    QPainter painter_id(&id);
-    painter_id.setRenderHint(QPainter::Antialiasing, false);
-    painter_id.setPen(pen);
-    painter_id.setBrush(QBrush(cm.id));
-    painter_id.drawEllipse(x, y, pen_size, pen_size);
-    painter_id.end();
-
-    QPainter painter_color(&color);
-    QPen pen_color(QBrush(cm.color), 1.0);
-    painter_color.setRenderHint(QPainter::Antialiasing, false);
-    painter_color.setPen(pen_color);
-    painter_color.setBrush(QBrush(cm.color));
-    painter_color.drawEllipse(x, y, pen_size, pen_size);
-    painter_color.end();
+    // Scanline fill of the disc QPainter::drawEllipse(x, y, pen_size, pen_size) covers with a 1px pen,
+    // QPainter can't paint exact values into 16-bit gray planes
+    _detach();
+    const double radius = pen_size / 2. + 0.5;
+    const double cx = x + pen_size / 2.;
+    const double cy = y + pen_size / 2.;
+    const int y0 = static_cast<int>(std::floor(cy - radius));
+    const int y1 = static_cast<int>(std::ceil(cy + radius));
+    for (int py = y0; py <= y1; py++)
+    {
+        const double dy = py + 0.5 - cy;
+        const double d2 = radius * radius - dy * dy;
+        if (d2 < 0)
+        {
+            continue;
+        }
+        const double half = std::sqrt(d2);
+        _fillSpan(py, static_cast<int>(std::ceil(cx - half - 0.5)), static_cast<int>(std::floor(cx + half - 0.5)), cm);
+    }
+}
+
+void ImageMask::drawFillCircles(const QVector<QPoint>& positions, int pen_size, ColorMask cm)
+{
+    _detach();
+    for (const QPoint& p : positions)
+    {
+        drawFillCircle(p.x(), p.y(), pen_size, cm);
+    }
 }
 
 void ImageMask::drawPixel(int x, int y, ColorMask cm)
 {
-    id.setPixelColor(x, y, cm.id);
-    color.setPixelColor(x, y, cm.color);
+    _detach();
+    _fillSpan(y, x, x, cm);
+}
+
+void ImageMask::drawPixels(const QVector<QPoint>& positions, ColorMask cm)
+{
+    _detach();
+    for (const QPoint& p : positions)
+    {
+        drawPixel(p.x(), p.y(), cm);
+    }
+}
+
+void ImageMask::drawSpans(const QVector<QLine>& spans, ColorMask cm)
+{
+    _detach();
+    for (const QLine& span : spans)
+    {
+        _fillSpan(span.y1(), span.x1(), span.x2(), cm);
+    }
 }
 
 void ImageMask::updateColor(const Id2Labels& labels)
@@ -51,14 +136,46 @@ void ImageMask::updateColor(const Id2Labels& labels)
 
 void ImageMask::exchangeLabel(int x, int y, const Id2Labels& id_labels, ColorMask cm)
 {
-    QColor current_id = id.pixelColor(QPoint(x, y));
-    if (current_id.red() == 0 || current_id.green() == 0 || current_id.blue() == 0)
+    const int current_id = idAt(x, y);
+    if (current_id == 0 || current_id == cm.id || !id.valid(x, y))
         return;
 
-    cv::Mat id_mat = qImage2Mat(id);
-    floodFill(id_mat, cv::Point(x, y), cv::Scalar(cm.id.red(), cm.id.green(), cm.id.blue()), 0, cv::Scalar(0, 0, 0),
-                  cv::Scalar(0, 0, 0));
+    _detach();
+    // 4-connected scanline flood fill of the region holding current_id
+    const int w = id.width();
+    const int h = id.height();
+    QStack<QPoint> seeds;
+    seeds.push(QPoint(x, y));
+    while (!seeds.isEmpty())
+    {
+        QPoint seed = seeds.pop();
+        auto* line = reinterpret_cast<quint16*>(id.scanLine(seed.y()));
+        if (line[seed.x()] != current_id)
+        {
+            continue;
+        }
+        int x0 = seed.x();
+        int x1 = seed.x();
+        while (x0 > 0 && line[x0 - 1] == current_id) x0--;
+        while (x1 < w - 1 && line[x1 + 1] == current_id) x1++;
+        std::fill(line + x0, line + x1 + 1, static_cast<quint16>(cm.id));
 
-    id = mat2QImage(id_mat);
-    color = idToColor(id, id_labels);
+        for (int ny : {seed.y() - 1, seed.y() + 1})
+        {
+            if (ny < 0 || ny >= h)
+            {
+                continue;
+            }
+            const auto* next = reinterpret_cast<const quint16*>(id.constScanLine(ny));
+            for (int nx = x0; nx <= x1; nx++)
+            {
+                if (next[nx] == current_id && (nx == x0 || next[nx - 1] != current_id))
+                {
+                    seeds.push(QPoint(nx, ny));
+                }
+            }
+        }
+    }
+
+    idToColor(id, id_labels, &color);
 }
@@ -0,0 +1,152 @@
+#include "input_recorder.h"
+
+static const quint32 SESSION_MAGIC = 0x50415452; // "PATR"
+static const quint16 SESSION_VERSION = 2;
+
+QDataStream& operator<<(QDataStream& out, const InputRecord& record)
+{
+    out << quint8(record.type) << record.time << record.position << qint32(record.button) << qint32(record.buttons)
+        << qint32(record.modifiers) << qint32(record.key) << record.angleDelta << qint32(record.label) << record.text;
+    return out;
+}
+
+QDataStream& operator>>(QDataStream& in, InputRecord& record)
+{
+    quint8 type;
+    qint32 button, buttons, modifiers, key, label;
+    in >> type >> record.time >> record.position >> button >> buttons >> modifiers >> key >> record.angleDelta >> label
+        >> record.text;
+    record.type = static_cast<InputRecordType>(type);
+    record.button = button;
+    record.buttons = buttons;
+    record.modifiers = modifiers;
+    record.key = key;
+    record.label = label;
+    return in;
+}
+
+bool InputRecorder::start(const QString& file, const InputSessionSettings& settings)
+{
+    stop();
+    _file.setFileName(file);
+    if (!_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        return false;
+    }
+    _stream.setDevice(&_file);
+    _stream.setVersion(QDataStream::Qt_6_0);
+    _stream << SESSION_MAGIC << SESSION_VERSION << qint32(settings.penSize) << settings.scale << settings.alpha
+        << settings.engine << settings.edgeSnapping;
+    _clock.start();
+    return true;
+}
+
+void InputRecorder::stop()
+{
+    if (_file.isOpen())
+    {
+        _stream.setDevice(Q_NULLPTR);
+        _file.close();
+    }
+}
+
+void InputRecorder::_write(InputRecord& record)
+{
+    if (!isRecording())
+    {
+        return;
+    }
+    record.time = _clock.elapsed();
+    _stream << record;
+}
+
+void InputRecorder::recordImage(const QString& imageFile)
+{
+    InputRecord record;
+    record.type = InputRecordType::Image;
+    record.text = imageFile;
+    _write(record);
+}
+
+void InputRecorder::recordMouse(InputRecordType type, const QMouseEvent* event)
+{
+    InputRecord record;
+    record.type = type;
+    record.position = event->position();
+    record.button = event->button();
+    record.buttons = event->buttons().toInt();
+    record.modifiers = event->modifiers().toInt();
+    _write(record);
+}
+
+void InputRecorder::recordWheel(const QWheelEvent* event)
+{
+    InputRecord record;
+    record.type = InputRecordType::Wheel;
+    record.position = event->position();
+    record.buttons = event->buttons().toInt();
+    record.modifiers = event->modifiers().toInt();
+    record.angleDelta = event->angleDelta();
+    _write(record);
+}
+
+void InputRecorder::recordKey(const QKeyEvent* event)
+{
+    InputRecord record;
+    record.type = InputRecordType::KeyPress;
+    record.key = event->key();
+    record.modifiers = event->modifiers().toInt();
+    record.text = event->text();
+    _write(record);
+}
+
+void InputRecorder::recordLabel(int id)
+{
+    InputRecord record;
+    record.type = InputRecordType::Label;
+    record.label = id;
+    _write(record);
+}
+
+QVector<InputRecord> readInputSession(const QString& file, bool* ok, InputSessionSettings* settings)
+{
+    QVector<InputRecord> records;
+    QFile input(file);
+    bool valid = input.open(QIODevice::ReadOnly);
+    if (valid)
+    {
+        QDataStream stream(&input);
+        stream.setVersion(QDataStream::Qt_6_0);
+        quint32 magic;
+        quint16 version;
+        stream >> magic >> version;
+        valid = magic == SESSION_MAGIC && version >= 1 && version <= SESSION_VERSION;
+        if (valid && version >= 2)
+        {
+            InputSessionSettings header;
+            qint32 penSize;
+            stream >> penSize >> header.scale >> header.alpha >> header.engine >> header.edgeSnapping;
+            header.penSize = penSize;
+            valid = stream.status() == QDataStream::Ok;
+            if (valid && settings)
+            {
+                *settings = header;
+            }
+        }
+        while (valid && !stream.atEnd())
+        {
+            InputRecord record;
+            stream >> record;
+            if (stream.status() != QDataStream::Ok)
+            {
+                break;
+            }
+            records.append(record);
+        }
+    }
+    if (ok)
+    {
+        *ok = valid;
+    }
+    return records;
+}
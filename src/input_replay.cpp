@@ -0,0 +1,243 @@
+#include "input_replay.h"
+#include "input_recorder.h"
+#include "main_window.h"
+
+#include <QEventLoop>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QFileInfo>
+#include <QDir>
+#include <QFile>
+#include <algorithm>
+
+static qint64 percentile(QVector<qint64> values, int p)
+{
+    if (values.isEmpty())
+    {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min<qsizetype>(values.size() - 1, values.size() * p / 100)];
+}
+
+static void printStatistics(QTextStream& out, const QString& name, const QVector<qint64>& nsecs)
+{
+    out << QString("%1: n=%2 p50=%3us p90=%4us p99=%5us max=%6us\n")
+           .arg(name, -22)
+           .arg(nsecs.size())
+           .arg(percentile(nsecs, 50) / 1000.)
+           .arg(percentile(nsecs, 90) / 1000.)
+           .arg(percentile(nsecs, 99) / 1000.)
+           .arg(percentile(nsecs, 100) / 1000.);
+}
+
+// Copies an image with its masks so the replay never touches the dataset
+static QString stageImage(const QString& image, const QTemporaryDir& dir)
+{
+    QFileInfo info(image);
+    const QString base = info.dir().absolutePath() + "/" + info.completeBaseName();
+    for (const QString& suffix : {QString("_mask.png"), QString("_watershed_mask.png")})
+    {
+        QFile::copy(base + suffix, dir.filePath(info.completeBaseName() + suffix));
+    }
+    const QString staged = dir.filePath(info.fileName());
+    QFile::copy(image, staged);
+    return staged;
+}
+
+static QString syntheticImage(QSize size, const QTemporaryDir& dir)
+{
+    // Smooth random content, so the watershed has gradients to follow
+    cv::Mat small(std::max(1, size.height() / 64), std::max(1, size.width() / 64), CV_8UC3);
+    cv::randu(small, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::Mat image;
+    cv::resize(small, image, cv::Size(size.width(), size.height()), 0, 0, cv::INTER_CUBIC);
+    const QString file = dir.filePath(QString("synthetic_%1x%2.png").arg(size.width()).arg(size.height()));
+    cv::imwrite(file.toStdString(), image);
+    return file;
+}
+
+static void waitFor(qint64 msecs)
+{
+    QEventLoop loop;
+    QTimer::singleShot(std::max<qint64>(0, msecs), &loop, &QEventLoop::quit);
+    loop.exec();
+}
+
+int replayInputSession(const ReplayOptions& options)
+{
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    bool ok;
+    // Sessions without the settings in their header replay with the saved ones
+    InputSessionSettings settings;
+    settings.penSize = -1;
+    const QVector<InputRecord> records = readInputSession(options.session, &ok, &settings);
+    if (!ok)
+    {
+        err << "Invalid input session " << options.session << "\n";
+        return 1;
+    }
+
+    QTemporaryDir dir;
+    QString replacement;
+    if (options.synthetic.isValid())
+    {
+        replacement = syntheticImage(options.synthetic, dir);
+    }
+    else if (!options.image.isEmpty())
+    {
+        replacement = stageImage(options.image, dir);
+    }
+
+    QVector<qint64> handling;
+    QVector<qint64> eventToPaint;
+    QVector<qint64> paints;
+    // Inputs delivered since the last repaint, with the time they were sent
+    QVector<qint64> waitingForPaint;
+    QElapsedTimer clock;
+    clock.start();
+
+    MainWindow window;
+    // Canvases take the pen size, zoom and alpha of the window when they open, before the first image record
+    if (settings.penSize >= 0)
+    {
+        window.ui->spinbox_pen_size->setValue(settings.penSize);
+        window.ui->spinbox_scale->setValue(settings.scale);
+        window.ui->spinbox_alpha->setValue(settings.alpha);
+        if (window.ui->combo_engine->findText(settings.engine) < 0)
+        {
+            err << "Unknown segmentation engine " << settings.engine << ", replaying with "
+                << window.ui->combo_engine->currentText() << "\n";
+        }
+        else
+        {
+            window.ui->combo_engine->setCurrentText(settings.engine);
+        }
+        window.edge_snapping_action->setChecked(settings.edgeSnapping);
+    }
+    window.show();
+
+    ImageCanvas* canvas = Q_NULLPTR;
+    auto attach = [&](ImageCanvas* ic)-> void
+    {
+        // Recorded events were all sent to a loaded canvas, snapped strokes to one with its edge map
+        ic->waitUntilLoaded();
+        if (window.edge_snapping_action->isChecked())
+        {
+            ic->waitForEdgeMap();
+        }
+        canvas = ic;
+        QObject::connect(canvas, &ImageCanvas::painted, canvas, [&](qint64 nsecs)-> void
+        {
+            paints.append(nsecs);
+            const qint64 now = clock.nsecsElapsed();
+            for (qint64 sent : waitingForPaint)
+            {
+                eventToPaint.append(now - sent);
+            }
+            waitingForPaint.clear();
+        });
+    };
+
+    QElapsedTimer wall;
+    wall.start();
+    int replayed = 0;
+    for (const InputRecord& record : records)
+    {
+        if (options.realtime)
+        {
+            waitFor(record.time - wall.elapsed());
+        }
+
+        if (record.type == InputRecordType::Image)
+        {
+            if (!canvas || replacement.isEmpty())
+            {
+                attach(window.openImage(replacement.isEmpty() ? stageImage(record.text, dir) : replacement));
+            }
+            continue;
+        }
+        if (!canvas)
+        {
+            continue;
+        }
+
+        const QPointF global = canvas->mapToGlobal(record.position);
+        const auto modifiers = Qt::KeyboardModifiers::fromInt(record.modifiers);
+        const qint64 sent = clock.nsecsElapsed();
+        switch (record.type)
+        {
+        case InputRecordType::MousePress:
+        case InputRecordType::MouseMove:
+        case InputRecordType::MouseRelease:
+            {
+                const QEvent::Type type = record.type == InputRecordType::MousePress
+                                              ? QEvent::MouseButtonPress
+                                              : record.type == InputRecordType::MouseMove
+                                              ? QEvent::MouseMove
+                                              : QEvent::MouseButtonRelease;
+                QMouseEvent event(type, record.position, global, static_cast<Qt::MouseButton>(record.button),
+                                  Qt::MouseButtons::fromInt(record.buttons), modifiers);
+                QCoreApplication::sendEvent(canvas, &event);
+                break;
+            }
+        case InputRecordType::Wheel:
+            {
+                QWheelEvent event(record.position, global, QPoint(), record.angleDelta,
+                                  Qt::MouseButtons::fromInt(record.buttons), modifiers, Qt::NoScrollPhase, false);
+                QCoreApplication::sendEvent(canvas, &event);
+                break;
+            }
+        case InputRecordType::KeyPress:
+            {
+                QKeyEvent event(QEvent::KeyPress, record.key, modifiers, record.text);
+                QCoreApplication::sendEvent(canvas, &event);
+                break;
+            }
+        case InputRecordType::Label:
+            canvas->setLabelColor(record.label);
+            break;
+        default:
+            break;
+        }
+        handling.append(clock.nsecsElapsed() - sent);
+        waitingForPaint.append(sent);
+        replayed++;
+
+        if (!options.realtime)
+        {
+            QCoreApplication::processEvents();
+        }
+    }
+    // Let the last frame be rasterized and painted
+    waitFor(100);
+
+    // The replay must never leave journals behind, even in the staged copies
+    for (int i = 0; i < window.ui->tabWidget->count(); i++)
+    {
+        auto scrollArea = dynamic_cast<QScrollArea*>(window.ui->tabWidget->widget(i));
+        if (auto ic = scrollArea ? dynamic_cast<ImageCanvas*>(scrollArea->widget()) : Q_NULLPTR)
+        {
+            ic->discardJournal();
+        }
+    }
+
+    out << "Session            : " << options.session << "\n";
+    out << "Settings           : pen " << window.ui->spinbox_pen_size->value() << ", zoom "
+        << window.ui->spinbox_scale->value() << ", alpha " << window.ui->spinbox_alpha->value() << ", "
+        << window.ui->combo_engine->currentText() << ", edge snapping "
+        << (window.edge_snapping_action->isChecked() ? "on" : "off") << "\n";
+    if (canvas)
+    {
+        out << "Image              : " << canvas->imageFilePath() << " (" << canvas->getImage().width() << "x"
+            << canvas->getImage().height() << ")\n";
+    }
+    out << "Events replayed    : " << replayed << " in " << wall.elapsed() << " ms\n";
+    printStatistics(out, "Event handling", handling);
+    printStatistics(out, "Event to paint", eventToPaint);
+    printStatistics(out, "Paint", paints);
+    out << "Peak memory        : " << peakMemoryUsage() / (1024 * 1024) << " MB\n";
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include "job_scheduler.h"
+
+#include <algorithm>
+
+JobScheduler& JobScheduler::instance()
+{
+    static JobScheduler* scheduler = new JobScheduler();
+    return *scheduler;
+}
+
+JobScheduler::JobScheduler()
+{
+    const int threads = std::max(2, QThread::idealThreadCount());
+    std::fill(std::begin(_running), std::end(_running), 0);
+    _limits[static_cast<int>(JobClass::Interactive)] = threads;
+    _limits[static_cast<int>(JobClass::Decode)] = threads;
+    // Saves are I/O bound, more of them at once would only queue on the disk
+    _limits[static_cast<int>(JobClass::Save)] = std::max(1, threads / 2);
+    _limits[static_cast<int>(JobClass::Background)] = threads - 1;
+    for (int i = 0; i < threads; i++)
+    {
+        _workers.emplace_back(QThread::create([this]()-> void
+        {
+            _work();
+        }));
+        _workers.back()->setObjectName(QString("JobScheduler %1").arg(i));
+        _workers.back()->start();
+    }
+}
+
+void JobScheduler::setLimit(JobClass jobClass, int limit)
+{
+    QMutexLocker lock(&_mutex);
+    _limits[static_cast<int>(jobClass)] = std::max(1, limit);
+    _wake.wakeAll();
+}
+
+int JobScheduler::limit(JobClass jobClass) const
+{
+    QMutexLocker lock(&_mutex);
+    return _limits[static_cast<int>(jobClass)];
+}
+
+void JobScheduler::setJobClass(const CancelToken& token, JobClass jobClass)
+{
+    QMutexLocker lock(&_mutex);
+    const int target = static_cast<int>(jobClass);
+    for (int c = 0; c < static_cast<int>(JobClass::Count); c++)
+    {
+        if (c == target)
+        {
+            continue;
+        }
+        std::deque<std::shared_ptr<Batch>>& queue = _queues[c];
+        for (auto it = queue.begin(); it != queue.end();)
+        {
+            // Only single jobs carry a token, one that is still queued hasn't been claimed
+            if ((*it)->token == token.flag())
+            {
+                (*it)->jobClass = jobClass;
+                _queues[target].push_back(*it);
+                it = queue.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+    _wake.wakeAll();
+}
+
+void JobScheduler::_enqueue(const std::shared_ptr<Batch>& batch)
+{
+    if (batch->count == 0)
+    {
+        batch->finish();
+        return;
+    }
+    QMutexLocker lock(&_mutex);
+    _queues[static_cast<int>(batch->jobClass)].push_back(batch);
+    if (batch->count == 1)
+    {
+        _wake.wakeOne();
+    }
+    else
+    {
+        _wake.wakeAll();
+    }
+}
+
+bool JobScheduler::_take(std::shared_ptr<Batch>* batch, int* index)
+{
+    for (int c = 0; c < static_cast<int>(JobClass::Count); c++)
+    {
+        std::deque<std::shared_ptr<Batch>>& queue = _queues[c];
+        while (!queue.empty() && _running[c] < _limits[c])
+        {
+            const int claimed = queue.front()->next.fetch_add(1);
+            if (claimed >= queue.front()->count)
+            {
+                // Its last elements were run by the thread blocking on it
+                queue.pop_front();
+                continue;
+            }
+            *batch = queue.front();
+            *index = claimed;
+            if (claimed == (*batch)->count - 1)
+            {
+                queue.pop_front();
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void JobScheduler::_runElement(const std::shared_ptr<Batch>& batch, int index)
+{
+    batch->work(index);
+    if (++batch->done == batch->count)
+    {
+        batch->finish();
+    }
+}
+
+void JobScheduler::_help(const std::shared_ptr<Batch>& batch)
+{
+    for (int index = batch->next.fetch_add(1); index < batch->count; index = batch->next.fetch_add(1))
+    {
+        _runElement(batch, index);
+    }
+}
+
+void JobScheduler::_work()
+{
+    QMutexLocker lock(&_mutex);
+    forever
+    {
+        std::shared_ptr<Batch> batch;
+        int index = 0;
+        if (!_take(&batch, &index))
+        {
+            _wake.wait(&_mutex);
+            continue;
+        }
+        const int c = static_cast<int>(batch->jobClass);
+        const bool atLimit = ++_running[c] == _limits[c];
+        lock.unlock();
+        _runElement(batch, index);
+        batch.reset();
+        lock.relock();
+        _running[c]--;
+        if (atLimit)
+        {
+            // Work of this class may have waited for the slot
+            _wake.wakeOne();
+        }
+    }
+}
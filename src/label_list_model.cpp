@@ -0,0 +1,97 @@
+#include "label_list_model.h"
+#include "utils.h"
+
+#include <QPainter>
+
+LabelListModel::LabelListModel(QObject* parent) : QAbstractListModel(parent)
+{}
+
+void LabelListModel::setLabels(const Name2Labels& labels, const QStringList& shortcuts)
+{
+    beginResetModel();
+    _labels.clear();
+    _labels.reserve(labels.size());
+    _rows.clear();
+    for (const LabelInfo& label : labels)
+    {
+        _rows.insert(label.id, _labels.size());
+        _labels.append(label);
+    }
+    _shortcuts = shortcuts;
+    endResetModel();
+}
+
+void LabelListModel::updateLabel(const LabelInfo& label)
+{
+    const int row = rowOfId(label.id);
+    if (row < 0)
+    {
+        return;
+    }
+    _labels[row] = label;
+    emit dataChanged(index(row), index(row));
+}
+
+int LabelListModel::rowCount(const QModelIndex& parent) const
+{
+    return parent.isValid() ? 0 : _labels.size();
+}
+
+QVariant LabelListModel::data(const QModelIndex& index, int role) const
+{
+    if (!index.isValid() || index.row() >= _labels.size())
+    {
+        return QVariant();
+    }
+    const LabelInfo& label = _labels[index.row()];
+    switch (role)
+    {
+    case Qt::DisplayRole:
+        return index.row() < _shortcuts.size()
+                   ? label.name + " (" + _shortcuts[index.row()] + ")"
+                   : label.name;
+    case Qt::ToolTipRole:
+        return QString("%1, id %2, category %3").arg(label.name).arg(label.id).arg(label.category);
+    case Qt::BackgroundRole:
+        return label.color;
+    case Qt::ForegroundRole:
+        return readableColor(label.color);
+    case IdRole:
+        return label.id;
+    case NameRole:
+        return label.name;
+    case SearchRole:
+        return label.name + " " + label.category;
+    default:
+        return QVariant();
+    }
+}
+
+void LabelItemDelegate::paint(QPainter* painter, const QStyleOptionViewItem& option, const QModelIndex& index) const
+{
+    const QColor color = index.data(Qt::BackgroundRole).value<QColor>();
+    painter->save();
+    painter->fillRect(option.rect, color);
+    QFont font = option.font;
+    font.setPixelSize(14);
+    painter->setFont(font);
+    painter->setPen(index.data(Qt::ForegroundRole).value<QColor>());
+    painter->drawText(option.rect, Qt::AlignHCenter | Qt::AlignVCenter, index.data(Qt::DisplayRole).toString());
+    if (option.state & QStyle::State_Selected)
+    {
+        const QColor inv = invColor(color);
+        painter->setOpacity(0.3);
+        painter->setPen(QPen(inv, 4));
+        painter->setBrush(inv);
+        painter->drawRect(option.rect.adjusted(2, 2, -2, -2));
+    }
+    painter->restore();
+}
+
+QSize LabelItemDelegate::sizeHint(const QStyleOptionViewItem& option, const QModelIndex& index) const
+{
+    QFont font = option.font;
+    font.setPixelSize(14);
+    return QSize(QFontMetrics(font).horizontalAdvance(index.data(Qt::DisplayRole).toString()) + 8,
+                 QFontMetrics(font).height() + 4);
+}
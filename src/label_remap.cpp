@@ -0,0 +1,375 @@
+#include "label_remap.h"
+#include "utils.h"
+#include "job_scheduler.h"
+
+#include <QBuffer>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QSaveFile>
+#include <QTextStream>
+
+static const QString REMAP_LOG = ".pixel_annotation_remap";
+static const QString REMAP_LOG_HEADER = "PixelAnnotationTool label remap";
+
+bool parseLabelMerges(const QString& text, QMap<QString, QString>* merges, QString* error)
+{
+    for (const QString& pair : text.split(',', Qt::SkipEmptyParts))
+    {
+        const QStringList sides = pair.split('=');
+        if (sides.size() != 2 || sides[0].trimmed().isEmpty() || sides[1].trimmed().isEmpty())
+        {
+            *error = QString("\"%1\" isn't a merge, write old=new").arg(pair);
+            return false;
+        }
+        merges->insert(sides[0].trimmed(), sides[1].trimmed());
+    }
+    return true;
+}
+
+bool configRemap(const Name2Labels& from, const Name2Labels& to, const QMap<QString, QString>& merges,
+                 QVector<quint16>* remap, QString* error)
+{
+    remap->resize(WATERSHED_BORDER_ID + 1);
+    for (int id = 0; id <= WATERSHED_BORDER_ID; id++)
+    {
+        (*remap)[id] = static_cast<quint16>(id);
+    }
+    QStringList unmatched;
+    for (const LabelInfo& label : from)
+    {
+        const QString target = merges.value(label.name, label.name);
+        if (!to.contains(target))
+        {
+            unmatched.append(target == label.name ? label.name : label.name + "=" + target);
+            continue;
+        }
+        if (label.id >= 0 && label.id <= MAX_LABEL_ID)
+        {
+            (*remap)[label.id] = static_cast<quint16>(to[target].id);
+        }
+    }
+    if (!unmatched.isEmpty())
+    {
+        *error = "No label of the new config for " + unmatched.join(", ");
+        return false;
+    }
+    return true;
+}
+
+static bool saveAtomically(const QString& file, const QByteArray& data)
+{
+    QSaveFile out(file);
+    return !data.isEmpty() && out.open(QIODevice::WriteOnly) && out.write(data) == data.size() && out.commit();
+}
+
+LabelRemapJob::LabelRemapJob(const QStringList& directories, const QVector<quint16>& remap, const Name2Labels& from,
+                             const Name2Labels& to, bool dryRun, QObject* parent)
+    : QObject(parent), _remap(remap), _from(from), _to(to), _dryRun(dryRun), _recolor(false), _changed(0),
+      _failed(0), _logsClosed(false)
+{
+    _toIds = getId2Label(_to);
+    _slots.fill(-1, WATERSHED_BORDER_ID + 1);
+    QStringList pairs;
+    for (int id = 0; id <= WATERSHED_BORDER_ID; id++)
+    {
+        if (_remap[id] != id)
+        {
+            _slots[id] = _changedIds.size();
+            _changedIds.append(static_cast<quint16>(id));
+            pairs.append(QString("%1=%2").arg(id).arg(_remap[id]));
+        }
+    }
+    _tableLine = pairs.join(',');
+
+    for (const QString& directory : directories)
+    {
+        const QDir dir(QDir::cleanPath(QDir(directory).absolutePath()));
+        _directories.append(dir.absolutePath());
+        for (const QString& name : listImageFiles(dir.absolutePath()))
+        {
+            _files.append(dir.absoluteFilePath(name));
+        }
+        // Files an unfinished run of this remap already wrote
+        QFile log(dir.absoluteFilePath(REMAP_LOG));
+        if (!log.open(QIODevice::ReadOnly | QIODevice::Text))
+        {
+            continue;
+        }
+        QTextStream in(&log);
+        const QString header = in.readLine();
+        const QString table = in.readLine();
+        if (header != REMAP_LOG_HEADER || table != _tableLine)
+        {
+            _error = QString("%1 logs an unfinished remap of other ids (%2): finish it first, or delete the log "
+                             "if its masks were restored").arg(log.fileName(), table);
+            continue;
+        }
+        while (!in.atEnd())
+        {
+            const QString name = in.readLine();
+            if (!name.isEmpty())
+            {
+                _done.insert(dir.absoluteFilePath(name));
+            }
+        }
+    }
+    _maskPixels.fill(0, _changedIds.size());
+    _watershedPixels.fill(0, _changedIds.size());
+    for (const LabelInfo& label : _from)
+    {
+        if (label.id >= 0 && label.id <= MAX_LABEL_ID && _toIds.palette()[_remap[label.id]] != label.color.rgb())
+        {
+            _recolor = true;
+        }
+    }
+
+    connect(&_watcher, &QFutureWatcher<void>::progressValueChanged, this, &LabelRemapJob::progressChanged);
+    connect(&_watcher, &QFutureWatcher<void>::finished, this, [this]()-> void
+    {
+        _closeLogs();
+        emit finished(_changed, _watcher.isCanceled());
+    });
+}
+
+LabelRemapJob::~LabelRemapJob()
+{
+    qDeleteAll(_logs);
+}
+
+void LabelRemapJob::start()
+{
+    if (!_error.isEmpty())
+    {
+        return;
+    }
+    _watcher.setFuture(JobScheduler::instance().map(JobClass::Background, _files, [this](const QString& file)-> void
+    {
+        _remapImage(file);
+    }));
+}
+
+void LabelRemapJob::waitForFinished()
+{
+    _watcher.waitForFinished();
+    _closeLogs();
+}
+
+bool LabelRemapJob::isComplete() const
+{
+    return !_dryRun && _error.isEmpty() && _watcher.isFinished() && !_watcher.isCanceled() && _failed == 0;
+}
+
+QJsonObject LabelRemapJob::record() const
+{
+    QJsonObject from;
+    _from.write(from);
+    QJsonObject to;
+    _to.write(to);
+    QJsonObject ids;
+    for (const quint16 id : _changedIds)
+    {
+        ids[QString::number(id)] = _remap[id];
+    }
+    QJsonObject record;
+    record["from"] = from;
+    record["to"] = to;
+    record["ids"] = ids;
+    record["directories"] = QJsonArray::fromStringList(_directories);
+    record["complete"] = isComplete();
+    record["changed_images"] = _changed.load();
+    record["failed_images"] = _failed.load();
+    return record;
+}
+
+bool LabelRemapJob::_logWritten(const QString& file)
+{
+    const QFileInfo info(file);
+    QMutexLocker lock(&_logMutex);
+    QFile*& log = _logs[info.absolutePath()];
+    if (!log)
+    {
+        log = new QFile(info.absolutePath() + "/" + REMAP_LOG);
+        const bool resumed = log->exists();
+        if (!log->open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text))
+        {
+            return false;
+        }
+        if (!resumed)
+        {
+            log->write((REMAP_LOG_HEADER + "\n" + _tableLine + "\n").toUtf8());
+        }
+    }
+    // Flushed right away: the log must hold every file replaced if the process dies
+    return log->write((info.fileName() + "\n").toUtf8()) > 0 && log->flush();
+}
+
+void LabelRemapJob::_closeLogs()
+{
+    if (_logsClosed)
+    {
+        return;
+    }
+    _logsClosed = true;
+    const bool complete = isComplete();
+    for (QFile* log : std::as_const(_logs))
+    {
+        log->close();
+        if (complete)
+        {
+            log->remove();
+        }
+        delete log;
+    }
+    _logs.clear();
+    if (complete)
+    {
+        // Directories where this run had nothing left to write still hold the log of the earlier one
+        for (const QString& directory : std::as_const(_directories))
+        {
+            QFile::remove(directory + "/" + REMAP_LOG);
+        }
+    }
+}
+
+void LabelRemapJob::cancel()
+{
+    _watcher.cancel();
+}
+
+bool LabelRemapJob::_remapPlane(QImage* plane, qint64* counts) const
+{
+    const quint16* table = _remap.constData();
+    const int* slot = _slots.constData();
+    bool changed = false;
+    for (int y = 0; y < plane->height(); y++)
+    {
+        // Rows without a remapped id are left alone, the plane isn't detached for them
+        const auto* in = reinterpret_cast<const quint16*>(plane->constScanLine(y));
+        int x = 0;
+        while (x < plane->width() && table[in[x]] == in[x])
+        {
+            x++;
+        }
+        if (x == plane->width())
+        {
+            continue;
+        }
+        auto* line = reinterpret_cast<quint16*>(plane->scanLine(y));
+        for (; x < plane->width(); x++)
+        {
+            const quint16 id = line[x];
+            const quint16 mapped = table[id];
+            if (mapped != id)
+            {
+                line[x] = mapped;
+                counts[slot[id]]++;
+            }
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+void LabelRemapJob::_remapImage(const QString& imageFile)
+{
+    const QString maskFile = siblingFile(imageFile, "_mask.png");
+    const QString watershedFile = siblingFile(imageFile, "_watershed_mask.png");
+    const QString colorFile = siblingFile(imageFile, "_color_mask.png");
+    // Files an earlier run wrote hold the new ids already, remapping them again would be wrong for swapped ids
+    const bool maskDone = _done.contains(maskFile);
+    const bool watershedDone = _done.contains(watershedFile);
+    const bool colorDone = _done.contains(colorFile);
+    QImage mask = !maskDone && QFile::exists(maskFile) ? readIdImage(maskFile) : QImage();
+    QImage watershed = !(watershedDone && colorDone) && QFile::exists(watershedFile) ? readIdImage(watershedFile)
+                                                                                      : QImage();
+    if (mask.isNull() && watershed.isNull())
+    {
+        return;
+    }
+
+    QVector<qint64> maskCounts(_changedIds.size(), 0);
+    QVector<qint64> watershedCounts(_changedIds.size(), 0);
+    const bool maskChanged = !mask.isNull() && _remapPlane(&mask, maskCounts.data());
+    const bool watershedChanged = !watershedDone && !watershed.isNull()
+        && _remapPlane(&watershed, watershedCounts.data());
+    if (maskChanged || watershedChanged)
+    {
+        ++_changed;
+        QMutexLocker lock(&_countsMutex);
+        for (int i = 0; i < _changedIds.size(); i++)
+        {
+            _maskPixels[i] += maskCounts[i];
+            _watershedPixels[i] += watershedCounts[i];
+        }
+    }
+    if (_dryRun)
+    {
+        return;
+    }
+
+    // Each file is logged once it is replaced, a rerun picks up exactly where this one stopped
+    bool written = true;
+    if (maskChanged)
+    {
+        written &= saveAtomically(maskFile, encodeIdImage(mask)) && _logWritten(maskFile);
+    }
+    bool watershedWritten = !watershedChanged;
+    if (watershedChanged)
+    {
+        watershedWritten = saveAtomically(watershedFile, encodeIdImage(watershed)) && _logWritten(watershedFile);
+        written &= watershedWritten;
+    }
+    if (!colorDone && watershedWritten && !watershed.isNull() && (watershedChanged || watershedDone || _recolor))
+    {
+        QByteArray color;
+        QBuffer buffer(&color);
+        buffer.open(QIODevice::WriteOnly);
+        idToColor(watershed, _toIds).save(&buffer, "PNG");
+        written &= saveAtomically(colorFile, color) && _logWritten(colorFile);
+    }
+    if (!written)
+    {
+        ++_failed;
+    }
+}
+
+QString LabelRemapJob::report() const
+{
+    Id2Labels fromIds = getId2Label(_from);
+    QString csv = "label,id,new label,new id,mask pixels,watershed pixels\n";
+    for (int i = 0; i < _changedIds.size(); i++)
+    {
+        const int id = _changedIds[i];
+        const LabelInfo* label = fromIds.value(id);
+        const LabelInfo* target = _toIds.value(_remap[id]);
+        csv += QString("\"%1\",%2,\"%3\",%4,%5,%6\n")
+               .arg(label ? label->name : QString(), QString::number(id), target ? target->name : QString(),
+                    QString::number(_remap[id]), QString::number(_maskPixels[i]),
+                    QString::number(_watershedPixels[i]));
+    }
+    return csv;
+}
+
+bool saveRemapRecord(const QString& configFile, const LabelRemapJob& job, QString* error)
+{
+    const QString recordFile = siblingFile(configFile, "_remap.json");
+    if (!saveAtomically(recordFile, QJsonDocument(job.record()).toJson()))
+    {
+        *error = recordFile;
+        return false;
+    }
+    if (!job.isComplete())
+    {
+        // The masks hold both configs' ids until the remap is run again to the end, the old config stays
+        return true;
+    }
+    if (!saveAtomically(configFile, QJsonDocument(job.record()["to"].toObject()).toJson()))
+    {
+        *error = configFile;
+        return false;
+    }
+    return true;
+}
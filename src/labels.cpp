@@ -1,12 +1,13 @@
 #include "labels.h"
 #include "utils.h"
 
-#include <QListWidgetItem>
 #include <QJsonObject>
 #include <QJsonArray>
 #include <QStandardItemModel>
 #include <QColormap>
 #include <QDebug>
+#include <QFile>
+#include <QJsonDocument>
 
 LabelInfo::LabelInfo()
 {
@@ -15,7 +16,6 @@ LabelInfo::LabelInfo()
     this->id = 0;
     this->id_category = 0;
     this->color = QColor(0, 0, 0);
-    item = Q_NULLPTR;
 }
 
 LabelInfo::LabelInfo(QString name, QString category, int id, int id_category, QColor color)
@@ -25,7 +25,6 @@ LabelInfo::LabelInfo(QString name, QString category, int id, int id_category, QC
     this->id = id;
     this->id_category = id_category;
     this->color = color;
-    item = Q_NULLPTR;
 }
 
 void LabelInfo::read(const QJsonObject& json)
@@ -82,6 +81,24 @@ void Name2Labels::write(QJsonObject& json) const
 }
 
 
+Id2Labels::Id2Labels() : _palette(WATERSHED_BORDER_ID + 1, qRgb(255, 255, 255))
+{}
+
+void Id2Labels::insert(int id, const LabelInfo* label)
+{
+    if (id < 0 || id > MAX_LABEL_ID)
+    {
+        qWarning() << "Label" << label->name << "has an id out of range:" << id;
+        return;
+    }
+    if (id >= _labels.size())
+    {
+        _labels.resize(id + 1, Q_NULLPTR);
+    }
+    _labels[id] = label;
+    _palette[id] = label->color.rgb();
+}
+
 Id2Labels getId2Label(const Name2Labels& labels)
 {
     Id2Labels id_labels;
@@ -89,7 +106,7 @@ Id2Labels getId2Label(const Name2Labels& labels)
     while (i.hasNext())
     {
         i.next();
-        id_labels[i.value().id] = &i.value();
+        id_labels.insert(i.value().id, &i.value());
     }
     return id_labels;
 }
@@ -149,3 +166,16 @@ Name2Labels defaultLabels()
 
     return labels;
 }
+
+bool readLabelsFile(const QString& file, Name2Labels* labels)
+{
+    QFile open_file(file);
+    if (!open_file.open(QIODevice::ReadOnly))
+    {
+        return false;
+    }
+    QJsonDocument loadDoc(QJsonDocument::fromJson(open_file.readAll()));
+    labels->clear();
+    labels->read(loadDoc.object());
+    return true;
+}
@@ -6,20 +6,59 @@
 #include <QColorDialog>
 #include <QFileDialog>
 #include <QJsonDocument>
+#include <QProgressDialog>
+#include <QPlainTextEdit>
+#include <QVBoxLayout>
+#include <QFontDatabase>
+#include <QFormLayout>
+#include <QSpinBox>
+#include <QPointer>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QImageReader>
+#include <QInputDialog>
+#include <QHeaderView>
+#include <QLineEdit>
+#include <QCheckBox>
+#include <QDialogButtonBox>
+#include <QPushButton>
+#include <QStyle>
+#include <algorithm>
 #include "pixel_annotation_tool_version.h"
 
 #include "main_window.h"
-#include "label_widget.h"
 #include "about_dialog.h"
+#include "consensus.h"
+#include "segmentation_engine.h"
+#include "plane_pool.h"
+#include "shard_export.h"
+#include "label_remap.h"
+#include "evaluation.h"
+#include "job_scheduler.h"
 
 MainWindow::MainWindow(QWidget* parent, Qt::WindowFlags flags): QMainWindow(parent, flags), ui(new Ui::MainWindow)
 {
     ui->setupUi(this);
     setWindowTitle(QApplication::translate("MainWindow", "PixelAnnotationTool " PIXEL_ANNOTATION_TOOL_GIT_TAG,
                                            Q_NULLPTR));
+    labelModel = new LabelListModel(this);
+    labelFilter = new QSortFilterProxyModel(this);
+    labelFilter->setSourceModel(labelModel);
+    labelFilter->setFilterRole(LabelListModel::SearchRole);
+    labelFilter->setFilterCaseSensitivity(Qt::CaseInsensitive);
+    ui->list_label->setModel(labelFilter);
+    // Rows are painted by the delegate and laid out without measuring each of them
+    ui->list_label->setItemDelegate(new LabelItemDelegate(ui->list_label));
+    ui->list_label->setUniformItemSizes(true);
+    ui->list_label->setEditTriggers(QAbstractItemView::NoEditTriggers);
     ui->list_label->setSpacing(1);
+    for (const SegmentationEngine* engine : segmentationEngines())
+    {
+        ui->combo_engine->addItem(engine->name());
+    }
     imageCanvas_ = Q_NULLPTR;
     isLoadingNewLabels = false;
+    paletteGeneration = 0;
 
     save_action = new QAction(tr("&Save current image"), this);
     copy_mask_action = new QAction(tr("&Copy Mask"), this);
@@ -31,6 +70,24 @@ MainWindow::MainWindow(QWidget* parent, Qt::WindowFlags flags): QMainWindow(pare
     redo_action = new QAction(tr("&Redo"), this);
     next_file_action = new QAction(tr("&Select next file"), this);
     previous_file_action = new QAction(tr("&Select previous file"), this);
+    export_color_masks_action = new QAction(tr("Re-&export color masks"), this);
+    export_shards_action = new QAction(tr("Export training &shards..."), this);
+    remap_labels_action = new QAction(tr("Re&map labels to a new config..."), this);
+    evaluate_action = new QAction(tr("&Evaluate against gold masks..."), this);
+    record_input_action = new QAction(tr("&Record input session"), this);
+    record_input_action->setCheckable(true);
+    dataset_statistics_action = new QAction(tr("&Dataset statistics"), this);
+    disagreement_action = new QAction(tr("Annotator &disagreement view"), this);
+    disagreement_action->setCheckable(true);
+    sequence_mode_action = new QAction(tr("&Sequence mode"), this);
+    sequence_mode_action->setCheckable(true);
+    sequence_global_motion_action = new QAction(tr("Sequence mode: &global motion only"), this);
+    sequence_global_motion_action->setCheckable(true);
+    display_mapping_action = new QAction(tr("Display &mapping..."), this);
+    memory_usage_action = new QAction(tr("Memory &usage"), this);
+    edge_snapping_action = new QAction(tr("&Edge-snapping brush"), this);
+    edge_snapping_action->setCheckable(true);
+    memory_budget_action = new QAction(tr("Memory &budget..."), this);
 
     save_action->setShortcut(QKeySequence::Save);
     copy_mask_action->setShortcut(QKeySequence::Copy);
@@ -39,6 +96,7 @@ MainWindow::MainWindow(QWidget* parent, Qt::WindowFlags flags): QMainWindow(pare
     close_tab_action->setShortcut(QKeySequence::Close);
     undo_action->setShortcuts(QKeySequence::Undo);
     swap_action->setShortcut(QKeySequence(Qt::CTRL | Qt::Key_Space));
+    edge_snapping_action->setShortcut(QKeySequence(Qt::CTRL | Qt::Key_E));
     redo_action->setShortcuts(QKeySequence::Redo);
     next_file_action->setShortcut(QKeySequence(Qt::CTRL | Qt::SHIFT | Qt::Key_Down));
     previous_file_action->setShortcut(QKeySequence(Qt::CTRL | Qt::SHIFT | Qt::Key_Up));
@@ -54,12 +112,32 @@ MainWindow::MainWindow(QWidget* parent, Qt::WindowFlags flags): QMainWindow(pare
     ui->menuEdit->addAction(paste_mask_action);
     ui->menuEdit->addAction(clear_mask_action);
     ui->menuEdit->addAction(swap_action);
+    ui->menuEdit->addAction(edge_snapping_action);
     ui->menuEdit->addAction(next_file_action);
     ui->menuEdit->addAction(previous_file_action);
+    ui->menuTool->addAction(export_color_masks_action);
+    ui->menuTool->addAction(export_shards_action);
+    ui->menuTool->addAction(remap_labels_action);
+    ui->menuTool->addAction(evaluate_action);
+    ui->menuTool->addAction(record_input_action);
+    ui->menuTool->addAction(dataset_statistics_action);
+    ui->menuTool->addAction(disagreement_action);
+    ui->menuTool->addAction(sequence_mode_action);
+    ui->menuTool->addAction(sequence_global_motion_action);
+    ui->menuTool->addAction(display_mapping_action);
+    ui->menuTool->addAction(memory_usage_action);
+    ui->menuTool->addAction(memory_budget_action);
 
     ui->tabWidget->clear();
 
     connect(ui->button_watershed, &QPushButton::released, this, &MainWindow::runWatershed);
+    connect(ui->combo_engine, &QComboBox::currentTextChanged, this, [this]()-> void
+    {
+        if (ui->checkbox_watershed_mask->isChecked())
+        {
+            runWatershed();
+        }
+    });
     connect(swap_action, &QAction::triggered, this, &MainWindow::swapView);
     connect(ui->actionOpen_config_file, &QAction::triggered, this, &MainWindow::loadConfigFile);
     connect(ui->actionSave_config_file, &QAction::triggered, this, &MainWindow::saveConfigFile);
@@ -69,6 +147,69 @@ MainWindow::MainWindow(QWidget* parent, Qt::WindowFlags flags): QMainWindow(pare
     connect(clear_mask_action, &QAction::triggered, this, &MainWindow::clearMask);
     connect(next_file_action, &QAction::triggered, this, &MainWindow::nextFile);
     connect(previous_file_action, &QAction::triggered, this, &MainWindow::previousFile);
+    connect(export_color_masks_action, &QAction::triggered, this, &MainWindow::exportColorMasks);
+    connect(export_shards_action, &QAction::triggered, this, &MainWindow::exportShards);
+    connect(remap_labels_action, &QAction::triggered, this, &MainWindow::remapLabels);
+    connect(evaluate_action, &QAction::triggered, this, &MainWindow::evaluateAgainstGold);
+    connect(record_input_action, &QAction::toggled, this, &MainWindow::recordInput);
+    connect(dataset_statistics_action, &QAction::triggered, this, &MainWindow::showDatasetStatistics);
+    connect(disagreement_action, &QAction::toggled, this, &MainWindow::showDisagreement);
+    connect(display_mapping_action, &QAction::triggered, this, &MainWindow::editDisplayMapping);
+    connect(memory_usage_action, &QAction::triggered, this, &MainWindow::showMemoryUsage);
+    connect(edge_snapping_action, &QAction::toggled, this, [this](bool checked)-> void
+    {
+        if (checked && imageCanvas_)
+        {
+            imageCanvas_->prepareEdgeMap();
+        }
+    });
+    connect(memory_budget_action, &QAction::triggered, this, &MainWindow::editMemoryBudget);
+    connect(ui->checkbox_native_segmentation, &QCheckBox::clicked, this, [this]()-> void
+    {
+        if (ui->checkbox_watershed_mask->isChecked())
+        {
+            runWatershed();
+        }
+    });
+    connect(sequence_mode_action, &QAction::toggled, this, [this](bool checked)-> void
+    {
+        if (checked)
+        {
+            sequenceTimer.start();
+        }
+        else
+        {
+            sequenceTimer.stop();
+            sequencePrefetcher.cancel();
+        }
+    });
+    connect(sequence_global_motion_action, &QAction::toggled, this, [this]()-> void
+    {
+        if (sequence_mode_action->isChecked())
+        {
+            sequenceTimer.start();
+        }
+    });
+    sequenceTimer.setSingleShot(true);
+    sequenceTimer.setInterval(1000);
+    connect(&sequenceTimer, &QTimer::timeout, this, &MainWindow::prefetchNextFrame);
+    connect(&sequencePrefetcher, &SequencePrefetcher::ready, this, [this](const QString& imageFile)-> void
+    {
+        statusBar()->showMessage(tr("%1 prepared from the current frame").arg(QFileInfo(imageFile).fileName()), 3000);
+    });
+
+    memoryBudget = 4096LL * 1024 * 1024;
+    memoryLabel = new QLabel(this);
+    statusBar()->addPermanentWidget(memoryLabel);
+    memoryTimer.setInterval(2000);
+    connect(&memoryTimer, &QTimer::timeout, this, &MainWindow::updateMemoryUsage);
+    memoryTimer.start();
+
+    indexSaveTimer.setSingleShot(true);
+    indexSaveTimer.setInterval(2000);
+    connect(&indexSaveTimer, &QTimer::timeout, this, &MainWindow::saveDatasetIndexes);
+    connect(&directoryWatcher, &DirectoryWatcher::imagesChanged, this, &MainWindow::updateDirectoryTree);
+    connect(&directoryWatcher, &DirectoryWatcher::filesChanged, this, &MainWindow::checkExternalMasks);
     connect(ui->tabWidget, &QTabWidget::tabCloseRequested, this, &MainWindow::closeTab);
     connect(ui->tabWidget, &QTabWidget::currentChanged, this, &MainWindow::onTabWidgetCurrentChanged);
     connect(ui->tree_widget_img, &QTreeWidget::itemClicked, this, &MainWindow::onTreeWidgetItemClicked);
@@ -78,8 +219,17 @@ MainWindow::MainWindow(QWidget* parent, Qt::WindowFlags flags): QMainWindow(pare
     labels = defaultLabels();
     loadConfigLabels();
 
-    connect(ui->list_label, &QListWidget::currentItemChanged, this, &MainWindow::changeLabel);
-    connect(ui->list_label, &QListWidget::itemDoubleClicked, this, &MainWindow::changeColor);
+    connect(ui->list_label->selectionModel(), &QItemSelectionModel::currentChanged, this, &MainWindow::changeLabel);
+    connect(ui->list_label, &QListView::doubleClicked, this, &MainWindow::changeColor);
+    connect(ui->edit_label_search, &QLineEdit::textChanged, labelFilter,
+            &QSortFilterProxyModel::setFilterFixedString);
+    connect(ui->edit_label_search, &QLineEdit::returnPressed, this, [this]()-> void
+    {
+        if (ui->list_label->isEnabled() && labelFilter->rowCount() > 0)
+        {
+            ui->list_label->setCurrentIndex(labelFilter->index(0, 0));
+        }
+    });
     ui->list_label->setEnabled(false);
 
     setAcceptDrops(true);
@@ -88,6 +238,13 @@ MainWindow::MainWindow(QWidget* parent, Qt::WindowFlags flags): QMainWindow(pare
 
 MainWindow::~MainWindow()
 {
+    indexingToken.cancel();
+    for (QFuture<void>& job : indexingJobs)
+    {
+        job.waitForFinished();
+    }
+    saveDatasetIndexes();
+    qDeleteAll(datasetIndexes);
     delete ui;
 }
 
@@ -100,6 +257,12 @@ void MainWindow::readSettings()
     ui->spinbox_pen_size->setValue(settings.value("pen_size", QVariant(30)).toInt());
     ui->spinbox_alpha->setValue(settings.value("alpha", QVariant(0.4)).toDouble());
     ui->spinbox_scale->setValue(settings.value("scale", QVariant(1.0)).toDouble());
+    ui->combo_engine->setCurrentText(settings.value("segmentation_engine", QVariant("Watershed")).toString());
+    sequence_mode_action->setChecked(settings.value("sequence_mode", QVariant(false)).toBool());
+    sequence_global_motion_action->setChecked(settings.value("sequence_global_motion", QVariant(false)).toBool());
+    memoryBudget = settings.value("memory_budget", QVariant(4096)).toLongLong() * 1024 * 1024;
+    edge_snapping_action->setChecked(settings.value("edge_snapping", QVariant(false)).toBool());
+    updateMemoryUsage();
 }
 
 void MainWindow::closeEvent(QCloseEvent* event)
@@ -110,7 +273,20 @@ void MainWindow::closeEvent(QCloseEvent* event)
     settings.setValue("pen_size", ui->spinbox_pen_size->value());
     settings.setValue("alpha", ui->spinbox_alpha->value());
     settings.setValue("scale", ui->spinbox_scale->value());
+    settings.setValue("segmentation_engine", ui->combo_engine->currentText());
+    settings.setValue("sequence_mode", sequence_mode_action->isChecked());
+    settings.setValue("sequence_global_motion", sequence_global_motion_action->isChecked());
+    settings.setValue("memory_budget", memoryBudget / (1024 * 1024));
+    settings.setValue("edge_snapping", edge_snapping_action->isChecked());
 
+    // Saves still writing finish before the tool exits
+    for (int i = 0; i < ui->tabWidget->count(); i++)
+    {
+        if (ImageCanvas* ic = getCanvasByIndex(i))
+        {
+            ic->waitUntilSaved();
+        }
+    }
     event->accept();
 }
 
@@ -163,15 +339,21 @@ void MainWindow::closeTab(int index)
         {
             ic->saveMask();
         }
+        else if (reply == QMessageBox::No)
+        {
+            ic->discardJournal();
+        }
         else if (reply == QMessageBox::Cancel)
         {
             return;
         }
     }
+    ic->waitUntilSaved();
 
     auto scrollArea = ui->tabWidget->widget(index);
     ui->tabWidget->removeTab(index);
     scrollArea->deleteLater();
+    updateWatchedMasks();
 }
 
 void MainWindow::registerShortcuts()
@@ -185,9 +367,9 @@ void MainWindow::registerShortcuts()
         shortcuts.append(shortcut);
         connect(shortcut, &QShortcut::activated, this, [=]()-> void
         {
-            if (ui->list_label->isEnabled() && row < ui->list_label->count())
+            if (ui->list_label->isEnabled() && row < labelModel->rowCount())
             {
-                ui->list_label->setCurrentRow(row, QItemSelectionModel::ClearAndSelect);
+                selectLabel(labelModel->labelAt(row).id);
                 update();
             }
         });
@@ -197,100 +379,915 @@ void MainWindow::registerShortcuts()
 void MainWindow::loadConfigLabels()
 {
     isLoadingNewLabels = true;
-    ui->list_label->clear();
-    QMapIterator it(labels);
-    while (it.hasNext())
+    QStringList shortcutTexts;
+    for (const QShortcut* shortcut : shortcuts)
     {
-        it.next();
-        const LabelInfo& label = it.value();
-        auto item = new QListWidgetItem(ui->list_label);
-        auto label_widget = new LabelWidget(label, this);
-
-        item->setSizeHint(label_widget->sizeHint());
-        item->setFlags(Qt::ItemIsSelectable | Qt::ItemIsEnabled);
-        ui->list_label->addItem(item);
-        ui->list_label->setItemWidget(item, label_widget);
-
-        auto& ref = labels[it.key()];
-        ref.item = item;
-
-        int id = ui->list_label->row(item);
+        shortcutTexts.append(shortcut->key().toString());
+    }
+    labelModel->setLabels(labels, shortcutTexts);
+    id_labels = getId2Label(labels);
+    paletteGeneration++;
+    isLoadingNewLabels = false;
 
-        if (id < 40)
+    // Border removal depends on which ids are labels
+    for (int i = 0; i < ui->tabWidget->count(); i++)
+    {
+        if (ImageCanvas* ic = getCanvasByIndex(i))
         {
-            QShortcut* shortcut = shortcuts.at(id);
-            QString text = label.name + " (" + shortcut->key().toString() + ")";
-            label_widget->setText(text);
+            ic->watershedCache().clear();
         }
     }
-    id_labels = getId2Label(labels);
-    isLoadingNewLabels = false;
+
+    if (imageCanvas_)
+    {
+        imageCanvas_->updateMaskColor();
+    }
 }
 
-void MainWindow::changeColor(QListWidgetItem* item)
+void MainWindow::changeColor(const QModelIndex& index)
 {
-    LabelWidget* widget = dynamic_cast<LabelWidget*>(ui->list_label->itemWidget(item));
-    LabelInfo& label = labels[widget->getName()];
+    const QModelIndex source = labelFilter->mapToSource(index);
+    if (!source.isValid())
+    {
+        return;
+    }
+    LabelInfo& label = labels[labelModel->labelAt(source.row()).name];
     QColor color = QColorDialog::getColor(label.color, this);
-    if (color.isValid())
+    if (!color.isValid())
+    {
+        return;
+    }
+    label.color = color;
+    labelModel->updateLabel(label);
+    // Editing the map may have detached it, the id lookup must point into the current data
+    id_labels = getId2Label(labels);
+    paletteGeneration++;
+
+    if (imageCanvas_)
+    {
+        imageCanvas_->setLabelColor(label.id);
+        imageCanvas_->updateMaskColor();
+        imageCanvas_->refresh();
+    }
+}
+
+void MainWindow::remapLabels()
+{
+    const QStringList directories = openedDirectories();
+    if (directories.isEmpty())
+    {
+        statusBar()->showMessage(tr("No opened directory to remap"));
+        return;
+    }
+
+    QDialog dialog(this);
+    dialog.setWindowTitle(tr("Remap labels"));
+    auto layout = new QFormLayout(&dialog);
+    auto config = new QLineEdit(&dialog);
+    auto browse = new QPushButton(tr("Browse..."), &dialog);
+    connect(browse, &QPushButton::clicked, &dialog, [&]()-> void
+    {
+        const QString file = QFileDialog::getOpenFileName(&dialog, tr("New Config File"), config->text(),
+                                                          tr("JSon file (*.json)"));
+        if (!file.isEmpty())
+        {
+            config->setText(file);
+        }
+    });
+    auto configRow = new QHBoxLayout();
+    configRow->addWidget(config);
+    configRow->addWidget(browse);
+    layout->addRow(tr("New config"), configRow);
+    auto merges = new QLineEdit(&dialog);
+    merges->setPlaceholderText(tr("e.g. polegroup=pole,other=unlabeled"));
+    layout->addRow(tr("Merged labels"), merges);
+    auto replaced = new QLineEdit(config_file, &dialog);
+    replaced->setPlaceholderText(tr("none, the new labels are only loaded"));
+    layout->addRow(tr("Replaced config"), replaced);
+    auto dryRun = new QCheckBox(tr("Only count the pixels that would change"), &dialog);
+    dryRun->setChecked(true);
+    layout->addRow(tr("Dry run"), dryRun);
+    auto buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel, &dialog);
+    connect(buttons, &QDialogButtonBox::accepted, &dialog, &QDialog::accept);
+    connect(buttons, &QDialogButtonBox::rejected, &dialog, &QDialog::reject);
+    layout->addRow(buttons);
+    if (dialog.exec() != QDialog::Accepted)
+    {
+        return;
+    }
+
+    Name2Labels to;
+    QMap<QString, QString> mergeMap;
+    QVector<quint16> remap;
+    QString error;
+    if (!readLabelsFile(config->text(), &to))
     {
-        label.color = color;
-        widget->setNewLabel(label);
+        error = tr("Couldn't read %1").arg(config->text());
     }
-    imageCanvas_->setLabelColor(label.id);
-    imageCanvas_->updateMaskColor(id_labels);
-    imageCanvas_->refresh();
+    if (!error.isEmpty() || !parseLabelMerges(merges->text(), &mergeMap, &error)
+        || !configRemap(labels, to, mergeMap, &remap, &error))
+    {
+        QMessageBox::warning(this, tr("Remap labels"), error);
+        return;
+    }
+    auto job = new LabelRemapJob(directories, remap, labels, to, dryRun->isChecked(), this);
+    if (!job->error().isEmpty())
+    {
+        QMessageBox::warning(this, tr("Remap labels"), job->error());
+        delete job;
+        return;
+    }
+    if (!dryRun->isChecked())
+    {
+        // The files are the reference while they are rewritten, open tabs are reloaded from them afterwards
+        for (int i = 0; i < ui->tabWidget->count(); i++)
+        {
+            if (ImageCanvas* ic = getCanvasByIndex(i))
+            {
+                ic->saveMask();
+            }
+        }
+        for (int i = 0; i < ui->tabWidget->count(); i++)
+        {
+            if (ImageCanvas* ic = getCanvasByIndex(i))
+            {
+                ic->waitUntilSaved();
+            }
+        }
+    }
+
+    const QString configFile = replaced->text();
+    auto progress = new QProgressDialog(dryRun->isChecked() ? tr("Counting remapped pixels...")
+                                                            : tr("Remapping labels..."),
+                                        tr("Cancel"), 0, job->total(), this);
+    progress->setWindowModality(Qt::WindowModal);
+    progress->setMinimumDuration(0);
+    connect(job, &LabelRemapJob::progressChanged, progress, &QProgressDialog::setValue);
+    connect(progress, &QProgressDialog::canceled, job, &LabelRemapJob::cancel);
+    connect(job, &LabelRemapJob::finished, this, [=](int changed, bool canceled)-> void
+    {
+        QString recordError;
+        if (!job->isDryRun())
+        {
+            // A partial run keeps the old labels: running the same remap again finishes it
+            if (job->isComplete())
+            {
+                labels = to;
+                loadConfigLabels();
+            }
+            if (!configFile.isEmpty())
+            {
+                if (saveRemapRecord(configFile, *job, &recordError))
+                {
+                    config_file = configFile;
+                }
+                else
+                {
+                    recordError = tr("Couldn't write %1.").arg(recordError);
+                }
+            }
+            for (int i = 0; i < ui->tabWidget->count(); i++)
+            {
+                if (ImageCanvas* ic = getCanvasByIndex(i))
+                {
+                    ic->reloadFromDisk();
+                }
+            }
+        }
+        QMessageBox box(QMessageBox::Information, tr("Remap labels"),
+                        tr("%1 of %2 images %3%4.")
+                        .arg(changed).arg(job->total())
+                        .arg(job->isDryRun() ? tr("would change") : tr("remapped"))
+                        .arg(canceled ? tr(" (canceled)") : QString()), QMessageBox::Ok, this);
+        if (!job->isDryRun() && !job->isComplete())
+        {
+            box.setInformativeText((job->failed() > 0 ? tr("%1 images couldn't be written. ").arg(job->failed())
+                                                      : QString())
+                                   + tr("The remap is unfinished and the old labels are kept; the remapped files "
+                                        "are logged, running the same remap again skips them and finishes it. ")
+                                   + recordError);
+        }
+        else if (!job->isDryRun())
+        {
+            box.setInformativeText(configFile.isEmpty()
+                                       ? tr("Save the config file to keep the new labels.")
+                                       : recordError.isEmpty()
+                                       ? tr("%1 now holds the new labels.").arg(configFile)
+                                       : recordError);
+        }
+        box.setDetailedText(job->report());
+        box.exec();
+        progress->deleteLater();
+        job->deleteLater();
+    });
+    job->start();
 }
 
-void MainWindow::changeLabel(QListWidgetItem* current, QListWidgetItem* previous)
+void MainWindow::evaluateAgainstGold()
 {
-    if (!isLoadingNewLabels && current)
+    const QString gold = QFileDialog::getExistingDirectory(this, tr("Gold Masks Directory"), curr_open_dir);
+    if (gold.isEmpty())
     {
-        if (previous)
+        return;
+    }
+    const QString annotated = QFileDialog::getExistingDirectory(this, tr("Evaluated Masks Directory"),
+                                                                curr_open_dir);
+    if (annotated.isEmpty())
+    {
+        return;
+    }
+    // The masks on disk are compared; unsaved edits are only written if the user wants them included
+    QVector<ImageCanvas*> unsaved;
+    for (int i = 0; i < ui->tabWidget->count(); i++)
+    {
+        ImageCanvas* ic = getCanvasByIndex(i);
+        if (ic && ic->isNotSaved())
         {
-            dynamic_cast<LabelWidget*>(ui->list_label->itemWidget(previous))->setSelected(false);
+            unsaved.append(ic);
         }
-        else
+    }
+    if (!unsaved.isEmpty())
+    {
+        QMessageBox::StandardButton reply = QMessageBox::question(
+            this,
+            tr("Evaluate against gold masks"),
+            tr("%1 open tabs have unsaved changes. Save them before the evaluation? "
+               "Otherwise only the masks on disk are compared.").arg(unsaved.size()),
+            QMessageBox::Yes | QMessageBox::No | QMessageBox::Cancel,
+            QMessageBox::Cancel
+        );
+        if (reply == QMessageBox::Cancel)
+        {
+            return;
+        }
+        if (reply == QMessageBox::Yes)
         {
-            for (int i = 0; i < ui->list_label->count(); i++)
+            for (ImageCanvas* ic : unsaved)
+            {
+                ic->saveMask();
+            }
+            // The comparison reads the files
+            for (ImageCanvas* ic : unsaved)
             {
-                dynamic_cast<LabelWidget*>(ui->list_label->itemWidget(ui->list_label->item(i)))->setSelected(false);
+                ic->waitUntilSaved();
             }
+            unsaved.clear();
+        }
+    }
+    const int skippedTabs = unsaved.size();
+
+    auto job = new EvaluationJob(gold, annotated, labels, this);
+    auto progress = new QProgressDialog(tr("Comparing masks..."), tr("Cancel"), 0, job->total(), this);
+    progress->setWindowModality(Qt::WindowModal);
+    progress->setMinimumDuration(0);
+    connect(job, &EvaluationJob::progressChanged, progress, &QProgressDialog::setValue);
+    connect(progress, &QProgressDialog::canceled, job, &EvaluationJob::cancel);
+    connect(job, &EvaluationJob::finished, this, [=](bool canceled)-> void
+    {
+        progress->deleteLater();
+        job->deleteLater();
+        if (canceled)
+        {
+            statusBar()->showMessage(tr("Evaluation canceled"));
+            return;
+        }
+        QString report = formatEvaluationReport(job->result());
+        if (skippedTabs > 0)
+        {
+            report += tr("Unsaved changes of %1 open tabs are not included\n").arg(skippedTabs);
         }
-        auto label = dynamic_cast<LabelWidget*>(ui->list_label->itemWidget(current));
-        label->setSelected(true);
-        const QString key = label->getName();
+        report += writeEvaluationReports(job->result(), annotated)
+                      ? tr("Reports written in %1\n").arg(annotated)
+                      : tr("Couldn't write the reports in %1\n").arg(annotated);
+
+        auto dialog = new QDialog(this);
+        dialog->setWindowTitle(tr("Evaluation against %1").arg(gold));
+        dialog->setAttribute(Qt::WA_DeleteOnClose);
+        auto layout = new QVBoxLayout(dialog);
+        auto text = new QPlainTextEdit(report, dialog);
+        text->setReadOnly(true);
+        text->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+        layout->addWidget(text);
+        dialog->resize(700, 500);
+        dialog->show();
+    });
+    job->start();
+}
+
+QStringList MainWindow::openedDirectories() const
+{
+    QStringList directories;
+    for (int i = 0; i < ui->tree_widget_img->topLevelItemCount(); i++)
+    {
+        directories.append(ui->tree_widget_img->topLevelItem(i)->text(0));
+    }
+    return directories;
+}
+
+void MainWindow::exportColorMasks()
+{
+    const QStringList directories = openedDirectories();
+    if (directories.isEmpty())
+    {
+        statusBar()->showMessage(tr("No opened directory to export"));
+        return;
+    }
+
+    auto job = new ColorMaskExportJob(directories, labels, this);
+    auto progress = new QProgressDialog(tr("Re-exporting color masks..."), tr("Cancel"), 0, job->total(), this);
+    progress->setWindowModality(Qt::WindowModal);
+    progress->setMinimumDuration(0);
+    connect(job, &ColorMaskExportJob::progressChanged, progress, &QProgressDialog::setValue);
+    connect(progress, &QProgressDialog::canceled, job, &ColorMaskExportJob::cancel);
+    connect(job, &ColorMaskExportJob::finished, this, [=](int exported, bool canceled)-> void
+    {
+        statusBar()->showMessage(
+            QString("%1 color masks re-exported%2").arg(exported).arg(canceled ? " (canceled)" : "")
+        );
+        progress->deleteLater();
+        job->deleteLater();
+    });
+    job->start();
+}
+
+void MainWindow::exportShards()
+{
+    ShardExportOptions options;
+    options.directories = openedDirectories();
+    if (options.directories.isEmpty())
+    {
+        statusBar()->showMessage(tr("No opened directory to export"));
+        return;
+    }
+
+    QDialog dialog(this);
+    dialog.setWindowTitle(tr("Export training shards"));
+    auto layout = new QFormLayout(&dialog);
+    auto output = new QLineEdit(&dialog);
+    auto browse = new QPushButton(tr("Browse..."), &dialog);
+    connect(browse, &QPushButton::clicked, &dialog, [&]()-> void
+    {
+        const QString directory = QFileDialog::getExistingDirectory(&dialog, tr("Shard directory"), output->text());
+        if (!directory.isEmpty())
+        {
+            output->setText(directory);
+        }
+    });
+    auto outputRow = new QHBoxLayout();
+    outputRow->addWidget(output);
+    outputRow->addWidget(browse);
+    layout->addRow(tr("Output directory"), outputRow);
+    auto webDataset = new QCheckBox(tr("WebDataset tar"), &dialog);
+    webDataset->setChecked(true);
+    auto npy = new QCheckBox(tr("NumPy .npy stacks"), &dialog);
+    layout->addRow(tr("Formats"), webDataset);
+    layout->addRow(QString(), npy);
+    auto width = new QSpinBox(&dialog);
+    auto height = new QSpinBox(&dialog);
+    for (QSpinBox* side : {width, height})
+    {
+        side->setRange(0, 16384);
+        side->setSpecialValueText(tr("native"));
+    }
+    layout->addRow(tr("Width"), width);
+    layout->addRow(tr("Height"), height);
+    auto shardSize = new QSpinBox(&dialog);
+    shardSize->setRange(1, 1000000);
+    shardSize->setValue(1000);
+    layout->addRow(tr("Samples per shard"), shardSize);
+    auto remap = new QLineEdit(&dialog);
+    remap->setPlaceholderText(tr("e.g. 7=1,road=1,car=2"));
+    layout->addRow(tr("Label remapping"), remap);
+    auto buttons = new QDialogButtonBox(QDialogButtonBox::Ok | QDialogButtonBox::Cancel, &dialog);
+    connect(buttons, &QDialogButtonBox::accepted, &dialog, &QDialog::accept);
+    connect(buttons, &QDialogButtonBox::rejected, &dialog, &QDialog::reject);
+    layout->addRow(buttons);
+    if (dialog.exec() != QDialog::Accepted || output->text().isEmpty())
+    {
+        return;
+    }
+
+    options.output = output->text();
+    options.webDataset = webDataset->isChecked();
+    options.npy = npy->isChecked();
+    if (width->value() > 0 && height->value() > 0)
+    {
+        options.size = QSize(width->value(), height->value());
+    }
+    options.samplesPerShard = shardSize->value();
+    options.remap = identityRemap();
+    QString error;
+    if (!parseLabelRemap(remap->text(), labels, &options.remap, &error))
+    {
+        QMessageBox::warning(this, tr("Export training shards"), error);
+        return;
+    }
+    auto job = new ShardExportJob(options, this);
+    if (!job->prepare(&error))
+    {
+        QMessageBox::warning(this, tr("Export training shards"), error);
+        delete job;
+        return;
+    }
+
+    auto progress = new QProgressDialog(tr("Exporting %1 samples...").arg(job->samples()), tr("Cancel"), 0,
+                                        job->shards() - job->resumed(), this);
+    progress->setWindowModality(Qt::WindowModal);
+    progress->setMinimumDuration(0);
+    connect(job, &ShardExportJob::progressChanged, progress, &QProgressDialog::setValue);
+    connect(progress, &QProgressDialog::canceled, job, &ShardExportJob::cancel);
+    connect(job, &ShardExportJob::finished, this, [=](int written, bool canceled)-> void
+    {
+        statusBar()->showMessage(
+            QString("%1 shards written%2").arg(written).arg(canceled ? " (canceled, export again to resume)" : "")
+        );
+        progress->deleteLater();
+        job->deleteLater();
+    });
+    job->start();
+}
+
+void MainWindow::changeLabel(const QModelIndex& current)
+{
+    // The view repaints the previous and the current row itself
+    const QModelIndex source = labelFilter->mapToSource(current);
+    if (!isLoadingNewLabels && source.isValid() && imageCanvas_)
+    {
+        const LabelInfo& label = labelModel->labelAt(source.row());
         statusBar()->showMessage(
             QString("label=[%1] id=[%2] category=[%3] color=[%4]")
-            .arg(key)
-            .arg(labels[key].id)
-            .arg(labels[key].category)
-            .arg(labels[key].color.name())
+            .arg(label.name)
+            .arg(label.id)
+            .arg(label.category)
+            .arg(label.color.name())
         );
-        imageCanvas_->setLabelColor(labels[key].id);
+        imageCanvas_->setLabelColor(label.id);
+        inputRecorder.recordLabel(label.id);
+    }
+}
+
+void MainWindow::selectLabel(int id)
+{
+    const int row = labelModel->rowOfId(id);
+    if (row < 0)
+    {
+        return;
+    }
+    QModelIndex index = labelFilter->mapFromSource(labelModel->index(row));
+    if (!index.isValid())
+    {
+        ui->edit_label_search->clear();
+        index = labelFilter->mapFromSource(labelModel->index(row));
+    }
+    if (index == ui->list_label->currentIndex())
+    {
+        // Picked again, e.g. on another tab: no current change to hear about
+        changeLabel(index);
+    }
+    ui->list_label->setCurrentIndex(index);
+    ui->list_label->scrollTo(index);
+}
+
+QImage MainWindow::runSegmentationEngine(const SegmentationEngine* engine, const QImage& image, const cv::Mat& native,
+                                         const QImage& markers)
+{
+    if (engine->isInteractive())
+    {
+        return native.empty() ? engine->segment(image, markers) : engine->segmentNative(native, markers);
     }
+
+    // Slow engines run in a worker behind a modal progress dialog, the caller still gets the result synchronously
+    CancelToken cancel;
+    QProgressDialog progress(tr("Running %1...").arg(engine->name()), tr("Cancel"), 0, 1000, this);
+    progress.setWindowModality(Qt::WindowModal);
+    progress.setMinimumDuration(0);
+    progress.setValue(0);
+    connect(&progress, &QProgressDialog::canceled, this, [&cancel]()-> void
+    {
+        cancel.cancel();
+    });
+    QFutureWatcher<QImage> watcher;
+    QEventLoop loop;
+    connect(&watcher, &QFutureWatcher<QImage>::finished, &loop, &QEventLoop::quit);
+    watcher.setFuture(JobScheduler::instance().run(JobClass::Interactive, [&]()-> QImage
+    {
+        const auto report = [&progress](double value)-> void
+        {
+            QMetaObject::invokeMethod(&progress, [&progress, value]()-> void
+            {
+                progress.setValue(static_cast<int>(value * 1000));
+            }, Qt::QueuedConnection);
+        };
+        return native.empty()
+                   ? engine->segment(image, markers, cancel.flag(), report)
+                   : engine->segmentNative(native, markers, cancel.flag(), report);
+    }));
+    loop.exec();
+    return watcher.result();
 }
 
 void MainWindow::runWatershed()
 {
-    if (imageCanvas_)
+    if (imageCanvas_ && imageCanvas_->isLoaded())
     {
-        QImage iwatershed = watershed(imageCanvas_->getImage(), imageCanvas_->getMask().id);
-        if (!ui->checkbox_border_ws->isChecked())
+        // Undo, redo and label picks re-run the segmentation on markers it has often already seen
+        const SegmentationEngine* engine = findSegmentationEngine(ui->combo_engine->currentText());
+        const QImage image = imageCanvas_->getImage();
+        const QImage markers = imageCanvas_->getMask().id;
+        const bool keepBorder = ui->checkbox_border_ws->isChecked();
+        const cv::Mat native = ui->checkbox_native_segmentation->isChecked() ? imageCanvas_->nativeImage() : cv::Mat();
+        const quint64 key = WatershedCache::key(markers, keepBorder,
+                                                engine->name() + (native.empty() ? "" : " native"));
+        QImage iwatershed;
+        if (!imageCanvas_->watershedCache().find(key, &iwatershed))
         {
-            iwatershed = removeBorder(iwatershed, id_labels);
+            const qint64 before = currentMemoryUsage();
+            QElapsedTimer timer;
+            timer.start();
+            iwatershed = runSegmentationEngine(engine, image, native, markers);
+            const qint64 after = currentMemoryUsage();
+            if (iwatershed.isNull())
+            {
+                statusBar()->showMessage(tr("%1 canceled").arg(engine->name()));
+                return;
+            }
+
+            QVector<qint64>& timings = engineTimings[engine->name()];
+            timings.append(timer.elapsed());
+            QVector<qint64> sorted = timings;
+            std::sort(sorted.begin(), sorted.end());
+            statusBar()->showMessage(QString("%1: %2 ms (median %3 ms over %4 runs), working set %5 MB before, "
+                                             "%6 MB after")
+                                     .arg(engine->name())
+                                     .arg(timings.last())
+                                     .arg(sorted[sorted.size() / 2])
+                                     .arg(sorted.size())
+                                     .arg(before / (1024 * 1024))
+                                     .arg(after / (1024 * 1024)));
+
+            if (!keepBorder)
+            {
+                iwatershed = removeBorder(iwatershed, id_labels);
+            }
+            imageCanvas_->watershedCache().insert(key, iwatershed);
         }
         imageCanvas_->setWatershedMask(iwatershed);
         ui->checkbox_watershed_mask->setCheckState(Qt::CheckState::Checked);
         imageCanvas_->update();
+        if (sequence_mode_action->isChecked())
+        {
+            sequenceTimer.start();
+        }
+    }
+}
+
+QString MainWindow::neighborFile(const QString& imageFile, int offset) const
+{
+    const QFileInfo info(imageFile);
+    for (int i = 0; i < ui->tree_widget_img->topLevelItemCount(); i++)
+    {
+        QTreeWidgetItem* directory = ui->tree_widget_img->topLevelItem(i);
+        if (QFileInfo(directory->text(0)).absoluteFilePath() != info.absolutePath())
+        {
+            continue;
+        }
+        for (int j = 0; j < directory->childCount(); j++)
+        {
+            if (directory->child(j)->text(0) == info.fileName())
+            {
+                const int neighbor = j + offset;
+                return neighbor >= 0 && neighbor < directory->childCount()
+                           ? info.absolutePath() + "/" + directory->child(neighbor)->text(0)
+                           : QString();
+            }
+        }
+    }
+    return QString();
+}
+
+PropagationRequest MainWindow::propagationRequest(const ImageCanvas* from, const QString& nextFile) const
+{
+    PropagationRequest request;
+    request.previousImage = from->getImage();
+    request.previousMarkers = from->getMask().id;
+    request.nextFile = nextFile;
+    request.engine = findSegmentationEngine(ui->combo_engine->currentText());
+    request.keepBorder = ui->checkbox_border_ws->isChecked();
+    request.labels = id_labels;
+    request.model = sequence_global_motion_action->isChecked() ? MotionModel::GlobalShift : MotionModel::DenseFlow;
+    return request;
+}
+
+void MainWindow::editDisplayMapping()
+{
+    QPointer<ImageCanvas> ic = getCurrentImageCanvas();
+    if (!ic || ic->nativeImage().empty())
+    {
+        statusBar()->showMessage(tr("The current image is 8-bit RGB, it is shown as decoded"));
+        return;
+    }
+
+    const cv::Mat& native = ic->nativeImage();
+    const DisplayMapping mapping = ic->displayMapping();
+    auto dialog = new QDialog(this);
+    dialog->setWindowTitle(tr("Display mapping of %1").arg(QFileInfo(ic->imageFilePath()).fileName()));
+    dialog->setAttribute(Qt::WA_DeleteOnClose);
+    auto layout = new QFormLayout(dialog);
+
+    QSpinBox* bands[3];
+    const QStringList names{tr("Red band"), tr("Green band"), tr("Blue band")};
+    for (int i = 0; i < 3; i++)
+    {
+        bands[i] = new QSpinBox(dialog);
+        bands[i]->setRange(0, native.channels() - 1);
+        bands[i]->setValue(mapping.bands[i]);
+        layout->addRow(names[i], bands[i]);
+    }
+    const double maximum = native.depth() == CV_16U ? 65535 : 255;
+    auto low = new QDoubleSpinBox(dialog);
+    auto high = new QDoubleSpinBox(dialog);
+    for (QDoubleSpinBox* bound : {low, high})
+    {
+        bound->setRange(0, maximum);
+        bound->setDecimals(0);
+    }
+    low->setValue(mapping.low);
+    high->setValue(mapping.high);
+    layout->addRow(tr("Black level"), low);
+    layout->addRow(tr("White level"), high);
+    auto gamma = new QDoubleSpinBox(dialog);
+    gamma->setRange(0.1, 5);
+    gamma->setSingleStep(0.1);
+    gamma->setValue(mapping.gamma);
+    layout->addRow(tr("Gamma"), gamma);
+
+    auto apply = [=]()-> void
+    {
+        if (!ic)
+        {
+            return;
+        }
+        DisplayMapping changed = mapping;
+        for (int i = 0; i < 3; i++)
+        {
+            changed.bands[i] = bands[i]->value();
+        }
+        changed.low = low->value();
+        changed.high = high->value();
+        changed.gamma = gamma->value();
+        ic->setDisplayMapping(changed);
+        displayMapping = changed;
+    };
+    for (int i = 0; i < 3; i++)
+    {
+        connect(bands[i], &QSpinBox::valueChanged, dialog, apply);
+    }
+    for (QDoubleSpinBox* value : {low, high, gamma})
+    {
+        connect(value, &QDoubleSpinBox::valueChanged, dialog, apply);
+    }
+    dialog->show();
+}
+
+void MainWindow::prefetchNextFrame()
+{
+    if (!sequence_mode_action->isChecked() || !imageCanvas_ || !imageCanvas_->isLoaded()
+        || isFullZero(imageCanvas_->getMask().id))
+    {
+        return;
+    }
+    const QString next = neighborFile(imageCanvas_->imageFilePath(), 1);
+    if (!next.isEmpty())
+    {
+        sequencePrefetcher.request(propagationRequest(imageCanvas_, next));
+    }
+}
+
+void MainWindow::seedFromPreviousFrame(ImageCanvas* ic, const ImageCanvas* previous)
+{
+    if (!isFullZero(ic->getMask().id))
+    {
+        return;
+    }
+    const QString previousFile = neighborFile(ic->imageFilePath(), -1);
+    const bool fromPrevious = previous && previous->isLoaded() && previous->imageFilePath() == previousFile
+        && !isFullZero(previous->getMask().id);
+    PropagatedFrame frame;
+    const bool prefetched = sequencePrefetcher.take(ic->imageFilePath(), &frame);
+    // Jumped to the frame before the background propagation was done, or edited the previous frame since
+    if (fromPrevious && (!prefetched || frame.sourceKey != SequencePrefetcher::sourceKey(previous->getMask().id)))
+    {
+        sequencePrefetcher.cancel();
+        frame = SequencePrefetcher::propagate(propagationRequest(previous, ic->imageFilePath()));
+    }
+    if (frame.markers.isNull())
+    {
+        return;
+    }
+
+    ic->seedMask(frame.markers);
+    ic->watershedCache().insert(frame.cacheKey, frame.labels);
+    ic->setWatershedMask(frame.labels);
+    ui->checkbox_watershed_mask->setCheckState(Qt::CheckState::Checked);
+    ic->update();
+    statusBar()->showMessage(tr("Markers propagated from %1").arg(QFileInfo(previousFile).fileName()));
+    sequenceTimer.start();
+}
+
+QVector<MemoryUsage> MainWindow::tabMemoryUsage(MemoryUsage* total) const
+{
+    QVector<MemoryUsage> usages;
+    *total = MemoryUsage();
+    for (int i = 0; i < ui->tabWidget->count(); i++)
+    {
+        const ImageCanvas* ic = getCanvasByIndex(i);
+        usages.append(ic ? ic->memoryUsage() : MemoryUsage());
+        *total += usages.last();
+    }
+    // Only what no tab shares any more
+    total->add(MemoryCategory::Clipboard, copiedMask.id);
+    total->add(MemoryCategory::Clipboard, copiedMask.color);
+    total->addBytes(MemoryCategory::Pool, PlanePool::instance().freeBytes());
+    return usages;
+}
+
+qint64 MainWindow::enforceMemoryBudget(qint64 total)
+{
+    QVector<ImageCanvas*> canvases;
+    for (int i = 0; i < ui->tabWidget->count(); i++)
+    {
+        ImageCanvas* ic = getCanvasByIndex(i);
+        if (ic && ic != imageCanvas_)
+        {
+            canvases.append(ic);
+        }
+    }
+    if (imageCanvas_)
+    {
+        canvases.append(imageCanvas_);
+    }
+
+    // Cheapest losses first: results computed again on demand, then long undo histories, then all but one step
+    const int undoStates[] = {0, 10, 2};
+    int trimmed = 0;
+    if (total > memoryBudget)
+    {
+        const qint64 pooled = PlanePool::instance().freeBytes();
+        PlanePool::instance().trim();
+        total -= pooled;
+    }
+    for (int step = 0; step < 3 && total > memoryBudget; step++)
+    {
+        for (ImageCanvas* ic : canvases)
+        {
+            if (total <= memoryBudget)
+            {
+                break;
+            }
+            const qint64 before = ic->memoryUsage().total();
+            if (step == 0)
+            {
+                ic->dropCaches();
+            }
+            else if (ic->trimUndo(undoStates[step]))
+            {
+                trimmed++;
+            }
+            total -= before - ic->memoryUsage().total();
+        }
+    }
+    if (trimmed > 0)
+    {
+        statusBar()->showMessage(tr("Over the memory budget, undo history shortened in %1 tabs").arg(trimmed), 5000);
+    }
+    return total;
+}
+
+bool MainWindow::confirmMemoryForImage(const QString& filePath)
+{
+    MemoryUsage usage;
+    tabMemoryUsage(&usage);
+    const qint64 needed = estimatedTabBytes(QImageReader(filePath).size());
+    const qint64 total = enforceMemoryBudget(usage.total() + needed) - needed;
+    if (total + needed <= memoryBudget)
+    {
+        return true;
+    }
+    const QMessageBox::StandardButton reply = QMessageBox::question(
+        this,
+        tr("Memory budget"),
+        tr("Opening %1 needs about %2 while the open tabs already use %3 of the %4 budget. Open it anyway?")
+        .arg(QFileInfo(filePath).fileName(), formatMegabytes(needed), formatMegabytes(total),
+             formatMegabytes(memoryBudget)),
+        QMessageBox::Yes | QMessageBox::No,
+        QMessageBox::No
+    );
+    return reply == QMessageBox::Yes;
+}
+
+void MainWindow::updateMemoryUsage()
+{
+    MemoryUsage total;
+    QVector<MemoryUsage> usages = tabMemoryUsage(&total);
+    if (total.total() > memoryBudget)
+    {
+        enforceMemoryBudget(total.total());
+        usages = tabMemoryUsage(&total);
+    }
+    memoryLabel->setText(tr("Memory %1 / %2%3")
+                         .arg(formatMegabytes(total.total()), formatMegabytes(memoryBudget))
+                         .arg(total.total() > memoryBudget ? tr(" (over budget)") : QString()));
+
+    if (!memoryTable)
+    {
+        return;
     }
+    const int categories = static_cast<int>(MemoryCategory::Count);
+    memoryTable->setRowCount(usages.size() + 1);
+    const auto setRow = [this, categories](int row, const QString& name, const MemoryUsage& usage)-> void
+    {
+        memoryTable->setItem(row, 0, new QTableWidgetItem(name));
+        for (int category = 0; category < categories; category++)
+        {
+            const qint64 bytes = usage.bytes(static_cast<MemoryCategory>(category));
+            auto item = new QTableWidgetItem(formatMegabytes(bytes));
+            item->setTextAlignment(Qt::AlignRight | Qt::AlignVCenter);
+            memoryTable->setItem(row, category + 1, item);
+        }
+        auto item = new QTableWidgetItem(formatMegabytes(usage.total()));
+        item->setTextAlignment(Qt::AlignRight | Qt::AlignVCenter);
+        memoryTable->setItem(row, categories + 1, item);
+    };
+    for (int i = 0; i < usages.size(); i++)
+    {
+        setRow(i, ui->tabWidget->tabText(i), usages[i]);
+    }
+    setRow(usages.size(), tr("Total"), total);
 }
 
-void MainWindow::setStarAtNameOfTab(bool star)
+void MainWindow::showMemoryUsage()
 {
-    if (ui->tabWidget->count() > 0)
+    if (memoryTable)
+    {
+        memoryTable->window()->raise();
+        memoryTable->window()->activateWindow();
+        return;
+    }
+
+    auto dialog = new QDialog(this);
+    dialog->setWindowTitle(tr("Memory usage"));
+    dialog->setAttribute(Qt::WA_DeleteOnClose);
+    auto layout = new QVBoxLayout(dialog);
+    const int categories = static_cast<int>(MemoryCategory::Count);
+    memoryTable = new QTableWidget(0, categories + 2, dialog);
+    QStringList headers{tr("Tab")};
+    for (int category = 0; category < categories; category++)
+    {
+        headers.append(memoryCategoryName(static_cast<MemoryCategory>(category)));
+    }
+    headers.append(tr("Total"));
+    memoryTable->setHorizontalHeaderLabels(headers);
+    memoryTable->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    memoryTable->verticalHeader()->hide();
+    memoryTable->horizontalHeader()->setSectionResizeMode(QHeaderView::ResizeToContents);
+    layout->addWidget(memoryTable);
+    dialog->resize(900, 300);
+    // The table follows the memory timer while the dialog is open
+    updateMemoryUsage();
+    dialog->show();
+}
+
+void MainWindow::editMemoryBudget()
+{
+    bool ok = false;
+    const int megabytes = QInputDialog::getInt(this, tr("Memory budget"),
+                                               tr("Memory the open tabs may use before caches and undo history "
+                                                   "are dropped, in MB:"),
+                                               static_cast<int>(memoryBudget / (1024 * 1024)), 256, 1024 * 1024, 256,
+                                               &ok);
+    if (ok)
+    {
+        memoryBudget = qint64(megabytes) * 1024 * 1024;
+        updateMemoryUsage();
+    }
+}
+
+void MainWindow::setStarAtNameOfTab(bool star, const ImageCanvas* ic)
+{
+    int index = ui->tabWidget->currentIndex();
+    if (ic && (index < 0 || getCanvasByIndex(index) != ic))
+    {
+        index = -1;
+        for (int i = 0; i < ui->tabWidget->count(); i++)
+        {
+            if (getCanvasByIndex(i) == ic)
+            {
+                index = i;
+            }
+        }
+    }
+    if (index >= 0)
     {
-        int index = ui->tabWidget->currentIndex();
         QString name = ui->tabWidget->tabText(index);
         if (star && !name.endsWith("*"))
         {
@@ -345,12 +1342,28 @@ void MainWindow::allDisconnect(const ImageCanvas* ic)
 void MainWindow::onTabWidgetCurrentChanged(const int index)
 {
     qDebug() << "onTabWidgetCurrentChanged " << index;
+    if (imageCanvas_)
+    {
+        imageCanvas_->setShown(false);
+    }
     if (index >= 0 && index < ui->tabWidget->count())
     {
         allDisconnect(imageCanvas_);
         imageCanvas_ = getCanvasByIndex(index);
         ui->list_label->setEnabled(imageCanvas_);
         initCanvasConnection(imageCanvas_);
+        if (imageCanvas_)
+        {
+            imageCanvas_->setShown(true);
+            imageCanvas_->updateMaskColor();
+            inputRecorder.recordImage(imageCanvas_->imageFilePath());
+            QSignalBlocker blocker(disagreement_action);
+            disagreement_action->setChecked(imageCanvas_->hasOverlay());
+            if (sequence_mode_action->isChecked())
+            {
+                sequenceTimer.start();
+            }
+        }
     }
     else
     {
@@ -408,14 +1421,39 @@ void MainWindow::onTreeWidgetItemClicked()
 
     if (index == -1)
     {
-        auto scrollArea = new QScrollArea(this);
-        auto imageCanvas = new ImageCanvas(scrollArea, this);
-        imageCanvas->loadImage(currentDir() + "/" + iFile);
-        index = ui->tabWidget->addTab(scrollArea, iFile);
+        if (!confirmMemoryForImage(currentDir() + "/" + iFile))
+        {
+            return;
+        }
+        const QPointer<ImageCanvas> previous = imageCanvas_;
+        ImageCanvas* ic = openImage(currentDir() + "/" + iFile);
+        if (sequence_mode_action->isChecked())
+        {
+            connect(ic, &ImageCanvas::loaded, this, [this, ic, previous]()-> void
+            {
+                seedFromPreviousFrame(ic, previous);
+            }, Qt::SingleShotConnection);
+        }
+        return;
     }
     ui->tabWidget->setCurrentIndex(index);
 }
 
+ImageCanvas* MainWindow::openImage(const QString& filePath)
+{
+    auto scrollArea = new QScrollArea(this);
+    auto imageCanvas = new ImageCanvas(scrollArea, this);
+    connect(imageCanvas, &ImageCanvas::loaded, this, [this, imageCanvas]()-> void
+    {
+        updateExternalMaskFlag(imageCanvas);
+        updateWatchedMasks();
+    });
+    imageCanvas->loadImage(filePath);
+    int index = ui->tabWidget->addTab(scrollArea, QFileInfo(filePath).fileName());
+    ui->tabWidget->setCurrentIndex(index);
+    return imageCanvas;
+}
+
 void MainWindow::on_actionOpenDir_triggered()
 {
     statusBar()->clearMessage();
@@ -435,38 +1473,162 @@ void MainWindow::openDirectory()
     currentTreeDir->setExpanded(true);
     currentTreeDir->setText(0, curr_open_dir);
 
-    QDir current_dir(curr_open_dir);
-    QStringList files = current_dir.entryList();
-    static QStringList ext_img = {"png", "jpg", "bmp", "pgm", "jpeg", "jpe", "jp2", "pbm", "ppm", "tiff", "tif"};
-    for (int i = 0; i < files.size(); i++)
+    const QStringList images = listImageFiles(curr_open_dir);
+    for (const QString& file : images)
+    {
+        auto currentFile = new QTreeWidgetItem(currentTreeDir);
+        currentFile->setText(0, file);
+    }
+    directoryWatcher.addRoot(curr_open_dir, images);
+
+    if (!datasetIndexes.contains(curr_open_dir))
+    {
+        // Only the masks changed since the last session are read again
+        auto index = new DatasetIndex(curr_open_dir);
+        datasetIndexes.insert(curr_open_dir, index);
+        index->load();
+        indexingJobs.append(JobScheduler::instance().run(JobClass::Background, [this, index]()-> void
+        {
+            index->rescan(indexingToken.flag());
+            index->save();
+        }));
+    }
+}
+
+void MainWindow::updateDirectoryTree(const QString& directory, const QStringList& added, const QStringList& removed)
+{
+    const QSet<QString> gone(removed.begin(), removed.end());
+    for (int i = 0; i < ui->tree_widget_img->topLevelItemCount(); i++)
     {
-        if (files[i].size() < 4)
+        QTreeWidgetItem* root = ui->tree_widget_img->topLevelItem(i);
+        if (QDir(root->text(0)).absolutePath() != directory)
         {
             continue;
         }
-        QString ext = files[i].section(".", -1, -1);
-        bool is_image = false;
-        for (int e = 0; e < ext_img.size(); e++)
+        for (int child = root->childCount() - 1; child >= 0 && !gone.isEmpty(); child--)
         {
-            if (ext.toLower() == ext_img[e])
+            if (gone.contains(root->child(child)->text(0)))
             {
-                is_image = true;
-                break;
+                delete root->takeChild(child);
             }
         }
-        if (!is_image)
+        // Children stay sorted by name as listImageFiles returns them, new frames go where a listing puts them
+        int position = 0;
+        for (const QString& file : added)
         {
-            continue;
+            while (position < root->childCount() && QString::compare(root->child(position)->text(0), file) < 0)
+            {
+                position++;
+            }
+            auto item = new QTreeWidgetItem();
+            item->setText(0, file);
+            root->insertChild(position, item);
         }
-        if (files[i].toLower().indexOf("_mask.png") > -1)
+    }
+    statusBar()->showMessage(tr("%1: %2 new images, %3 removed").arg(QDir(directory).dirName())
+                             .arg(added.size()).arg(removed.size()));
+}
+
+void MainWindow::checkExternalMasks(const QStringList& files)
+{
+    const QSet<QString> changed(files.begin(), files.end());
+    for (int i = 0; i < ui->tabWidget->count(); i++)
+    {
+        ImageCanvas* ic = getCanvasByIndex(i);
+        if (ic && (changed.contains(ic->maskFilePath())
+                   || changed.contains(QFileInfo(ic->maskFilePath()).absolutePath())))
+        {
+            updateExternalMaskFlag(ic);
+        }
+    }
+    updateWatchedMasks();
+}
+
+void MainWindow::updateWatchedMasks()
+{
+    QStringList masks;
+    for (int i = 0; i < ui->tabWidget->count(); i++)
+    {
+        if (const ImageCanvas* ic = getCanvasByIndex(i))
+        {
+            masks.append(ic->maskFilePath());
+        }
+    }
+    directoryWatcher.setWatchedFiles(masks);
+}
+
+void MainWindow::updateExternalMaskFlag(ImageCanvas* ic)
+{
+    for (int i = 0; i < ui->tabWidget->count(); i++)
+    {
+        if (getCanvasByIndex(i) != ic)
         {
             continue;
         }
-        auto currentFile = new QTreeWidgetItem(currentTreeDir);
-        currentFile->setText(0, files[i]);
+        if (ic->isMaskModifiedExternally())
+        {
+            ui->tabWidget->setTabIcon(i, style()->standardIcon(QStyle::SP_MessageBoxWarning));
+            ui->tabWidget->setTabToolTip(
+                i, tr("%1 was modified by another program, saving this tab overwrites it; reopen the image to see it")
+                .arg(QFileInfo(ic->maskFilePath()).fileName()));
+            statusBar()->showMessage(tr("%1 was modified by another program").arg(ic->maskFilePath()));
+        }
+        else
+        {
+            ui->tabWidget->setTabIcon(i, QIcon());
+            ui->tabWidget->setTabToolTip(i, QString());
+        }
+    }
+}
+
+void MainWindow::indexSavedMask(const QString& imageFile, const QImage& ids)
+{
+    const QString root = QFileInfo(imageFile).absolutePath();
+    for (DatasetIndex* index : datasetIndexes)
+    {
+        if (QFileInfo(index->root()).absoluteFilePath() == root)
+        {
+            index->update(imageFile, ids);
+            indexSaveTimer.start();
+        }
+    }
+}
+
+void MainWindow::saveDatasetIndexes()
+{
+    for (DatasetIndex* index : datasetIndexes)
+    {
+        if (index->isDirty())
+        {
+            index->save();
+        }
     }
 }
 
+void MainWindow::showDatasetStatistics()
+{
+    QString report;
+    for (DatasetIndex* index : datasetIndexes)
+    {
+        report += index->root() + "\n" + formatIndexReport(index->summary(), id_labels) + "\n";
+    }
+    if (report.isEmpty())
+    {
+        report = tr("No opened directory");
+    }
+
+    auto dialog = new QDialog(this);
+    dialog->setWindowTitle(tr("Dataset statistics"));
+    dialog->setAttribute(Qt::WA_DeleteOnClose);
+    auto layout = new QVBoxLayout(dialog);
+    auto text = new QPlainTextEdit(report, dialog);
+    text->setReadOnly(true);
+    text->setFont(QFontDatabase::systemFont(QFontDatabase::FixedFont));
+    layout->addWidget(text);
+    dialog->resize(600, 500);
+    dialog->show();
+}
+
 void MainWindow::nextFile()
 {
     QTreeWidgetItem* currentItem = ui->tree_widget_img->currentItem();
@@ -501,29 +1663,119 @@ void MainWindow::saveConfigFile()
     QJsonDocument saveDoc(object);
     save_file.write(saveDoc.toJson());
     save_file.close();
+    config_file = file;
 }
 
 void MainWindow::loadConfigFile()
 {
     QString file = QFileDialog::getOpenFileName(this, tr("Open Config File"), QString(), tr("JSon file (*.json)"));
-    QFile open_file(file);
-    if (!open_file.open(QIODevice::ReadOnly))
+    if (!readLabelsFile(file, &labels))
     {
         qWarning("Couldn't open save file.");
         return;
     }
-    QJsonObject object;
-    QByteArray saveData = open_file.readAll();
-    QJsonDocument loadDoc(QJsonDocument::fromJson(saveData));
-
-    labels.clear();
-    labels.read(loadDoc.object());
-    open_file.close();
+    config_file = file;
 
     loadConfigLabels();
     update();
 }
 
+void MainWindow::recordInput(bool checked)
+{
+    if (!checked)
+    {
+        inputRecorder.stop();
+        statusBar()->showMessage(tr("Input recording stopped"));
+        return;
+    }
+
+    QString file = QFileDialog::getSaveFileName(this, tr("Record Input Session"), QString(),
+                                                tr("Input session (*.patrec)"));
+    InputSessionSettings settings;
+    settings.penSize = ui->spinbox_pen_size->value();
+    settings.scale = ui->spinbox_scale->value();
+    settings.alpha = ui->spinbox_alpha->value();
+    settings.engine = ui->combo_engine->currentText();
+    settings.edgeSnapping = edge_snapping_action->isChecked();
+    if (file.isEmpty() || !inputRecorder.start(file, settings))
+    {
+        record_input_action->setChecked(false);
+        return;
+    }
+    if (imageCanvas_)
+    {
+        inputRecorder.recordImage(imageCanvas_->imageFilePath());
+        const QModelIndex current = ui->list_label->currentIndex();
+        if (current.isValid())
+        {
+            inputRecorder.recordLabel(current.data(LabelListModel::IdRole).toInt());
+        }
+    }
+    statusBar()->showMessage(tr("Recording input to %1").arg(file));
+}
+
+void MainWindow::showDisagreement(bool checked)
+{
+    ImageCanvas* ic = getCurrentImageCanvas();
+    if (!ic || !ic->isLoaded() || !checked)
+    {
+        if (ic)
+        {
+            ic->setOverlay(QImage());
+        }
+        QSignalBlocker blocker(disagreement_action);
+        disagreement_action->setChecked(false);
+        return;
+    }
+
+    QStringList directories;
+    while (true)
+    {
+        QString directory = QFileDialog::getExistingDirectory(
+            this, tr("Annotator directory %1 (cancel when done)").arg(directories.size() + 1), curr_open_dir);
+        if (directory.isEmpty())
+        {
+            break;
+        }
+        directories.append(directory);
+    }
+
+    const QString name = QFileInfo(ic->imageFilePath()).fileName();
+    QVector<QImage> masks;
+    for (const QString& directory : directories)
+    {
+        QImage ids = readAnnotationLabels(directory + "/" + name);
+        if (ids.size() == ic->getImage().size())
+        {
+            masks.append(ids);
+        }
+        else
+        {
+            qWarning() << "No usable annotation of" << name << "in" << directory;
+        }
+    }
+    if (masks.size() < 2)
+    {
+        statusBar()->showMessage(tr("The disagreement view needs the annotations of at least two annotators"));
+        QSignalBlocker blocker(disagreement_action);
+        disagreement_action->setChecked(false);
+        return;
+    }
+
+    const ConsensusResult consensus = computeConsensus(masks);
+    ic->setOverlay(disagreementHeatMap(consensus.disagreement));
+    quint64 unanimous = 0;
+    quint64 any = 0;
+    for (const LabelAgreement& agreement : consensus.agreement)
+    {
+        unanimous += agreement.unanimous;
+        any += agreement.any;
+    }
+    statusBar()->showMessage(QString("%1 annotators, agreement %2%")
+                             .arg(masks.size())
+                             .arg(100. * unanimous / std::max<quint64>(1, any), 0, 'f', 1));
+}
+
 void MainWindow::on_actionAbout_triggered()
 {
     AboutDialog* d = new AboutDialog(this);
@@ -533,7 +1785,8 @@ void MainWindow::on_actionAbout_triggered()
 
 void MainWindow::copyMask()
 {
-    if (ImageCanvas* ic = getCurrentImageCanvas())
+    ImageCanvas* ic = getCurrentImageCanvas();
+    if (ic && ic->isLoaded())
     {
         copiedMask = ic->getMask();
     }
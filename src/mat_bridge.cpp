@@ -0,0 +1,77 @@
+#include "mat_bridge.h"
+
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+static int matType(QImage::Format format)
+{
+    switch (format)
+    {
+    case QImage::Format_Grayscale8:
+        return CV_8UC1;
+    case QImage::Format_Grayscale16:
+        return CV_16UC1;
+    case QImage::Format_RGB888:
+        return CV_8UC3;
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+        return CV_8UC4;
+    default:
+        return -1;
+    }
+}
+
+static QImage::Format imageFormat(int type)
+{
+    switch (type)
+    {
+    case CV_8UC1:
+        return QImage::Format_Grayscale8;
+    case CV_16UC1:
+        return QImage::Format_Grayscale16;
+    case CV_8UC3:
+        return QImage::Format_RGB888;
+    case CV_8UC4:
+        return QImage::Format_ARGB32;
+    default:
+        return QImage::Format_Invalid;
+    }
+}
+
+cv::Mat matView(const QImage& image)
+{
+    const int type = matType(image.format());
+    CV_Assert(type >= 0);
+    return cv::Mat(image.height(), image.width(), type, const_cast<uchar*>(image.constBits()), image.bytesPerLine());
+}
+
+cv::Mat mutableMatView(QImage& image)
+{
+    const int type = matType(image.format());
+    CV_Assert(type >= 0);
+    return cv::Mat(image.height(), image.width(), type, image.bits(), image.bytesPerLine());
+}
+
+QImage qImageView(const cv::Mat& mat)
+{
+    const QImage::Format format = imageFormat(mat.type());
+    CV_Assert(format != QImage::Format_Invalid && mat.dims == 2);
+    auto* owner = new cv::Mat(mat);
+    return QImage(owner->data, owner->cols, owner->rows, static_cast<qsizetype>(owner->step), format,
+                  [](void* info)-> void
+                  {
+                      delete static_cast<cv::Mat*>(info);
+                  }, owner);
+}
+
+QImage readRgbImage(const QString& file)
+{
+    cv::Mat image = cv::imread(file.toStdString(), cv::IMREAD_COLOR);
+    if (image.empty())
+    {
+        return QImage();
+    }
+    cv::cvtColor(image, image, cv::COLOR_BGR2RGB);
+    return qImageView(image);
+}
@@ -0,0 +1,105 @@
+#include "memory_usage.h"
+
+#include <algorithm>
+
+QString memoryCategoryName(MemoryCategory category)
+{
+    switch (category)
+    {
+    case MemoryCategory::Image:
+        return "Image";
+    case MemoryCategory::Pixmap:
+        return "Pixmap";
+    case MemoryCategory::Mask:
+        return "Mask";
+    case MemoryCategory::Watershed:
+        return "Watershed";
+    case MemoryCategory::Undo:
+        return "Undo";
+    case MemoryCategory::Cache:
+        return "Caches";
+    case MemoryCategory::Clipboard:
+        return "Clipboard";
+    case MemoryCategory::Pool:
+        return "Buffer pool";
+    default:
+        return QString();
+    }
+}
+
+MemoryUsage::MemoryUsage()
+{
+    std::fill(std::begin(_bytes), std::end(_bytes), 0);
+}
+
+void MemoryUsage::add(MemoryCategory category, const QImage& image)
+{
+    if (image.isNull() || holds(image))
+    {
+        return;
+    }
+    _images.insert(image.cacheKey());
+    _bytes[static_cast<int>(category)] += image.sizeInBytes();
+}
+
+void MemoryUsage::add(MemoryCategory category, const QPixmap& pixmap)
+{
+    if (pixmap.isNull() || _images.contains(pixmap.cacheKey()))
+    {
+        return;
+    }
+    _images.insert(pixmap.cacheKey());
+    _bytes[static_cast<int>(category)] += qint64(pixmap.width()) * pixmap.height() * pixmap.depth() / 8;
+}
+
+void MemoryUsage::add(MemoryCategory category, const cv::Mat& mat)
+{
+    if (mat.empty() || _mats.contains(mat.datastart))
+    {
+        return;
+    }
+    _mats.insert(mat.datastart);
+    _bytes[static_cast<int>(category)] += mat.dataend - mat.datastart;
+}
+
+void MemoryUsage::addBytes(MemoryCategory category, qint64 bytes)
+{
+    _bytes[static_cast<int>(category)] += bytes;
+}
+
+bool MemoryUsage::holds(const QImage& image) const
+{
+    return _images.contains(image.cacheKey());
+}
+
+qint64 MemoryUsage::total() const
+{
+    qint64 total = 0;
+    for (qint64 bytes : _bytes)
+    {
+        total += bytes;
+    }
+    return total;
+}
+
+MemoryUsage& MemoryUsage::operator+=(const MemoryUsage& other)
+{
+    for (int i = 0; i < static_cast<int>(MemoryCategory::Count); i++)
+    {
+        _bytes[i] += other._bytes[i];
+    }
+    _images.unite(other._images);
+    _mats.unite(other._mats);
+    return *this;
+}
+
+qint64 estimatedTabBytes(const QSize& imageSize)
+{
+    // RGB888 display, then Grayscale16 ids and RGB888 colors for the mask, the watershed and an undo state
+    return qint64(imageSize.width()) * imageSize.height() * (3 + 3 * (2 + 3));
+}
+
+QString formatMegabytes(qint64 bytes)
+{
+    return QString("%1 MB").arg(bytes / (1024. * 1024.), 0, 'f', 1);
+}
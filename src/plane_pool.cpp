@@ -0,0 +1,224 @@
+#include "plane_pool.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Below this, the heap is as fast and doesn't fragment the address space much
+static const qsizetype MIN_POOLED_BYTES = 256 * 1024;
+
+// Buffer of an image handed out by the pool
+struct PooledBuffer
+{
+    PlanePool* pool;
+    uchar* data;
+    qsizetype capacity;
+};
+
+class PooledMatAllocator : public cv::MatAllocator
+{
+public:
+    explicit PooledMatAllocator(PlanePool* pool) : _pool(pool)
+    {}
+
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data0, size_t* step, cv::AccessFlag,
+                           cv::UMatUsageFlags) const override
+    {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; i--)
+        {
+            if (step)
+            {
+                if (data0 && step[i] != CV_AUTOSTEP)
+                {
+                    total = step[i];
+                }
+                else
+                {
+                    step[i] = total;
+                }
+            }
+            total *= sizes[i];
+        }
+        auto u = new cv::UMatData(this);
+        if (data0)
+        {
+            u->data = u->origdata = static_cast<uchar*>(data0);
+            u->flags |= cv::UMatData::USER_ALLOCATED;
+        }
+        else
+        {
+            qsizetype capacity = 0;
+            u->data = u->origdata = _pool->_take(static_cast<qsizetype>(total), &capacity);
+        }
+        u->size = total;
+        return u;
+    }
+
+    bool allocate(cv::UMatData* u, cv::AccessFlag, cv::UMatUsageFlags) const override
+    {
+        return u != Q_NULLPTR;
+    }
+
+    void deallocate(cv::UMatData* u) const override
+    {
+        if (!u)
+        {
+            return;
+        }
+        CV_Assert(u->urefcount == 0 && u->refcount == 0);
+        if (!(u->flags & cv::UMatData::USER_ALLOCATED))
+        {
+            // The bucket follows from the size asked for
+            _pool->_give(u->origdata, PlanePool::_bucket(static_cast<qsizetype>(u->size)));
+        }
+        delete u;
+    }
+
+private:
+    PlanePool* _pool;
+};
+
+PlanePool& PlanePool::instance()
+{
+    // Never destroyed: static images and matrices may still give their buffers back while the program exits
+    static auto pool = new PlanePool();
+    return *pool;
+}
+
+PlanePool::PlanePool(qint64 budgetBytes) : _freeBytes(0), _budget(budgetBytes)
+{
+    _matAllocator = new PooledMatAllocator(this);
+}
+
+PlanePool::~PlanePool()
+{
+    trim();
+    delete _matAllocator;
+}
+
+qsizetype PlanePool::_bucket(qsizetype bytes)
+{
+    if (bytes < MIN_POOLED_BYTES)
+    {
+        return bytes;
+    }
+    // Eight buckets per power of two, at most 12.5% of a buffer unused
+    qsizetype power = 1;
+    while (power * 2 <= bytes)
+    {
+        power *= 2;
+    }
+    const qsizetype step = power / 8;
+    return (bytes + step - 1) / step * step;
+}
+
+uchar* PlanePool::_take(qsizetype bytes, qsizetype* capacity)
+{
+    *capacity = _bucket(bytes);
+    if (*capacity >= MIN_POOLED_BYTES)
+    {
+        QMutexLocker locker(&_mutex);
+        auto it = _free.find(*capacity);
+        if (it != _free.end() && !it->isEmpty())
+        {
+            uchar* data = it->takeLast();
+            _returned.removeAt(_returned.lastIndexOf(*capacity));
+            _freeBytes -= *capacity;
+            return data;
+        }
+    }
+    return static_cast<uchar*>(cv::fastMalloc(static_cast<size_t>(*capacity)));
+}
+
+void PlanePool::_give(uchar* data, qsizetype capacity)
+{
+    if (capacity < MIN_POOLED_BYTES)
+    {
+        cv::fastFree(data);
+        return;
+    }
+    QVector<uchar*> evicted;
+    {
+        QMutexLocker locker(&_mutex);
+        _free[capacity].append(data);
+        _returned.append(capacity);
+        _freeBytes += capacity;
+        while (_freeBytes > _budget && !_returned.isEmpty())
+        {
+            const qsizetype oldest = _returned.takeFirst();
+            evicted.append(_free[oldest].takeFirst());
+            _freeBytes -= oldest;
+        }
+    }
+    for (uchar* buffer : evicted)
+    {
+        cv::fastFree(buffer);
+    }
+}
+
+QImage PlanePool::image(const QSize& size, QImage::Format format)
+{
+    // 32-bit aligned lines, as QImage allocates them itself
+    const int depth = QImage::toPixelFormat(format).bitsPerPixel();
+    const qsizetype bytesPerLine = (qsizetype(size.width()) * depth + 31) / 32 * 4;
+    auto buffer = new PooledBuffer{this, Q_NULLPTR, 0};
+    buffer->data = _take(std::max<qsizetype>(bytesPerLine * size.height(), 1), &buffer->capacity);
+    return QImage(buffer->data, size.width(), size.height(), bytesPerLine, format, [](void* info)-> void
+    {
+        auto buffer = static_cast<PooledBuffer*>(info);
+        buffer->pool->_give(buffer->data, buffer->capacity);
+        delete buffer;
+    }, buffer);
+}
+
+QImage PlanePool::copy(const QImage& image)
+{
+    if (image.isNull())
+    {
+        return QImage();
+    }
+    QImage result = this->image(image.size(), image.format());
+    const qsizetype lineSize = std::min(image.bytesPerLine(), result.bytesPerLine());
+    for (int y = 0; y < image.height(); y++)
+    {
+        memcpy(result.scanLine(y), image.constScanLine(y), lineSize);
+    }
+    return result;
+}
+
+cv::Mat PlanePool::mat(int rows, int cols, int type)
+{
+    cv::Mat mat;
+    mat.allocator = _matAllocator;
+    mat.create(rows, cols, type);
+    return mat;
+}
+
+cv::MatAllocator* PlanePool::matAllocator()
+{
+    return _matAllocator;
+}
+
+qint64 PlanePool::freeBytes() const
+{
+    QMutexLocker locker(&_mutex);
+    return _freeBytes;
+}
+
+void PlanePool::trim()
+{
+    QMap<qsizetype, QVector<uchar*>> freed;
+    {
+        QMutexLocker locker(&_mutex);
+        freed.swap(_free);
+        _returned.clear();
+        _freeBytes = 0;
+    }
+    for (const QVector<uchar*>& buffers : freed)
+    {
+        for (uchar* buffer : buffers)
+        {
+            cv::fastFree(buffer);
+        }
+    }
+}
@@ -0,0 +1,579 @@
+#include "segmentation_engine.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <limits>
+
+static bool isCanceled(const std::atomic<bool>* cancel)
+{
+    return cancel && *cancel;
+}
+
+// Distinct non-zero ids of a marker plane
+static QVector<quint16> markerLabels(const QImage& markers)
+{
+    std::vector<bool> seen(WATERSHED_BORDER_ID + 1, false);
+    QVector<quint16> labels;
+    for (int y = 0; y < markers.height(); y++)
+    {
+        const auto* line = reinterpret_cast<const quint16*>(markers.constScanLine(y));
+        for (int x = 0; x < markers.width(); x++)
+        {
+            if (line[x] && !seen[line[x]])
+            {
+                seen[line[x]] = true;
+                labels.append(line[x]);
+            }
+        }
+    }
+    return labels;
+}
+
+// First three bands of a native image stretched to 8 bits, fewer bands are repeated
+static cv::Mat stretchedRgb(const cv::Mat& native)
+{
+    std::vector<cv::Mat> bands;
+    cv::split(native, bands);
+    const cv::Mat last = bands.back();
+    bands.resize(3, last);
+    for (cv::Mat& band : bands)
+    {
+        cv::normalize(band, band, 0, 255, cv::NORM_MINMAX, CV_8U);
+    }
+    cv::Mat rgb;
+    cv::merge(bands, rgb);
+    return rgb;
+}
+
+QImage SegmentationEngine::segmentNative(const cv::Mat& native, const QImage& markers,
+                                         const std::atomic<bool>* cancel,
+                                         const std::function<void(double)>& progress) const
+{
+    return segment(qImageView(stretchedRgb(native)), markers, cancel, progress);
+}
+
+// Gradient magnitude summed over the bands, each band normalized to its own range first, quantized to 16 bits
+static cv::Mat nativeGradient(const cv::Mat& native)
+{
+    std::vector<cv::Mat> bands;
+    cv::split(native, bands);
+    cv::Mat magnitude = cv::Mat::zeros(native.size(), CV_32FC1);
+    cv::Mat band;
+    cv::Mat dx;
+    cv::Mat dy;
+    for (const cv::Mat& raw : bands)
+    {
+        double low = 0;
+        double high = 0;
+        cv::minMaxLoc(raw, &low, &high);
+        const double scale = 1. / std::max(high - low, 1.);
+        raw.convertTo(band, CV_32F, scale, -low * scale);
+        cv::Sobel(band, dx, CV_32F, 1, 0);
+        cv::Sobel(band, dy, CV_32F, 0, 1);
+        magnitude += dx.mul(dx) + dy.mul(dy);
+    }
+    cv::sqrt(magnitude, magnitude);
+    cv::Mat levels;
+    cv::normalize(magnitude, levels, 0, 65535, cv::NORM_MINMAX, CV_16U);
+    return levels;
+}
+
+// Marker flooding in the manner of cv::watershed on a 16-bit relief, with a bucket per level.
+// Pixels where two labels meet get -1.
+static cv::Mat floodLevels(const cv::Mat& levels, const cv::Mat& markers, const std::atomic<bool>* cancel,
+                           const std::function<void(double)>& progress)
+{
+    const int rows = levels.rows;
+    const int cols = levels.cols;
+    cv::Mat labels;
+    markers.convertTo(labels, CV_32S);
+    int* label = labels.ptr<int>();
+    const auto* level = levels.ptr<quint16>();
+    std::vector<uchar> queued(static_cast<size_t>(rows) * cols, 0);
+    std::vector<std::vector<int>> buckets(65536);
+
+    auto neighbors = [rows, cols](int index, int* out)-> int
+    {
+        const int y = index / cols;
+        const int x = index % cols;
+        int count = 0;
+        if (x > 0) out[count++] = index - 1;
+        if (x + 1 < cols) out[count++] = index + 1;
+        if (y > 0) out[count++] = index - cols;
+        if (y + 1 < rows) out[count++] = index + cols;
+        return count;
+    };
+
+    int around[4];
+    for (int index = 0; index < rows * cols; index++)
+    {
+        if (label[index] > 0)
+        {
+            continue;
+        }
+        const int count = neighbors(index, around);
+        for (int i = 0; i < count; i++)
+        {
+            if (label[around[i]] > 0)
+            {
+                queued[index] = 1;
+                buckets[level[index]].push_back(index);
+                break;
+            }
+        }
+    }
+
+    for (int current = 0; current < 65536; current++)
+    {
+        // The bucket grows while it is emptied, pixels reached from here can't be flooded below this level
+        std::vector<int>& bucket = buckets[current];
+        for (size_t k = 0; k < bucket.size(); k++)
+        {
+            if ((k & 0xFFFF) == 0 && cancel && *cancel)
+            {
+                return cv::Mat();
+            }
+            const int index = bucket[k];
+            const int count = neighbors(index, around);
+            int found = 0;
+            bool boundary = false;
+            for (int i = 0; i < count; i++)
+            {
+                const int neighbor = label[around[i]];
+                if (neighbor > 0)
+                {
+                    boundary = boundary || (found && neighbor != found);
+                    found = found ? found : neighbor;
+                }
+            }
+            label[index] = boundary ? -1 : found;
+            if (boundary)
+            {
+                continue;
+            }
+            for (int i = 0; i < count; i++)
+            {
+                if (label[around[i]] == 0 && !queued[around[i]])
+                {
+                    queued[around[i]] = 1;
+                    buckets[std::max<int>(level[around[i]], current)].push_back(around[i]);
+                }
+            }
+        }
+        std::vector<int>().swap(bucket);
+        if (progress && current % 4096 == 4095)
+        {
+            progress((current + 1) / 65536.);
+        }
+    }
+    return labels;
+}
+
+QImage WatershedEngine::segment(const QImage& image, const QImage& markers, const std::atomic<bool>* cancel,
+                                const std::function<void(double)>& progress) const
+{
+    if (isCanceled(cancel))
+    {
+        return QImage();
+    }
+    QImage result = watershed(image, markers);
+    if (progress)
+    {
+        progress(1.);
+    }
+    return result;
+}
+
+QImage WatershedEngine::segmentNative(const cv::Mat& native, const QImage& markers, const std::atomic<bool>* cancel,
+                                      const std::function<void(double)>& progress) const
+{
+    const cv::Mat labels = floodLevels(nativeGradient(native), matView(markers), cancel, progress);
+    return labels.empty() ? QImage() : qImageView(convertMat32StoId16(labels));
+}
+
+QImage GrabCutEngine::segment(const QImage& image, const QImage& markers, const std::atomic<bool>* cancel,
+                              const std::function<void(double)>& progress) const
+{
+    const QVector<quint16> labels = markerLabels(markers);
+    if (labels.size() < 2)
+    {
+        // GrabCut needs background samples, a single label floods the image anyway
+        return WatershedEngine().segment(image, markers, cancel, progress);
+    }
+
+    const cv::Mat rgb = matView(image);
+    const cv::Mat ids = matView(markers);
+    // Label claiming each pixel, 0 when none did, WATERSHED_BORDER_ID when several did
+    cv::Mat claims = cv::Mat::zeros(ids.size(), CV_16UC1);
+    cv::Mat background;
+    cv::Mat foreground;
+    for (int i = 0; i < labels.size(); i++)
+    {
+        if (isCanceled(cancel))
+        {
+            return QImage();
+        }
+        cv::Mat mask(ids.size(), CV_8UC1, cv::Scalar(cv::GC_PR_BGD));
+        mask.setTo(cv::GC_BGD, ids != 0);
+        mask.setTo(cv::GC_FGD, ids == labels[i]);
+        cv::grabCut(rgb, mask, cv::Rect(), background, foreground, _iterations, cv::GC_INIT_WITH_MASK);
+
+        const cv::Mat claimed = (mask & 1) != 0;
+        claims.setTo(WATERSHED_BORDER_ID, claimed & (claims != 0));
+        claims.setTo(labels[i], claimed & (claims == 0));
+        if (progress)
+        {
+            progress(double(i + 1) / (labels.size() + 1));
+        }
+    }
+    claims.setTo(0, claims == WATERSHED_BORDER_ID);
+    // Strokes always win over the models
+    ids.copyTo(claims, ids != 0);
+
+    if (isCanceled(cancel))
+    {
+        return QImage();
+    }
+    return WatershedEngine().segment(image, qImageView(claims), Q_NULLPTR, progress);
+}
+
+namespace
+{
+    // 4-connected pixel graph, right(y, x) weighs the edge to (y, x + 1) and down(y, x) the one to (y + 1, x)
+    struct PixelGraph
+    {
+        cv::Mat right;
+        cv::Mat down;
+        cv::Mat degree;
+        // Non-zero on the pixels without a marker
+        cv::Mat unknown;
+    };
+}
+
+static PixelGraph buildGraph(const QImage& image, const QImage& markers, double beta)
+{
+    cv::Mat pixels;
+    matView(image).convertTo(pixels, CV_32FC3, 1. / 255);
+    const int rows = pixels.rows;
+    const int cols = pixels.cols;
+
+    PixelGraph graph;
+    graph.right = cv::Mat::zeros(rows, cols, CV_32FC1);
+    graph.down = cv::Mat::zeros(rows, cols, CV_32FC1);
+    cv::Mat diff;
+    cv::Mat squared;
+    if (cols > 1)
+    {
+        cv::subtract(pixels.colRange(1, cols), pixels.colRange(0, cols - 1), diff);
+        cv::transform(diff.mul(diff), squared, cv::Matx13f(1, 1, 1));
+        squared.copyTo(graph.right.colRange(0, cols - 1));
+    }
+    if (rows > 1)
+    {
+        cv::subtract(pixels.rowRange(1, rows), pixels.rowRange(0, rows - 1), diff);
+        cv::transform(diff.mul(diff), squared, cv::Matx13f(1, 1, 1));
+        squared.copyTo(graph.down.rowRange(0, rows - 1));
+    }
+
+    // Gradients normalized by the strongest one, then w = exp(-beta * g), kept above 0 so the graph stays connected
+    double maxRight = 0;
+    double maxDown = 0;
+    cv::minMaxLoc(graph.right, Q_NULLPTR, &maxRight);
+    cv::minMaxLoc(graph.down, Q_NULLPTR, &maxDown);
+    const double scale = -beta / std::max({maxRight, maxDown, 1e-10});
+    for (cv::Mat* weights : {&graph.right, &graph.down})
+    {
+        cv::exp(*weights * scale, *weights);
+        *weights += 1e-6;
+    }
+    if (cols > 1)
+    {
+        graph.right.col(cols - 1).setTo(0);
+    }
+    if (rows > 1)
+    {
+        graph.down.row(rows - 1).setTo(0);
+    }
+
+    graph.degree = graph.right + graph.down;
+    if (cols > 1)
+    {
+        graph.degree.colRange(1, cols) += graph.right.colRange(0, cols - 1);
+    }
+    if (rows > 1)
+    {
+        graph.degree.rowRange(1, rows) += graph.down.rowRange(0, rows - 1);
+    }
+    // Marked pixels are never divided by, only kept from being 0
+    graph.degree.setTo(1, graph.degree == 0);
+    graph.unknown = matView(markers) == 0;
+    return graph;
+}
+
+// result = L p on the unknown pixels, 0 on the marked ones
+static void applyLaplacian(const PixelGraph& graph, const cv::Mat& p, cv::Mat& result)
+{
+    const int rows = p.rows;
+    const int cols = p.cols;
+    result.create(p.size(), CV_32FC1);
+    cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& range)-> void
+    {
+        for (int y = range.start; y < range.end; y++)
+        {
+            const float* line = p.ptr<float>(y);
+            const float* up = y > 0 ? p.ptr<float>(y - 1) : Q_NULLPTR;
+            const float* below = y + 1 < rows ? p.ptr<float>(y + 1) : Q_NULLPTR;
+            const float* right = graph.right.ptr<float>(y);
+            const float* down = graph.down.ptr<float>(y);
+            const float* downAbove = y > 0 ? graph.down.ptr<float>(y - 1) : Q_NULLPTR;
+            const float* degree = graph.degree.ptr<float>(y);
+            const uchar* unknown = graph.unknown.ptr<uchar>(y);
+            float* out = result.ptr<float>(y);
+            for (int x = 0; x < cols; x++)
+            {
+                if (!unknown[x])
+                {
+                    out[x] = 0;
+                    continue;
+                }
+                float neighbors = 0;
+                if (x + 1 < cols)
+                {
+                    neighbors += right[x] * line[x + 1];
+                }
+                if (x > 0)
+                {
+                    neighbors += right[x - 1] * line[x - 1];
+                }
+                if (below)
+                {
+                    neighbors += down[x] * below[x];
+                }
+                if (up)
+                {
+                    neighbors += downAbove[x] * up[x];
+                }
+                out[x] = degree[x] * line[x] - neighbors;
+            }
+        }
+    }, cv::getNumThreads());
+}
+
+QImage RandomWalkerEngine::segment(const QImage& image, const QImage& markers, const std::atomic<bool>* cancel,
+                                   const std::function<void(double)>& progress) const
+{
+    const QVector<quint16> labels = markerLabels(markers);
+    const QImage initial = WatershedEngine().segment(image, markers, cancel);
+    if (labels.size() < 2 || initial.isNull())
+    {
+        if (progress && !initial.isNull())
+        {
+            progress(1.);
+        }
+        return initial;
+    }
+
+    const PixelGraph graph = buildGraph(image, markers, _beta);
+    const cv::Mat ids = matView(markers);
+    const cv::Mat start = matView(initial);
+    cv::Mat best(ids.size(), CV_32FC1, cv::Scalar(std::numeric_limits<float>::lowest()));
+    cv::Mat result = ids.clone();
+    cv::Mat x, r, z, p, ap, b;
+    for (int i = 0; i < labels.size(); i++)
+    {
+        // Unknown probabilities start from the watershed, marked pixels are folded into the right-hand side
+        cv::Mat seeds;
+        cv::Mat(ids == labels[i]).convertTo(seeds, CV_32FC1, 1. / 255);
+        applyLaplacian(graph, seeds, b);
+        b = -b;
+        cv::Mat(start == labels[i]).convertTo(x, CV_32FC1, 1. / 255);
+        x.setTo(0, graph.unknown == 0);
+
+        applyLaplacian(graph, x, ap);
+        cv::subtract(b, ap, r);
+        cv::divide(r, graph.degree, z);
+        p = z.clone();
+        double rz = r.dot(z);
+        const double bNorm = std::max(cv::norm(b), 1e-10);
+        for (int iteration = 0; iteration < _maxIterations && cv::norm(r) > _tolerance * bNorm; iteration++)
+        {
+            if (isCanceled(cancel))
+            {
+                return QImage();
+            }
+            applyLaplacian(graph, p, ap);
+            const double pap = p.dot(ap);
+            if (pap <= 0)
+            {
+                break;
+            }
+            const double alpha = rz / pap;
+            cv::scaleAdd(p, alpha, x, x);
+            cv::scaleAdd(ap, -alpha, r, r);
+            cv::divide(r, graph.degree, z);
+            const double rzNext = r.dot(z);
+            cv::scaleAdd(p, rzNext / rz, z, p);
+            rz = rzNext;
+            if (progress && iteration % 16 == 0)
+            {
+                progress((i + double(iteration) / _maxIterations) / labels.size());
+            }
+        }
+
+        const cv::Mat wins = (x > best) & graph.unknown;
+        x.copyTo(best, wins);
+        result.setTo(labels[i], wins);
+        if (progress)
+        {
+            progress(double(i + 1) / labels.size());
+        }
+    }
+    return qImageView(result);
+}
+
+// Reduces a marker plane by blocks, a cell keeps a stroke of its block if there is one so thin strokes survive
+static cv::Mat reduceMarkers(const cv::Mat& markers, cv::Size size)
+{
+    cv::Mat reduced(size, CV_32SC1);
+    cv::parallel_for_(cv::Range(0, size.height), [&](const cv::Range& range)-> void
+    {
+        for (int y = range.start; y < range.end; y++)
+        {
+            const int top = static_cast<int>(qint64(y) * markers.rows / size.height);
+            const int bottom = std::max(top + 1, static_cast<int>(qint64(y + 1) * markers.rows / size.height));
+            auto* out = reduced.ptr<int>(y);
+            for (int x = 0; x < size.width; x++)
+            {
+                const int left = static_cast<int>(qint64(x) * markers.cols / size.width);
+                const int right = std::max(left + 1, static_cast<int>(qint64(x + 1) * markers.cols / size.width));
+                int id = 0;
+                for (int yy = top; yy < bottom && !id; yy++)
+                {
+                    const auto* line = markers.ptr<quint16>(yy);
+                    for (int xx = left; xx < right && !id; xx++)
+                    {
+                        id = line[xx];
+                    }
+                }
+                out[x] = id;
+            }
+        }
+    }, cv::getNumThreads());
+    return reduced;
+}
+
+QImage TiledWatershedEngine::segment(const QImage& image, const QImage& markers, const std::atomic<bool>* cancel,
+                                     const std::function<void(double)>& progress) const
+{
+    if (image.width() <= _tileSize && image.height() <= _tileSize)
+    {
+        return WatershedEngine().segment(image, markers, cancel, progress);
+    }
+
+    const cv::Mat rgb = matView(image);
+    const cv::Mat ids = matView(markers);
+
+    // Coarse pass, only the inside of its regions is trusted: pixels whose whole 5x5 neighborhood has their label
+    const double factor = std::min(1., double(_coarseSize) / std::max(rgb.cols, rgb.rows));
+    const cv::Size coarseSize(std::max(1, qRound(rgb.cols * factor)), std::max(1, qRound(rgb.rows * factor)));
+    cv::Mat seeds;
+    {
+        cv::Mat coarseImage;
+        cv::resize(rgb, coarseImage, coarseSize, 0, 0, cv::INTER_AREA);
+        cv::Mat coarseLabels = reduceMarkers(ids, coarseSize);
+        cv::watershed(coarseImage, coarseLabels);
+        coarseLabels.setTo(0, coarseLabels < 0);
+        coarseLabels.convertTo(seeds, CV_16U);
+        cv::Mat highest;
+        cv::Mat lowest;
+        const cv::Mat kernel = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(5, 5));
+        cv::dilate(seeds, highest, kernel);
+        cv::erode(seeds, lowest, kernel);
+        seeds.setTo(0, highest != lowest);
+    }
+    if (isCanceled(cancel))
+    {
+        return QImage();
+    }
+
+    QVector<cv::Rect> tiles;
+    for (int y = 0; y < rgb.rows; y += _tileSize)
+    {
+        for (int x = 0; x < rgb.cols; x += _tileSize)
+        {
+            tiles.append(cv::Rect(x, y, std::min(_tileSize, rgb.cols - x), std::min(_tileSize, rgb.rows - y)));
+        }
+    }
+
+    cv::Mat result(rgb.size(), CV_16UC1);
+    std::atomic<int> done(0);
+    const cv::Rect bounds(0, 0, rgb.cols, rgb.rows);
+    cv::parallel_for_(cv::Range(0, static_cast<int>(tiles.size())), [&](const cv::Range& range)-> void
+    {
+        cv::Mat tileMarkers;
+        for (int i = range.start; i < range.end; i++)
+        {
+            if (isCanceled(cancel))
+            {
+                return;
+            }
+            const cv::Rect core = tiles[i];
+            const cv::Rect extended = cv::Rect(core.x - _overlap, core.y - _overlap, core.width + 2 * _overlap,
+                                               core.height + 2 * _overlap) & bounds;
+
+            // Strokes first, the trusted coarse labels where there is none
+            ids(extended).convertTo(tileMarkers, CV_32S);
+            for (int y = 0; y < extended.height; y++)
+            {
+                auto* line = tileMarkers.ptr<int>(y);
+                const auto* coarse = seeds.ptr<quint16>(
+                    std::min(seeds.rows - 1, static_cast<int>((extended.y + y) * factor)));
+                for (int x = 0; x < extended.width; x++)
+                {
+                    if (!line[x])
+                    {
+                        line[x] = coarse[std::min(seeds.cols - 1, static_cast<int>((extended.x + x) * factor))];
+                    }
+                }
+            }
+            cv::watershed(rgb(extended), tileMarkers);
+
+            const cv::Rect inside(core.x - extended.x, core.y - extended.y, core.width, core.height);
+            convertMat32StoId16(tileMarkers(inside)).copyTo(result(core));
+            if (progress)
+            {
+                progress(double(++done) / tiles.size());
+            }
+        }
+    }, cv::getNumThreads());
+
+    if (isCanceled(cancel))
+    {
+        return QImage();
+    }
+    return qImageView(result);
+}
+
+const QVector<const SegmentationEngine*>& segmentationEngines()
+{
+    static const WatershedEngine watershedEngine;
+    static const GrabCutEngine grabCutEngine;
+    static const RandomWalkerEngine randomWalkerEngine;
+    static const TiledWatershedEngine tiledWatershedEngine;
+    static const QVector<const SegmentationEngine*> engines{
+        &watershedEngine, &grabCutEngine, &randomWalkerEngine, &tiledWatershedEngine
+    };
+    return engines;
+}
+
+const SegmentationEngine* findSegmentationEngine(const QString& name)
+{
+    for (const SegmentationEngine* engine : segmentationEngines())
+    {
+        if (engine->name() == name)
+        {
+            return engine;
+        }
+    }
+    return segmentationEngines().first();
+}
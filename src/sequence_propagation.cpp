@@ -0,0 +1,183 @@
+#include "sequence_propagation.h"
+#include "watershed_cache.h"
+#include "utils.h"
+#include "job_scheduler.h"
+
+#include <QFile>
+#include <opencv2/video/tracking.hpp>
+
+// Motion is estimated on frames of about this size, markers are always warped at full resolution
+static const double MOTION_ESTIMATION_SIZE = 640.;
+
+static cv::Mat grayFrame(const QImage& image, double scale)
+{
+    cv::Mat gray;
+    cv::cvtColor(matView(image), gray, cv::COLOR_RGB2GRAY);
+    if (scale < 1.)
+    {
+        cv::resize(gray, gray, cv::Size(), scale, scale, cv::INTER_AREA);
+    }
+    return gray;
+}
+
+QImage propagateMarkers(const QImage& previousImage, const QImage& previousMarkers, const QImage& nextImage,
+                        MotionModel model)
+{
+    if (previousImage.size() != nextImage.size() || previousMarkers.size() != nextImage.size())
+    {
+        return QImage();
+    }
+
+    const cv::Mat markers = matView(previousMarkers);
+    const double scale = std::min(1., MOTION_ESTIMATION_SIZE / std::max(markers.cols, markers.rows));
+    const cv::Mat previous = grayFrame(previousImage, scale);
+    const cv::Mat next = grayFrame(nextImage, scale);
+    cv::Mat warped;
+    if (model == MotionModel::GlobalShift)
+    {
+        cv::Mat a;
+        cv::Mat b;
+        previous.convertTo(a, CV_32F);
+        next.convertTo(b, CV_32F);
+        cv::Mat window;
+        cv::createHanningWindow(window, a.size(), CV_32F);
+        const cv::Point2d shift = cv::phaseCorrelate(a, b, window) / scale;
+        const cv::Matx23d translation(1, 0, shift.x, 0, 1, shift.y);
+        cv::warpAffine(markers, warped, translation, markers.size(), cv::INTER_NEAREST, cv::BORDER_CONSTANT, 0);
+    }
+    else
+    {
+        // Flow from the next frame back to the previous one, so every pixel of the next frame knows where to read
+        cv::Mat flow;
+        cv::calcOpticalFlowFarneback(next, previous, flow, 0.5, 3, 15, 3, 5, 1.2, 0);
+        cv::resize(flow, flow, markers.size(), 0, 0, cv::INTER_LINEAR);
+        cv::Mat map(markers.size(), CV_32FC2);
+        const float inverseScale = static_cast<float>(1. / scale);
+        cv::parallel_for_(cv::Range(0, map.rows), [&](const cv::Range& range)-> void
+        {
+            for (int y = range.start; y < range.end; y++)
+            {
+                const auto* motion = flow.ptr<cv::Vec2f>(y);
+                auto* source = map.ptr<cv::Vec2f>(y);
+                for (int x = 0; x < map.cols; x++)
+                {
+                    source[x] = cv::Vec2f(x + motion[x][0] * inverseScale, y + motion[x][1] * inverseScale);
+                }
+            }
+        }, cv::getNumThreads());
+        cv::remap(markers, warped, map, cv::noArray(), cv::INTER_NEAREST, cv::BORDER_CONSTANT, 0);
+    }
+    return qImageView(warped);
+}
+
+SequencePrefetcher::SequencePrefetcher(QObject* parent) : QObject(parent), _cancel(false), _hasPending(false)
+{
+    connect(&_watcher, &QFutureWatcher<PropagatedFrame>::finished, this, &SequencePrefetcher::_finished);
+}
+
+SequencePrefetcher::~SequencePrefetcher()
+{
+    cancel();
+    _watcher.waitForFinished();
+}
+
+void SequencePrefetcher::request(const PropagationRequest& request)
+{
+    _pending = request;
+    _hasPending = true;
+    if (_watcher.isRunning())
+    {
+        _cancel = true;
+    }
+    else
+    {
+        _start();
+    }
+}
+
+bool SequencePrefetcher::take(const QString& imageFile, PropagatedFrame* frame)
+{
+    if (_hasPending || _watcher.isRunning() || _result.imageFile != imageFile || _result.markers.isNull())
+    {
+        return false;
+    }
+    *frame = _result;
+    _result = PropagatedFrame();
+    return true;
+}
+
+void SequencePrefetcher::cancel()
+{
+    _hasPending = false;
+    _cancel = true;
+}
+
+PropagatedFrame SequencePrefetcher::propagate(const PropagationRequest& request, const std::atomic<bool>* cancel)
+{
+    PropagatedFrame frame;
+    if (QFile::exists(siblingFile(request.nextFile, "_mask.png")))
+    {
+        return frame;
+    }
+    const QImage next = readRgbImage(request.nextFile);
+    if (next.isNull() || (cancel && *cancel))
+    {
+        return frame;
+    }
+    const QImage markers = propagateMarkers(request.previousImage, request.previousMarkers, next, request.model);
+    if (markers.isNull() || isFullZero(markers))
+    {
+        return frame;
+    }
+    QImage labels = request.engine->segment(next, markers, cancel);
+    if (labels.isNull())
+    {
+        return frame;
+    }
+    if (!request.keepBorder)
+    {
+        labels = removeBorder(labels, request.labels);
+    }
+
+    frame.imageFile = request.nextFile;
+    frame.markers = markers;
+    frame.labels = labels;
+    frame.cacheKey = WatershedCache::key(markers, request.keepBorder, request.engine->name());
+    frame.sourceKey = sourceKey(request.previousMarkers);
+    return frame;
+}
+
+quint64 SequencePrefetcher::sourceKey(const QImage& markers)
+{
+    return WatershedCache::key(markers, false, QString());
+}
+
+void SequencePrefetcher::_start()
+{
+    _hasPending = false;
+    _cancel = false;
+    const PropagationRequest request = _pending;
+    _pending = PropagationRequest();
+    _watcher.setFuture(JobScheduler::instance().run(JobClass::Background, [this, request]()-> PropagatedFrame
+    {
+        return propagate(request, &_cancel);
+    }));
+}
+
+void SequencePrefetcher::_finished()
+{
+    if (_hasPending)
+    {
+        _start();
+        return;
+    }
+    if (_cancel)
+    {
+        return;
+    }
+    _result = _watcher.result();
+    if (!_result.markers.isNull())
+    {
+        emit ready(_result.imageFile);
+    }
+}
@@ -0,0 +1,464 @@
+#include "shard_export.h"
+#include "utils.h"
+#include "job_scheduler.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+#include <cstdio>
+#include <cstring>
+
+static const int MANIFEST_VERSION = 1;
+
+QVector<quint16> identityRemap()
+{
+    QVector<quint16> remap(WATERSHED_BORDER_ID + 1);
+    for (int id = 0; id <= WATERSHED_BORDER_ID; id++)
+    {
+        remap[id] = static_cast<quint16>(id);
+    }
+    return remap;
+}
+
+static int labelId(const QString& text, const Name2Labels& labels)
+{
+    bool number = false;
+    const int id = text.trimmed().toInt(&number);
+    if (number)
+    {
+        return id >= 0 && id <= WATERSHED_BORDER_ID ? id : -1;
+    }
+    const auto it = labels.find(text.trimmed());
+    return it == labels.end() ? -1 : it->id;
+}
+
+bool parseLabelRemap(const QString& text, const Name2Labels& labels, QVector<quint16>* remap, QString* error)
+{
+    for (const QString& pair : text.split(',', Qt::SkipEmptyParts))
+    {
+        const QStringList sides = pair.split('=');
+        const int from = sides.size() == 2 ? labelId(sides[0], labels) : -1;
+        const int to = sides.size() == 2 ? labelId(sides[1], labels) : -1;
+        if (from < 0 || to < 0)
+        {
+            *error = QString("Invalid label remap \"%1\"").arg(pair);
+            return false;
+        }
+        (*remap)[from] = static_cast<quint16>(to);
+    }
+    return true;
+}
+
+// Minimal ustar writer, members are added in order and padded to 512-byte blocks
+class TarWriter
+{
+public:
+    bool open(const QString& file)
+    {
+        _file.setFileName(file);
+        return _file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+    }
+
+    bool add(const QString& name, const QByteArray& data)
+    {
+        char header[512];
+        memset(header, 0, sizeof(header));
+        const QByteArray path = name.toUtf8();
+        memcpy(header, path.constData(), std::min<qsizetype>(path.size(), 99));
+        snprintf(header + 100, 8, "%07o", 0644);
+        snprintf(header + 108, 8, "%07o", 0);
+        snprintf(header + 116, 8, "%07o", 0);
+        snprintf(header + 124, 12, "%011llo", static_cast<unsigned long long>(data.size()));
+        snprintf(header + 136, 12, "%011o", 0);
+        header[156] = '0';
+        memcpy(header + 257, "ustar", 6);
+        memcpy(header + 263, "00", 2);
+        // The checksum is computed with its own field as spaces
+        memset(header + 148, ' ', 8);
+        unsigned int checksum = 0;
+        for (unsigned char c : header)
+        {
+            checksum += c;
+        }
+        snprintf(header + 148, 8, "%06o", checksum);
+        header[155] = ' ';
+
+        static const char padding[512] = {};
+        const qsizetype pad = (512 - data.size() % 512) % 512;
+        return _file.write(header, 512) == 512 && _file.write(data) == data.size()
+            && _file.write(padding, pad) == pad;
+    }
+
+    bool finish()
+    {
+        static const char end[1024] = {};
+        const bool ok = _file.write(end, sizeof(end)) == sizeof(end) && _file.flush();
+        _file.close();
+        return ok;
+    }
+
+private:
+    QFile _file;
+};
+
+// .npy file of a known shape whose rows are streamed in, one sample at a time
+class NpyWriter
+{
+public:
+    bool open(const QString& file, const QString& descr, const QString& shape)
+    {
+        _file.setFileName(file);
+        if (!_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        {
+            return false;
+        }
+        // Version 1.0 header, magic to newline padded to a multiple of 64 bytes
+        QByteArray header = QString("{'descr': '%1', 'fortran_order': False, 'shape': %2, }")
+                            .arg(descr, shape).toLatin1();
+        const qsizetype unpadded = 10 + header.size() + 1;
+        header.append(QByteArray((64 - unpadded % 64) % 64, ' '));
+        header.append('\n');
+        const quint16 length = static_cast<quint16>(header.size());
+        const char preamble[10] = {
+            '\x93', 'N', 'U', 'M', 'P', 'Y', 1, 0, static_cast<char>(length & 0xff), static_cast<char>(length >> 8)
+        };
+        return _file.write(preamble, 10) == 10 && _file.write(header) == header.size();
+    }
+
+    bool write(const cv::Mat& mat)
+    {
+        const qsizetype lineSize = qsizetype(mat.cols) * mat.elemSize();
+        for (int y = 0; y < mat.rows; y++)
+        {
+            if (_file.write(mat.ptr<char>(y), lineSize) != lineSize)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool finish()
+    {
+        const bool ok = _file.flush();
+        _file.close();
+        return ok;
+    }
+
+private:
+    QFile _file;
+};
+
+// Image and labels of a sample at the exported size, labels remapped; false when they can't be read
+static bool loadSample(const QString& file, const ShardExportOptions& options, cv::Mat* image, cv::Mat* labels)
+{
+    const QImage rgb = readRgbImage(file);
+    const QImage ids = readAnnotationLabels(file);
+    if (rgb.isNull() || ids.isNull() || rgb.size() != ids.size())
+    {
+        return false;
+    }
+    if (options.size.isValid())
+    {
+        const cv::Size size(options.size.width(), options.size.height());
+        const bool shrink = size.area() < rgb.width() * rgb.height();
+        cv::resize(matView(rgb), *image, size, 0, 0, shrink ? cv::INTER_AREA : cv::INTER_LINEAR);
+        cv::resize(matView(ids), *labels, size, 0, 0, cv::INTER_NEAREST);
+    }
+    else
+    {
+        *image = matView(rgb).clone();
+        *labels = matView(ids).clone();
+    }
+    const quint16* remap = options.remap.constData();
+    for (int y = 0; y < labels->rows; y++)
+    {
+        auto* line = labels->ptr<quint16>(y);
+        for (int x = 0; x < labels->cols; x++)
+        {
+            line[x] = remap[line[x]];
+        }
+    }
+    return true;
+}
+
+static QByteArray encodePng(const cv::Mat& mat)
+{
+    std::vector<uchar> buffer;
+    cv::Mat bgr;
+    if (mat.channels() == 3)
+    {
+        cv::cvtColor(mat, bgr, cv::COLOR_RGB2BGR);
+    }
+    else
+    {
+        bgr = mat;
+    }
+    cv::imencode(".png", bgr, buffer, {cv::IMWRITE_PNG_COMPRESSION, 1});
+    return QByteArray(reinterpret_cast<const char*>(buffer.data()), static_cast<qsizetype>(buffer.size()));
+}
+
+ShardExportJob::ShardExportJob(const ShardExportOptions& options, QObject* parent)
+    : QObject(parent), _options(options), _resumed(0), _written(0), _cancel(false)
+{
+    if (_options.remap.size() != WATERSHED_BORDER_ID + 1)
+    {
+        _options.remap = identityRemap();
+    }
+    connect(&_watcher, &QFutureWatcher<void>::progressValueChanged, this, &ShardExportJob::progressChanged);
+    connect(&_watcher, &QFutureWatcher<void>::finished, this, [this]()-> void
+    {
+        if (!_cancel)
+        {
+            writeIndex();
+        }
+        emit finished(_written, _cancel);
+    });
+}
+
+bool ShardExportJob::prepare(QString* error)
+{
+    if (!_options.webDataset && !_options.npy)
+    {
+        *error = "No shard format chosen";
+        return false;
+    }
+    if (_options.npy && !_options.size.isValid())
+    {
+        *error = ".npy stacks need a target size, every sample of a stack has the same shape";
+        return false;
+    }
+    if (_options.samplesPerShard < 1 || !QDir().mkpath(_options.output))
+    {
+        *error = "Can't create " + _options.output;
+        return false;
+    }
+
+    _files.clear();
+    QCryptographicHash sources(QCryptographicHash::Sha1);
+    for (const QString& directory : _options.directories)
+    {
+        for (const QString& name : listImageFiles(directory))
+        {
+            const QString file = QDir(directory).absoluteFilePath(name);
+            if (QFile::exists(siblingFile(file, "_watershed_mask.png")) || QFile::exists(siblingFile(file, "_mask.png")))
+            {
+                _files.append(file);
+                sources.addData(file.toUtf8());
+            }
+        }
+    }
+    if (_files.isEmpty())
+    {
+        *error = "No annotated image to export";
+        return false;
+    }
+
+    // Resuming is only safe on the very same export, the manifest records what it was
+    QJsonObject manifest;
+    manifest["version"] = MANIFEST_VERSION;
+    manifest["webdataset"] = _options.webDataset;
+    manifest["npy"] = _options.npy;
+    manifest["width"] = _options.size.isValid() ? _options.size.width() : 0;
+    manifest["height"] = _options.size.isValid() ? _options.size.height() : 0;
+    manifest["samples_per_shard"] = _options.samplesPerShard;
+    manifest["samples"] = _files.size();
+    manifest["sources"] = QString(sources.result().toHex());
+    manifest["remap"] = QString(QCryptographicHash::hash(
+        QByteArray(reinterpret_cast<const char*>(_options.remap.constData()),
+                   _options.remap.size() * qsizetype(sizeof(quint16))), QCryptographicHash::Sha1).toHex());
+    const QString manifestFile = _options.output + "/manifest.json";
+    QFile existing(manifestFile);
+    if (existing.open(QIODevice::ReadOnly))
+    {
+        if (QJsonDocument::fromJson(existing.readAll()).object() != manifest)
+        {
+            *error = _options.output + " holds another export, choose an empty directory";
+            return false;
+        }
+    }
+    else
+    {
+        QSaveFile file(manifestFile);
+        if (!file.open(QIODevice::WriteOnly) || file.write(QJsonDocument(manifest).toJson()) < 0 || !file.commit())
+        {
+            *error = "Can't write " + manifestFile;
+            return false;
+        }
+    }
+
+    _resumed = 0;
+    for (int shard = 0; shard < shards(); shard++)
+    {
+        _resumed += _isComplete(shard);
+    }
+    return true;
+}
+
+QString ShardExportJob::_shardPath(int shard, const QString& suffix) const
+{
+    return QString("%1/shard-%2%3").arg(_options.output).arg(shard, 6, 10, QChar('0')).arg(suffix);
+}
+
+bool ShardExportJob::_isComplete(int shard) const
+{
+    // The index part is written last
+    return QFile::exists(_shardPath(shard, ".csv"));
+}
+
+void ShardExportJob::start()
+{
+    _cancel = false;
+    _written = 0;
+    _pending.clear();
+    for (int shard = 0; shard < shards(); shard++)
+    {
+        if (!_isComplete(shard))
+        {
+            _pending.append(shard);
+        }
+    }
+    // One shard per worker, written sequentially: a worker only ever holds the sample it is on
+    _watcher.setFuture(JobScheduler::instance().map(JobClass::Background, _pending, [this](int shard)-> void
+    {
+        if (!_cancel && _writeShard(shard))
+        {
+            ++_written;
+        }
+    }));
+}
+
+void ShardExportJob::waitForFinished()
+{
+    _watcher.waitForFinished();
+}
+
+void ShardExportJob::cancel()
+{
+    _cancel = true;
+    _watcher.cancel();
+}
+
+bool ShardExportJob::_writeShard(int shard)
+{
+    const int first = shard * _options.samplesPerShard;
+    const int count = std::min<int>(_options.samplesPerShard, _files.size() - first);
+    const QString tarFile = _shardPath(shard, ".tar");
+    const QString imagesFile = _shardPath(shard, ".images.npy");
+    const QString labelsFile = _shardPath(shard, ".labels.npy");
+
+    TarWriter tar;
+    NpyWriter images;
+    NpyWriter labels;
+    bool ok = true;
+    if (_options.webDataset)
+    {
+        ok = tar.open(tarFile + ".part");
+    }
+    if (ok && _options.npy)
+    {
+        const int w = _options.size.width();
+        const int h = _options.size.height();
+        ok = images.open(imagesFile + ".part", "|u1", QString("(%1, %2, %3, 3)").arg(count).arg(h).arg(w))
+            && labels.open(labelsFile + ".part", "<u2", QString("(%1, %2, %3)").arg(count).arg(h).arg(w));
+    }
+
+    QString index;
+    for (int i = 0; i < count && ok; i++)
+    {
+        if (_cancel)
+        {
+            ok = false;
+            break;
+        }
+        const QString& file = _files[first + i];
+        const QString key = QString("%1").arg(first + i, 8, 10, QChar('0'));
+        cv::Mat image;
+        cv::Mat ids;
+        const bool valid = loadSample(file, _options, &image, &ids);
+        index += QString("%1,%2,%3,%4,\"%5\"\n").arg(key).arg(shard).arg(i).arg(valid ? 1 : 0)
+                 .arg(QString(file).replace("\"", "\"\""));
+        if (_options.webDataset && valid)
+        {
+            QJsonObject json;
+            json["source"] = file;
+            json["width"] = image.cols;
+            json["height"] = image.rows;
+            ok = tar.add(key + ".image.png", encodePng(image))
+                && tar.add(key + ".label.png", encodePng(ids))
+                && tar.add(key + ".json", QJsonDocument(json).toJson(QJsonDocument::Compact));
+        }
+        if (ok && _options.npy)
+        {
+            // Stacks have one row per sample, a sample that can't be read stays zero and is flagged in the index
+            if (!valid)
+            {
+                image = cv::Mat::zeros(_options.size.height(), _options.size.width(), CV_8UC3);
+                ids = cv::Mat::zeros(_options.size.height(), _options.size.width(), CV_16UC1);
+            }
+            ok = images.write(image) && labels.write(ids);
+        }
+    }
+
+    if (_options.webDataset)
+    {
+        ok = tar.finish() && ok;
+    }
+    if (_options.npy)
+    {
+        ok = images.finish() && ok;
+        ok = labels.finish() && ok;
+    }
+    const auto commit = [](const QString& file)-> bool
+    {
+        QFile::remove(file);
+        return QFile::rename(file + ".part", file);
+    };
+    if (ok && _options.webDataset)
+    {
+        ok = commit(tarFile);
+    }
+    if (ok && _options.npy)
+    {
+        ok = commit(imagesFile) && commit(labelsFile);
+    }
+    if (ok)
+    {
+        QSaveFile part(_shardPath(shard, ".csv"));
+        ok = part.open(QIODevice::WriteOnly | QIODevice::Text) && part.write(index.toUtf8()) >= 0 && part.commit();
+    }
+    if (!ok)
+    {
+        for (const QString& file : {tarFile, imagesFile, labelsFile})
+        {
+            QFile::remove(file + ".part");
+        }
+    }
+    return ok;
+}
+
+bool ShardExportJob::writeIndex()
+{
+    QSaveFile file(_options.output + "/index.csv");
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+        return false;
+    }
+    file.write("key,shard,row,valid,source\n");
+    for (int shard = 0; shard < shards(); shard++)
+    {
+        QFile part(_shardPath(shard, ".csv"));
+        if (!part.open(QIODevice::ReadOnly))
+        {
+            // Still incomplete, the index is written by the run that finishes the export
+            file.cancelWriting();
+            return false;
+        }
+        file.write(part.readAll());
+    }
+    return file.commit();
+}
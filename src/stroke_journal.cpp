@@ -0,0 +1,347 @@
+#include "stroke_journal.h"
+
+#include <QFileInfo>
+#include <QDir>
+#include <QDebug>
+#include <cstring>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+static const quint32 JOURNAL_MAGIC = 0x5041544a; // "PATJ"
+// Version 1 journals hold a subset of the records, they are still replayed
+static const quint16 JOURNAL_VERSION = 2;
+// Records are forced to disk at most once per interval, a crash loses at most that much work
+static const int JOURNAL_SYNC_INTERVAL_MS = 1000;
+
+StrokeJournal::StrokeJournal()
+{
+    _stream.setVersion(QDataStream::Qt_6_0);
+    _syncTimer.setSingleShot(true);
+    _syncTimer.setInterval(JOURNAL_SYNC_INTERVAL_MS);
+    QObject::connect(&_syncTimer, &QTimer::timeout, [this]()-> void
+    {
+        sync();
+    });
+}
+
+StrokeJournal::~StrokeJournal()
+{
+    sync();
+}
+
+QString StrokeJournal::journalPath(const QString& imageFile)
+{
+    QFileInfo file(imageFile);
+    return file.dir().absolutePath() + "/" + file.completeBaseName() + "_mask.journal";
+}
+
+void StrokeJournal::setFile(const QString& file, QSize size)
+{
+    sync();
+    _file.close();
+    _file.setFileName(file);
+    _size = size;
+}
+
+bool StrokeJournal::_beginRecord(RecordType type)
+{
+    if (!_file.isOpen())
+    {
+        if (_file.fileName().isEmpty() || !_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        {
+            return false;
+        }
+        _stream.setDevice(&_file);
+        _stream << JOURNAL_MAGIC << JOURNAL_VERSION << qint32(_size.width()) << qint32(_size.height());
+    }
+    _stream << quint8(type);
+    if (!_syncTimer.isActive())
+    {
+        _syncTimer.start();
+    }
+    return true;
+}
+
+void StrokeJournal::appendStroke(int id, int penSize, const QVector<QPoint>& positions)
+{
+    if (!_beginRecord(Stroke))
+    {
+        return;
+    }
+    _stream << quint16(id) << qint32(penSize) << quint32(positions.size());
+    for (const QPoint& p : positions)
+    {
+        _stream << qint32(p.x()) << qint32(p.y());
+    }
+}
+
+void StrokeJournal::appendFill(int id, QPoint position)
+{
+    if (!_beginRecord(Fill))
+    {
+        return;
+    }
+    _stream << quint16(id) << qint32(position.x()) << qint32(position.y());
+}
+
+void StrokeJournal::appendSpans(int id, const QVector<QLine>& spans)
+{
+    if (!_beginRecord(Spans))
+    {
+        return;
+    }
+    _stream << quint16(id) << quint32(spans.size());
+    for (const QLine& span : spans)
+    {
+        _stream << qint32(span.y1()) << qint32(span.x1()) << qint32(span.x2());
+    }
+}
+
+void StrokeJournal::appendSnapshot(const QImage& ids)
+{
+    if (!_beginRecord(Snapshot))
+    {
+        return;
+    }
+    QByteArray raw;
+    raw.reserve(ids.width() * ids.height() * sizeof(quint16));
+    for (int y = 0; y < ids.height(); y++)
+    {
+        raw.append(reinterpret_cast<const char*>(ids.constScanLine(y)), ids.width() * sizeof(quint16));
+    }
+    _stream << qCompress(raw, 1);
+}
+
+void StrokeJournal::appendStep()
+{
+    _beginRecord(Step);
+}
+
+void StrokeJournal::appendUndo()
+{
+    _beginRecord(Undo);
+}
+
+void StrokeJournal::appendRedo()
+{
+    _beginRecord(Redo);
+}
+
+void StrokeJournal::appendClear()
+{
+    _beginRecord(Clear);
+}
+
+void StrokeJournal::appendPaste(const QRect& rect, const QImage& ids)
+{
+    if (!_beginRecord(Paste))
+    {
+        return;
+    }
+    QByteArray raw;
+    raw.reserve(qsizetype(rect.width()) * rect.height() * sizeof(quint16));
+    for (int y = rect.top(); y <= rect.bottom(); y++)
+    {
+        raw.append(reinterpret_cast<const char*>(ids.constScanLine(y)) + rect.left() * sizeof(quint16),
+                   rect.width() * sizeof(quint16));
+    }
+    _stream << qint32(rect.x()) << qint32(rect.y()) << qint32(rect.width()) << qint32(rect.height())
+        << qCompress(raw, 1);
+}
+
+void StrokeJournal::sync()
+{
+    _syncTimer.stop();
+    if (!_file.isOpen())
+    {
+        return;
+    }
+    _file.flush();
+#ifdef Q_OS_WIN
+    _commit(_file.handle());
+#else
+    fsync(_file.handle());
+#endif
+}
+
+void StrokeJournal::remove()
+{
+    _syncTimer.stop();
+    _file.close();
+    if (!_file.fileName().isEmpty())
+    {
+        QFile::remove(_file.fileName());
+    }
+}
+
+int StrokeJournal::replay(const QString& file, ImageMask* mask, const Id2Labels& labels)
+{
+    QFile input(file);
+    if (!input.open(QIODevice::ReadOnly))
+    {
+        return -1;
+    }
+    QDataStream stream(&input);
+    stream.setVersion(QDataStream::Qt_6_0);
+
+    quint32 magic;
+    quint16 version;
+    qint32 width, height;
+    stream >> magic >> version >> width >> height;
+    if (stream.status() != QDataStream::Ok || magic != JOURNAL_MAGIC || version < 1 || version > JOURNAL_VERSION
+        || QSize(width, height) != mask->id.size())
+    {
+        qWarning() << "Ignoring journal" << file;
+        return -1;
+    }
+
+    auto colorMask = [&labels](quint16 id)-> ColorMask
+    {
+        const LabelInfo* label = labels[id];
+        return ColorMask{id, label ? label->color : QColor(255, 255, 255)};
+    };
+
+    // The undo steps the canvas had, replayed the same way so undo and redo records land on the same masks
+    QList<ImageMask> steps{*mask};
+    int step = 0;
+
+    // A record cut short by the crash leaves the stream past its end, everything before it is kept
+    int records = 0;
+    QVector<QPoint> positions;
+    while (!stream.atEnd())
+    {
+        quint8 type;
+        stream >> type;
+        if (type == Stroke)
+        {
+            quint16 id;
+            qint32 penSize;
+            quint32 count;
+            stream >> id >> penSize >> count;
+            if (stream.status() != QDataStream::Ok || count > quint32(input.size()))
+            {
+                break;
+            }
+            positions.resize(count);
+            for (QPoint& p : positions)
+            {
+                qint32 x, y;
+                stream >> x >> y;
+                p = QPoint(x, y);
+            }
+            if (stream.status() != QDataStream::Ok)
+            {
+                break;
+            }
+            if (penSize > 0)
+            {
+                mask->drawFillCircles(positions, penSize, colorMask(id));
+            }
+            else
+            {
+                mask->drawPixels(positions, colorMask(id));
+            }
+        }
+        else if (type == Fill)
+        {
+            quint16 id;
+            qint32 x, y;
+            stream >> id >> x >> y;
+            if (stream.status() != QDataStream::Ok)
+            {
+                break;
+            }
+            mask->exchangeLabel(x, y, labels, colorMask(id));
+        }
+        else if (type == Spans)
+        {
+            quint16 id;
+            quint32 count;
+            stream >> id >> count;
+            if (stream.status() != QDataStream::Ok || count > quint32(input.size()))
+            {
+                break;
+            }
+            QVector<QLine> spans(count);
+            for (QLine& span : spans)
+            {
+                qint32 y, x0, x1;
+                stream >> y >> x0 >> x1;
+                span = QLine(x0, y, x1, y);
+            }
+            if (stream.status() != QDataStream::Ok)
+            {
+                break;
+            }
+            mask->drawSpans(spans, colorMask(id));
+        }
+        else if (type == Snapshot)
+        {
+            QByteArray compressed;
+            stream >> compressed;
+            QByteArray raw = qUncompress(compressed);
+            if (stream.status() != QDataStream::Ok || raw.size() != qsizetype(width) * height * 2)
+            {
+                break;
+            }
+            const int lineSize = width * sizeof(quint16);
+            for (int y = 0; y < height; y++)
+            {
+                memcpy(mask->id.scanLine(y), raw.constData() + y * lineSize, lineSize);
+            }
+            mask->updateColor(labels);
+        }
+        else if (type == Step)
+        {
+            while (steps.size() > step + 1)
+            {
+                steps.removeLast();
+            }
+            steps.append(*mask);
+            step++;
+        }
+        else if (type == Undo || type == Redo)
+        {
+            // Steps trimmed from the canvas before the journal began aren't known, the mask then stays as it is
+            const int target = type == Undo ? step - 1 : step + 1;
+            if (target >= 0 && target < steps.size())
+            {
+                step = target;
+                *mask = steps[step];
+            }
+        }
+        else if (type == Clear)
+        {
+            *mask = ImageMask(mask->id.size());
+        }
+        else if (type == Paste)
+        {
+            qint32 x, y, w, h;
+            QByteArray compressed;
+            stream >> x >> y >> w >> h >> compressed;
+            const QRect rect(x, y, w, h);
+            QByteArray raw = qUncompress(compressed);
+            if (stream.status() != QDataStream::Ok || !mask->id.rect().contains(rect)
+                || raw.size() != qsizetype(w) * h * 2)
+            {
+                break;
+            }
+            const int lineSize = w * sizeof(quint16);
+            for (int row = 0; row < h; row++)
+            {
+                memcpy(mask->id.scanLine(y + row) + x * sizeof(quint16), raw.constData() + row * lineSize, lineSize);
+            }
+            mask->updateColor(labels);
+        }
+        else
+        {
+            break;
+        }
+        records++;
+    }
+    return records;
+}
@@ -1,60 +1,135 @@
 #include "utils.h"
+#include "plane_pool.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+
+#ifdef Q_OS_WIN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+#ifdef Q_OS_MACOS
+#include <mach/mach.h>
+#endif
 
 //-------------------------------------------------------------------------------------------------------------
-QImage mat2QImage(cv::Mat const& src)
+QImage readIdImage(const QString& file)
 {
-    cv::Mat temp; // make the same cv::Mat
-    cvtColor(src, temp, cv::COLOR_BGR2RGB); // cvtColor Makes a copt, that what i need
-    QImage dest(static_cast<const uchar*>(temp.data), temp.cols, temp.rows, static_cast<int>(temp.step),
-                QImage::Format_RGB888);
-    // enforce deep copy, see documentation of QImage::QImage ( const uchar * data, int width, int height, Format format )
-    dest.bits();
-    return dest;
+    cv::Mat mat = cv::imread(file.toStdString(), cv::IMREAD_UNCHANGED);
+    if (mat.empty())
+    {
+        return QImage();
+    }
+    if (mat.channels() > 1)
+    {
+        // Legacy masks repeat the id in every channel
+        cv::extractChannel(mat, mat, 0);
+    }
+    if (mat.depth() != CV_16U)
+    {
+        // The decoded file is dropped right away, the id plane is kept
+        cv::Mat ids;
+        ids.allocator = PlanePool::instance().matAllocator();
+        mat.convertTo(ids, CV_16U);
+        if (mat.depth() == CV_8U)
+        {
+            // 255 is the border of the 8-bit format, see storedIdMat
+            ids.setTo(WATERSHED_BORDER_ID, mat == 255);
+        }
+        return qImageView(ids);
+    }
+    return qImageView(mat);
 }
 
-cv::Mat qImage2Mat(QImage const& src)
+QImage readAnnotationLabels(const QString& imageFile)
 {
-    cv::Mat tmp(src.height(), src.width(), CV_8UC3, const_cast<uchar*>(src.bits()), src.bytesPerLine());
-    cv::Mat result; // deep copy just in case (my lack of knowledge with open cv)
-    cvtColor(tmp, result, cv::COLOR_BGR2RGB);
-    return result;
+    QImage ids = readIdImage(siblingFile(imageFile, "_watershed_mask.png"));
+    if (ids.isNull() || isFullZero(ids))
+    {
+        ids = readIdImage(siblingFile(imageFile, "_mask.png"));
+    }
+    return ids;
+}
+
+// What an id plane is stored as: 8-bit BGR as the tool always wrote, 16-bit only when an id needs it.
+// The 8-bit format keeps 255 for the watershed border, as the 8-bit watershed always wrote it, and readIdImage
+// maps it back to WATERSHED_BORDER_ID; a plane using 255 as a label id is stored on 16 bits.
+static cv::Mat storedIdMat(const QImage& image_id)
+{
+    bool wide = false;
+    for (int y = 0; y < image_id.height() && !wide; y++)
+    {
+        const auto* line = reinterpret_cast<const quint16*>(image_id.constScanLine(y));
+        for (int x = 0; x < image_id.width(); x++)
+        {
+            if (line[x] >= 255 && line[x] != WATERSHED_BORDER_ID)
+            {
+                wide = true;
+                break;
+            }
+        }
+    }
+
+    cv::Mat ids = matView(image_id);
+    if (wide)
+    {
+        return ids;
+    }
+    // Saturation turns the border id into 255
+    cv::Mat narrow, rgb;
+    ids.convertTo(narrow, CV_8U);
+    cv::cvtColor(narrow, rgb, cv::COLOR_GRAY2BGR);
+    return rgb;
+}
+
+bool writeIdImage(const QImage& image_id, const QString& file)
+{
+    return cv::imwrite(file.toStdString(), storedIdMat(image_id));
+}
+
+QByteArray encodeIdImage(const QImage& image_id)
+{
+    std::vector<uchar> buffer;
+    if (!cv::imencode(".png", storedIdMat(image_id), buffer))
+    {
+        return QByteArray();
+    }
+    return QByteArray(reinterpret_cast<const char*>(buffer.data()), static_cast<qsizetype>(buffer.size()));
 }
 
 QImage idToColor(const QImage& image_id, const Id2Labels& id_label)
 {
-    QImage result(image_id.size(), QImage::Format_RGB888);
+    QImage result = PlanePool::instance().image(image_id.size(), QImage::Format_RGB888);
     idToColor(image_id, id_label, &result);
     return result;
 }
 
 void idToColor(const QImage& image_id, const Id2Labels& id_label, QImage* result)
 {
-    uchar* pix;
+    // Every pixel is written, a buffer still shared e.g. with an undo state is replaced rather than copied
+    if (result->size() != image_id.size() || result->format() != QImage::Format_RGB888 || !result->isDetached())
+    {
+        *result = PlanePool::instance().image(image_id.size(), QImage::Format_RGB888);
+    }
+
+    const QRgb* palette = id_label.palette();
     for (int y = 0; y < image_id.height(); y++)
     {
-        const uchar* line_in = image_id.scanLine(y);
-        uchar* line_out = result->scanLine(y);
-        for (int x = 0; x < image_id.width() * 3; x += 3)
+        const auto* line_in = reinterpret_cast<const quint16*>(image_id.constScanLine(y));
+        uchar* pix = result->scanLine(y);
+        for (int x = 0; x < image_id.width(); x++, pix += 3)
         {
-            int id = line_in[x];
-            QMap<int, const LabelInfo*>::const_iterator it = id_label.find(id);
-            if (it != id_label.end())
-            {
-                pix = &line_out[x];
-                const LabelInfo* label = *it;
-                *pix = label->color.red();
-                pix++;
-                *pix = label->color.green();
-                pix++;
-                *pix = label->color.blue();
-            }
-            else
-            {
-                pix = &line_out[x];
-                pix[0] = 255;
-                pix[1] = 255;
-                pix[2] = 255;
-            }
+            const QRgb color = palette[line_in[x]];
+            pix[0] = qRed(color);
+            pix[1] = qGreen(color);
+            pix[2] = qBlue(color);
         }
     }
 }
@@ -82,6 +157,91 @@ QColor invColor(const QColor& color)
     return color_inv;
 }
 
+bool isImageFile(const QString& fileName)
+{
+    static const QStringList ext_img = {"png", "jpg", "bmp", "pgm", "jpeg", "jpe", "jp2", "pbm", "ppm", "tiff", "tif"};
+    if (fileName.size() < 4)
+    {
+        return false;
+    }
+    if (!ext_img.contains(fileName.section(".", -1, -1).toLower()))
+    {
+        return false;
+    }
+    return fileName.toLower().indexOf("_mask.png") == -1;
+}
+
+QStringList listImageFiles(const QString& directory)
+{
+    QStringList images;
+    for (const QString& file : QDir(directory).entryList(QDir::Files, QDir::Name))
+    {
+        if (isImageFile(file))
+        {
+            images.append(file);
+        }
+    }
+    return images;
+}
+
+QString siblingFile(const QString& imageFile, const QString& suffix)
+{
+    QFileInfo file(imageFile);
+    return file.dir().absolutePath() + "/" + file.completeBaseName() + suffix;
+}
+
+qint64 peakMemoryUsage()
+{
+#ifdef Q_OS_WIN
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+#ifdef Q_OS_MACOS
+    return usage.ru_maxrss;
+#else
+    return qint64(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+qint64 currentMemoryUsage()
+{
+#if defined(Q_OS_WIN)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return counters.WorkingSetSize;
+    }
+    return 0;
+#elif defined(Q_OS_MACOS)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS)
+    {
+        return 0;
+    }
+    return info.resident_size;
+#else
+    // Program size then resident size, in pages
+    QFile statm("/proc/self/statm");
+    if (!statm.open(QIODevice::ReadOnly))
+    {
+        return 0;
+    }
+    const QList<QByteArray> fields = statm.readAll().split(' ');
+    return fields.size() > 1 ? fields[1].toLongLong() * sysconf(_SC_PAGESIZE) : 0;
+#endif
+}
+
 int rgbToInt(uchar r, uchar g, uchar b)
 {
     return (r << 16) + (g << 8) + b;
@@ -89,9 +249,9 @@ int rgbToInt(uchar r, uchar g, uchar b)
 
 void intToRgb(int value, uchar& r, uchar& g, uchar& b)
 {
-    r = (value >> 16) & 0x000f;
-    g = (value >> 8) & 0x000f;
-    b = (value >> 0) & 0x000f;
+    r = (value >> 16) & 0x00ff;
+    g = (value >> 8) & 0x00ff;
+    b = (value >> 0) & 0x00ff;
 }
 
 QVector<QColor> colorMap(int size)
@@ -111,30 +271,23 @@ QVector<QColor> colorMap(int size)
     return res;
 }
 
-cv::Mat convertMat32StoRGBC3(const cv::Mat& mat)
+cv::Mat convertMat32StoId16(const cv::Mat& mat)
 {
-    cv::Mat dst(mat.size(), CV_8UC3);
-    uchar* pix;
-    uchar label;
+    cv::Mat dst = PlanePool::instance().mat(mat.rows, mat.cols, CV_16UC1);
     for (int r = 0; r < dst.rows; ++r)
     {
         const int* ptr = mat.ptr<int>(r);
-        uchar* ptr_dst = dst.ptr<uchar>(r);
+        auto* ptr_dst = dst.ptr<quint16>(r);
         for (int c = 0; c < dst.cols; ++c)
         {
-            label = ptr[c];
-            pix = &ptr_dst[c * 3];
-            if (label > 0)
+            const int label = ptr[c];
+            if (label < 0)
             {
-                pix[0] = label;
-                pix[1] = label;
-                pix[2] = label;
+                ptr_dst[c] = WATERSHED_BORDER_ID;
             }
             else
             {
-                pix[0] = 0;
-                pix[1] = 0;
-                pix[2] = 0;
+                ptr_dst[c] = static_cast<quint16>(std::min(label, MAX_LABEL_ID));
             }
         }
     }
@@ -143,38 +296,26 @@ cv::Mat convertMat32StoRGBC3(const cv::Mat& mat)
 
 QImage watershed(const QImage& qimage, const QImage& qmarkers_mask)
 {
-    cv::Mat image = qImage2Mat(qimage);
-    cv::Mat markers_mask = qImage2Mat(qmarkers_mask);
-    cv::Mat markers = cv::Mat::zeros(markers_mask.size(), CV_32S);
-    for (int y = 0; y < markers_mask.rows; y++)
-    {
-        int* mark = markers.ptr<int>(y);
-        auto* mask = markers_mask.ptr<cv::Vec3b>(y);
-        for (int x = 0; x < markers_mask.cols; x++)
-        {
-            mark[x] = mask[x][0];
-        }
-    }
-    cv::watershed(image, markers);
-    cv::Mat new_mask = convertMat32StoRGBC3(markers);
-    return mat2QImage(new_mask);
+    // The watershed only compares channels with each other, it runs on the RGB pixels as they are
+    cv::Mat markers = PlanePool::instance().mat(qmarkers_mask.height(), qmarkers_mask.width(), CV_32S);
+    matView(qmarkers_mask).convertTo(markers, CV_32S);
+    cv::watershed(matView(qimage), markers);
+    return qImageView(convertMat32StoId16(markers));
 }
 
 QImage removeBorder(const QImage& mask_id, const Id2Labels& labels, cv::Size win_size)
 {
-    QImage result = mask_id.copy();
+    QImage result = PlanePool::instance().copy(mask_id);
 
     // loop through image
     for (int y = 0; y < mask_id.height(); y++)
     {
-        const uchar* line_curr = mask_id.scanLine(y);
-        uchar* line_out = result.scanLine(y);
-        for (int X = 0; X < mask_id.width(); X++)
+        const auto* line_curr = reinterpret_cast<const quint16*>(mask_id.constScanLine(y));
+        auto* line_out = reinterpret_cast<quint16*>(result.scanLine(y));
+        for (int x = 0; x < mask_id.width(); x++)
         {
-            // multiply by 3 to match RGB
-            int x = X * 3;
             int id = line_curr[x];
-            if (labels.find(id) == labels.end())
+            if (!labels.contains(id))
             {
                 // map id # to amount of occurences
                 std::map<int, int> mapk;
@@ -183,22 +324,22 @@ QImage removeBorder(const QImage& mask_id, const Id2Labels& labels, cv::Size win
                 {
                     int yyy = y + yy;
                     if (yyy < 0 || yyy >= mask_id.height()) continue;
-                    const uchar* l_curr = mask_id.scanLine(yyy);
+                    const auto* l_curr = reinterpret_cast<const quint16*>(mask_id.constScanLine(yyy));
                     for (int xx = -(win_size.width >> 1); xx <= win_size.width >> 1; xx++)
                     {
-                        int xxx = x + xx * 3;
-                        if (xxx < 0 || xxx >= mask_id.width() * 3) continue;
+                        int xxx = x + xx;
+                        if (xxx < 0 || xxx >= mask_id.width()) continue;
                         if ((yyy == y && xxx == x)) continue;
-                        if (mapk.find(l_curr[xxx]) != mapk.end()) mapk[l_curr[xxx]]++;
-                        else mapk[l_curr[xxx]] = 1;
+                        mapk[l_curr[xxx]]++;
                     }
                 }
+                if (mapk.empty()) continue;
                 int id_max = 0;
                 int id_resul = mapk.begin()->first;
                 std::map<int, int>::iterator it = mapk.begin();
                 while (it != mapk.end())
                 {
-                    if (it->first != 255)
+                    if (it->first != WATERSHED_BORDER_ID)
                     {
                         if (it->second > id_max)
                         {
@@ -209,8 +350,6 @@ QImage removeBorder(const QImage& mask_id, const Id2Labels& labels, cv::Size win
                     it++;
                 }
                 line_out[x] = id_resul;
-                line_out[x + 1] = id_resul;
-                line_out[x + 2] = id_resul;
             }
         }
     }
@@ -219,10 +358,12 @@ QImage removeBorder(const QImage& mask_id, const Id2Labels& labels, cv::Size win
 
 bool isFullZero(const QImage& image)
 {
+    // Pixels only: the padding at the end of the lines of a recycled plane may hold another image's data
+    const qsizetype lineSize = qsizetype(image.width()) * image.depth() / 8;
     for (int y = 0; y < image.height(); y++)
     {
-        const uchar* line = image.scanLine(y);
-        for (int x = 0; x < image.bytesPerLine(); x++)
+        const uchar* line = image.constScanLine(y);
+        for (qsizetype x = 0; x < lineSize; x++)
         {
             if (line[x] > 0)
             {
@@ -233,4 +374,15 @@ bool isFullZero(const QImage& image)
     return true;
 }
 
+size_t contentHash(const QImage& image)
+{
+    const size_t lineSize = static_cast<size_t>(image.width()) * image.depth() / 8;
+    size_t hash = qHashMulti(0, image.width(), image.height(), static_cast<int>(image.format()));
+    for (int y = 0; y < image.height(); y++)
+    {
+        hash = qHashBits(image.constScanLine(y), lineSize, hash);
+    }
+    return hash;
+}
+
 //-------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,63 @@
+#include "watershed_cache.h"
+
+#include <QHash>
+
+WatershedCache::WatershedCache(qint64 budgetBytes) : _bytes(0), _budget(budgetBytes)
+{}
+
+quint64 WatershedCache::key(const QImage& markers, bool keepBorder, const QString& engine)
+{
+    size_t seed = qHashMulti(0, markers.width(), markers.height(), keepBorder, engine);
+    const qsizetype lineSize = qsizetype(markers.width()) * markers.depth() / 8;
+    for (int y = 0; y < markers.height(); y++)
+    {
+        seed = qHashBits(markers.constScanLine(y), lineSize, seed);
+    }
+    return seed;
+}
+
+bool WatershedCache::find(quint64 key, QImage* result)
+{
+    for (int i = 0; i < _entries.size(); i++)
+    {
+        if (_entries[i].key == key)
+        {
+            _entries.move(i, 0);
+            *result = _entries.first().result;
+            return true;
+        }
+    }
+    return false;
+}
+
+void WatershedCache::insert(quint64 key, const QImage& result)
+{
+    const qint64 size = result.sizeInBytes();
+    if (size > _budget)
+    {
+        return;
+    }
+    _entries.prepend(Entry{key, result});
+    _bytes += size;
+    while (_bytes > _budget)
+    {
+        _bytes -= _entries.last().result.sizeInBytes();
+        _entries.removeLast();
+    }
+}
+
+QList<QImage> WatershedCache::results() const
+{
+    QList<QImage> results;
+    for (const Entry& entry : _entries)
+    {
+        results.append(entry.result);
+    }
+    return results;
+}
+
+void WatershedCache::clear()
+{
+    _entries.clear();
+    _bytes = 0;
+}